@@ -15,6 +15,8 @@
 #include <iostream>
 #include <fstream>
 #include <cstddef>
+#include <cstdint>
+#include <string>
 #include <variant>
 #include <vector>
 
@@ -31,6 +33,41 @@ struct ConfigSphere {
   float x, y, z, vx, vy, vz, m, r;
 };
 
+/*
+ * A binary body file holds a header followed by
+ * a flat array of spheres, laid out exactly like
+ * ConfigSphere. Files are memory-mapped rather
+ * than read, so the engine can copy bodies
+ * straight from the page cache into its arrays
+ * (in parallel) without ever building the
+ * intermediate vector of variants.
+ */
+struct BodyFileHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t reserved;
+  std::uint64_t num_bodies;
+};
+
+class BodyFile {
+public:
+  BodyFile();
+  BodyFile(BodyFile&& other) noexcept;
+  BodyFile& operator=(BodyFile&& other) noexcept;
+  BodyFile(const BodyFile&) = delete;
+  BodyFile& operator=(const BodyFile&) = delete;
+  ~BodyFile();
+
+  int open(const std::string& file_name);
+  const ConfigSphere* data() const;
+  std::size_t size() const;
+
+private:
+  void *mapping;
+  std::size_t mapping_size;
+  std::size_t num_bodies;
+};
+
 /*
  * Config struct representing a user config. We
  * don't read our input file on construction as
@@ -39,18 +76,39 @@ struct ConfigSphere {
  * Contains a couple fields for simulation
  * constants, and a vector of variants of config
  * bodies (representing the bodies we want to
- * spawn in our simulation).
+ * spawn in our simulation). Bodies that come from
+ * body files are kept separately, since they are
+ * loaded directly by the engine.
  */
 struct Config {
-  explicit Config(char *json_file_name_i) : json_file_name(json_file_name_i), grav_constant(0.0f), elasticity(0.0f), speed(1.0f), ticks_per_frame(1), num_bodies(0), boundary{} {}
+  explicit Config(char *json_file_name_i) : json_file_name(json_file_name_i), grav_constant(0.0f), mutual_grav_constant(0.0f), opening_angle(0.5f), softening(0.01f), elasticity(0.0f), friction(0.0f), ccd_speed(0.0f), speed(1.0f), ticks_per_frame(1), cfl(0.0f), max_ticks_per_frame(64), checkpoint_interval(0), publish_interval(1), stats_interval(1), reorder_interval(0), record_interval(1), loose_octree(false), num_bodies(0), boundary{}, seed(0), random_stream(0) {}
   int process_body(const Json::Value &root);
   int initialize();
+  int initialize(const Json::Value &root);
   char *json_file_name;
   float grav_constant;
+  float mutual_grav_constant;
+  float opening_angle;
+  float softening;
   float elasticity;
+  float friction;
+  float ccd_speed;
   float speed;
   std::size_t ticks_per_frame;
+  float cfl;
+  std::size_t max_ticks_per_frame;
+  std::size_t checkpoint_interval;
+  std::string publish_name;
+  std::size_t publish_interval;
+  std::string stats_file;
+  std::size_t stats_interval;
+  std::size_t reorder_interval;
+  std::size_t record_interval;
+  bool loose_octree;
   std::size_t num_bodies;
   float boundary[6];
   std::vector<std::variant<ConfigSphere>> bodies;
+  std::vector<BodyFile> body_files;
+  std::uint64_t seed;
+  std::uint32_t random_stream;
 };
@@ -0,0 +1,150 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#pragma once
+
+#include <iostream>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <json/json.h>
+
+#include <physics/engine.h>
+#include <cli.h>
+
+/*
+ * A transport moves messages between the
+ * processes (ranks) of a distributed run. Ranks
+ * only ever talk to their neighbors, rank - 1 and
+ * rank + 1. exchange sends out to a neighbor
+ * while receiving in from it, so that two
+ * neighbors exchanging at once never wait on
+ * each other.
+ */
+class Transport {
+public:
+  virtual ~Transport() = default;
+  virtual int get_rank() const = 0;
+  virtual int get_size() const = 0;
+  virtual int exchange(const int peer, const std::vector<char>& out, std::vector<char>& in) = 0;
+};
+
+/*
+ * Transport over Unix stream sockets, one per
+ * neighbor (-1 where there is none). Messages
+ * are sent with their length in front.
+ */
+class SocketTransport : public Transport {
+public:
+  SocketTransport(const int rank_i, const int size_i, const int left_fd_i, const int right_fd_i);
+  SocketTransport(const SocketTransport&) = delete;
+  SocketTransport& operator=(const SocketTransport&) = delete;
+  ~SocketTransport() override;
+  int get_rank() const override;
+  int get_size() const override;
+  int exchange(const int peer, const std::vector<char>& out, std::vector<char>& in) override;
+
+  /*
+   * Start a local run over size processes. The
+   * calling process becomes rank 0, and every
+   * other rank is a fresh process running
+   * worker_args followed by its rank, size and
+   * socket descriptors. wait_workers waits for
+   * them all to exit.
+   */
+  static std::unique_ptr<SocketTransport> spawn_workers(const int size, const std::vector<std::string>& worker_args);
+  int wait_workers();
+
+private:
+  int rank, size, left_fd, right_fd;
+  std::vector<pid_t> workers;
+};
+
+/*
+ * A body on the move between ranks, named by
+ * its global ID (its place in the config).
+ */
+struct DomainBody {
+  std::uint32_t global_id;
+  BodyState state;
+};
+
+/*
+ * A distributed run splits the boundary box along
+ * x into slabs, one per rank. Every rank runs its
+ * own engine on the bodies in its slab, plus
+ * copies (ghosts) of the neighbors' bodies close
+ * enough to touch its own this tick, which are
+ * thrown away again after the tick. Bodies that
+ * leave a slab move to the neighbor. Every
+ * BALANCE_INTERVAL ticks, neighbors move the
+ * boundary between them towards the rank with
+ * more bodies.
+ *
+ * The config JSON gains a DISTRIBUTED object with
+ * how many TICKS to run, how long each tick is
+ * (DT) and BALANCE_INTERVAL (0 never balances).
+ * Every rank reads the same config, and seed is
+ * used as its SEED if it has none, so that all
+ * ranks generate the same scene.
+ */
+class Domain {
+public:
+  Domain(char *json_file_name_i, Transport &transport_i, const std::uint64_t seed_i);
+  int initialize();
+  int step();
+  int run();
+  int save(const std::string& file_name);
+  float get_slab_min() const;
+  float get_slab_max() const;
+  std::size_t get_num_owned() const;
+  const std::vector<DomainBody> &get_result() const;
+private:
+  char *json_file_name;
+  Transport &transport;
+  std::uint64_t seed;
+  Config config;
+  std::unique_ptr<Engine> engine;
+  std::size_t ticks, balance_interval, tick;
+  float dt;
+
+  /*
+   * This rank owns bodies with slab_min <= x <
+   * slab_max (the first and last slabs reach
+   * past the boundary box, for bodies that are
+   * pushed out of it).
+   */
+  float slab_min, slab_max;
+  float max_radius;
+
+  /*
+   * Global IDs of our bodies, by engine ID, and
+   * the engine IDs of this tick's ghosts.
+   */
+  std::vector<std::uint32_t> global_of;
+  std::vector<unsigned int> ghost_ids;
+
+  /*
+   * After run, every body of the simulation (on
+   * rank 0), in global ID order.
+   */
+  std::vector<DomainBody> result;
+
+  int balance();
+  int ghost_reach(float reach[2]);
+  int add_received(const std::vector<char>& in);
+};
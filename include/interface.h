@@ -16,9 +16,17 @@
 #include <variant>
 #include <math.h>
 #include <tuple>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#include <omp.h>
 
 #include <GL/gl.h>
 #include <GLFW/glfw3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -35,6 +43,31 @@
 void mouse_callback(GLFWwindow* window, double x, double y);
 void resize_callback(GLFWwindow* window, int width, int height);
 
+/*
+ * What the vertex shader needs to know about each
+ * instance it draws: pos holds the position and
+ * radius, rot the orientation as a quaternion
+ * (x, y, z, w). Must match the layout of the
+ * shader's storage buffer.
+ */
+struct InstanceData {
+  glm::vec4 pos;
+  glm::vec4 rot;
+};
+
+/*
+ * How many frames of instance data we keep, so that
+ * we can write one frame while the GPU still reads
+ * the previous ones.
+ */
+static constexpr unsigned int FRAMES_IN_FLIGHT = 3;
+
+/*
+ * How many levels of detail we keep for the sphere
+ * mesh. LOD i is the icosphere refined i times.
+ */
+static constexpr unsigned int NUM_LODS = 4;
+
 /*
  * Represents the graphics context for the program.
  * This class is responsible for initializing all
@@ -45,27 +78,49 @@ void resize_callback(GLFWwindow* window, int width, int height);
  * can retrieve an error code. The public interface
  * is sparse - all that our main function needs to
  * do is call render_tick and check if we should_close
- * the simulation. 
+ * the simulation. Without a display, initialize_headless
+ * and export_frame take the place of initialize and
+ * render_tick.
  */
 class Graphics {
 public:
   explicit Graphics(Engine &engine_i);
   ~Graphics();
   int initialize();
+  int initialize_headless(const int frame_width, const int frame_height);
   void render_tick(const float dt);
+  const std::vector<unsigned char>& export_frame();
+  int get_width() const;
+  int get_height() const;
   bool should_close() const;
 private:
   GLFWwindow *window;
+
+  /*
+   * When drawing offscreen, we have an EGL context
+   * instead of a window, and draw into a framebuffer
+   * object (a color and a depth renderbuffer). Frames
+   * are read back into frame_pixels.
+   */
+  EGLDisplay egl_display;
+  EGLContext egl_context;
+  EGLSurface egl_surface;
+  unsigned int fbo, fbo_renderbuffers[2];
+  std::vector<unsigned char> frame_pixels;
+
   Engine &engine;
 
+  int initialize_pipeline();
+  void draw_frame();
+
   /*
-   * Part of our initialization is creating an icosphere
-   * mesh - this is used for rendering approximate 
-   * spheres.
+   * Part of our initialization is creating icosphere
+   * meshes - these are used for rendering approximate 
+   * spheres, one mesh per level of detail.
    */
-  unsigned int num_pts, num_tris;
+  unsigned int lod_tris[NUM_LODS];
   std::pair<unsigned int, unsigned int> calc_icosphere_size(const unsigned int iters) const;
-  std::pair<std::vector<float>, std::vector<unsigned int>> create_icosphere_mesh();
+  std::pair<std::vector<float>, std::vector<unsigned int>> create_icosphere_mesh(const unsigned int iters);
 
   /*
    * Helpers for initializing meshes.
@@ -77,32 +132,69 @@ private:
    * Members representing parts of our OpenGL pipeline.
    * OpenGL represents these objects externally as integers.
    */
-  unsigned int sphereVAO, sphereVBO, sphereEBO;
+  unsigned int sphereVAOs[NUM_LODS], sphereVBOs[NUM_LODS], sphereEBOs[NUM_LODS];
   unsigned int wallsVAO, wallsVBO, wallsEBO;
-  unsigned int vertex_shader, fragment_shader, shader_program;
-  int proj_view_loc, model_loc, normal_loc;
+  unsigned int shader_program;
+  int proj_view_loc;
+  int create_shader_program(const char* const vertex_shader_text, const char* const fragment_shader_text, unsigned int& program);
+
+  /*
+   * Impostor mode draws each body as one quad and ray
+   * casts its sphere per fragment, which is far less
+   * vertex work than a mesh when there are millions
+   * of bodies. Impostors have no vertex attributes,
+   * so their VAO stays empty.
+   */
+  bool impostors;
+  unsigned int impostor_program, impostorVAO;
+  int impostor_proj_view_loc, impostor_cam_pos_loc;
 
   /*
    * Members representing math constants - that is, elements
    * that don't change frequently.
    */
-  glm::mat4 proj, identity;
+  glm::mat4 proj;
   glm::vec3 cup;
   
   /*
-   * Arrays where we store our model and normal matrix
-   * calculations each frame, so that we can multithread
-   * this calculation and refer to them later when we
-   * make OpenGL API calls.
+   * Instance data lives in a shader storage buffer that
+   * stays mapped for its whole lifetime, split into one
+   * section per frame in flight. Each frame, we write
+   * the next section straight from the body arrays (in
+   * parallel), and fence it once its draws are issued.
+   * A section's first instance is the walls', the rest
+   * are the visible bodies', grouped by level of detail,
+   * so each level goes out in a single draw call.
    */
-  glm::mat4* model_cache;
-  glm::mat4* normal_cache;
+  unsigned int instance_buffer;
+  InstanceData* instance_map;
+  std::size_t instance_capacity, section_instances;
+  GLsync fences[FRAMES_IN_FLIGHT];
+  unsigned int frame;
+  int allocate_instance_buffer(const std::size_t capacity);
+  void wait_for_section(const unsigned int section);
+
+  /*
+   * Scratch space for culling: the level of detail
+   * of each body this frame (NUM_LODS if culled),
+   * and how many bodies each thread put in each
+   * level.
+   */
+  std::vector<unsigned char> body_lods;
+  std::vector<std::array<std::size_t, NUM_LODS>> thread_lod_counts;
 
   /*
    * Camera position & rotation.
    */
   float cx, cy, cz, cphi, ctheta;
 
-  bool released_enter = true, released_left = true, released_right = true;
+  bool released_enter = true, released_left = true, released_right = true, released_i = true;
   void handle_input(float dt);
+
+  /*
+   * With adaptive substepping, the window title
+   * shows how many ticks the last frame took.
+   */
+  std::size_t shown_frame_ticks = 0;
+  void show_frame_ticks();
 };
@@ -12,7 +12,7 @@
 
 #pragma once
 
-#include <fstream>
+#include <iostream>
 #include <memory>
 
 #include <math.h>
@@ -36,12 +36,16 @@ Transform operator/(const Transform& a, float b);
 /*
  * A response to a collision query -  tells us more
  * than just whether a collision occurred so that we
- * can properly respond to the collision.
+ * can properly respond to the collision. Swept
+ * queries also report the time of impact, as a
+ * fraction of the sweep (0 if the colliders
+ * already touched at the start).
  */
 struct CollisionResponse {
   Transform normal;
   float depth;
   bool collides;
+  float toi = 0.0f;
 };
 
 enum class ColliderType { Sphere, Wall };
@@ -56,12 +60,20 @@ struct WallCollider;
  * make a concrete collision check). Colliders
  * store attributes unique to the type of body.
  * For example, sphere colliders store a radius.
+ * Swept checks move both colliders in a straight
+ * line from their start to their end transforms,
+ * and find the first contact along the way, so
+ * that fast bodies can't pass through each other
+ * between ticks.
  */
 struct Collider {
   virtual CollisionResponse checkCollision(const Collider& other, const Transform& myPos, const Transform& otherPos) const = 0;
   virtual CollisionResponse checkCollision(const SphereCollider& other, const Transform& myPos, const Transform& otherPos) const = 0;
   virtual CollisionResponse checkCollision(const WallCollider& other, const Transform& myPos, const Transform& otherPos) const = 0;
-  virtual void serialize(std::fstream& fs) const = 0;
+  virtual CollisionResponse checkSweptCollision(const Collider& other, const Transform& myStart, const Transform& myEnd, const Transform& otherStart, const Transform& otherEnd) const = 0;
+  virtual CollisionResponse checkSweptCollision(const SphereCollider& other, const Transform& myStart, const Transform& myEnd, const Transform& otherStart, const Transform& otherEnd) const = 0;
+  virtual CollisionResponse checkSweptCollision(const WallCollider& other, const Transform& myStart, const Transform& myEnd, const Transform& otherStart, const Transform& otherEnd) const = 0;
+  virtual void serialize(std::ostream& out) const = 0;
   virtual ~Collider() = default;
 };
 
@@ -71,7 +83,10 @@ struct SphereCollider : public Collider {
   virtual CollisionResponse checkCollision(const Collider& other, const Transform& myPos, const Transform& otherPos) const override;
   virtual CollisionResponse checkCollision(const SphereCollider& other, const Transform& myPos, const Transform& otherPos) const override;
   virtual CollisionResponse checkCollision(const WallCollider& other, const Transform& myPos, const Transform& otherPos) const override;
-  virtual void serialize(std::fstream& fs) const override;
+  virtual CollisionResponse checkSweptCollision(const Collider& other, const Transform& myStart, const Transform& myEnd, const Transform& otherStart, const Transform& otherEnd) const override;
+  virtual CollisionResponse checkSweptCollision(const SphereCollider& other, const Transform& myStart, const Transform& myEnd, const Transform& otherStart, const Transform& otherEnd) const override;
+  virtual CollisionResponse checkSweptCollision(const WallCollider& other, const Transform& myStart, const Transform& myEnd, const Transform& otherStart, const Transform& otherEnd) const override;
+  virtual void serialize(std::ostream& out) const override;
 };
 
 struct WallCollider : public Collider {
@@ -80,7 +95,10 @@ struct WallCollider : public Collider {
   virtual CollisionResponse checkCollision(const Collider& other, const Transform& myPos, const Transform& otherPos) const override;
   virtual CollisionResponse checkCollision(const SphereCollider& other, const Transform& myPos, const Transform& otherPos) const override;
   virtual CollisionResponse checkCollision(const WallCollider& other, const Transform& myPos, const Transform& otherPos) const override;
-  virtual void serialize(std::fstream& fs) const override;
+  virtual CollisionResponse checkSweptCollision(const Collider& other, const Transform& myStart, const Transform& myEnd, const Transform& otherStart, const Transform& otherEnd) const override;
+  virtual CollisionResponse checkSweptCollision(const SphereCollider& other, const Transform& myStart, const Transform& myEnd, const Transform& otherStart, const Transform& otherEnd) const override;
+  virtual CollisionResponse checkSweptCollision(const WallCollider& other, const Transform& myStart, const Transform& myEnd, const Transform& otherStart, const Transform& otherEnd) const override;
+  virtual void serialize(std::ostream& out) const override;
 };
 
-std::unique_ptr<Collider> deserialize_collider(std::fstream& fs);
+std::unique_ptr<Collider> deserialize_collider(std::istream& in);
@@ -13,7 +13,11 @@
 #pragma once
 
 #include <immintrin.h>
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <numeric>
 #include <variant>
 #include <vector>
 #include <memory>
@@ -30,8 +34,25 @@
 #include <physics/quaternion.h>
 #include <physics/collider.h>
 #include <physics/octree.h>
+#include <physics/shared_state.h>
+#include <physics/stats.h>
 #include <cli.h>
 
+/*
+ * The full state of one body, for moving bodies
+ * from one engine to another.
+ */
+struct BodyState {
+  float x, y, z, vx, vy, vz, qw, qx, qy, qz, wx, wy, wz, m, r;
+};
+
+/*
+ * Just what it takes to draw one body.
+ */
+struct BodyPose {
+  float x, y, z, qw, qx, qy, qz;
+};
+
 /*
  * Engine represents the physics world we are
  * simulating. We are using data oriented design,
@@ -49,10 +70,82 @@ public:
   explicit Engine(const Config& cfg);
   Engine(const Config& cfg, std::string file_name);
   explicit Engine(const std::string& file_name); 
+  explicit Engine(std::istream& init);
   ~Engine();
 
   void update(const float dt);
 
+  /*
+   * Advance the simulation by one frame's worth
+   * of time, split into ticks. Returns how many
+   * ticks it took. With a CFL number set, the
+   * tick length adapts to how fast bodies move.
+   */
+  std::size_t advance(const float frame_dt);
+
+  /*
+   * Checkpointing - unlike a recording, a
+   * checkpoint holds the full state of the
+   * simulation, so a run can be resumed from
+   * it. Checkpoints can also be written
+   * automatically every N ticks.
+   */
+  int save_checkpoint(const std::string& file_name) const;
+  int load_checkpoint(const std::string& file_name);
+  void set_checkpointing(const std::string& file_name, const std::size_t interval);
+
+  /*
+   * Publish positions, velocities and
+   * orientations to the named shared memory
+   * object every interval ticks, for other
+   * processes to watch the run live.
+   */
+  int set_publishing(const std::string& name, const std::size_t interval);
+
+  /*
+   * Write what collision detection did (see
+   * TickStats) to a file every interval ticks.
+   * Other ticks run the same code as without
+   * stats, so they cost nothing extra.
+   */
+  int set_stats(const std::string& file_name, const std::size_t interval);
+  const TickStats& get_tick_stats() const;
+
+  /*
+   * Bodies can be added and removed while the
+   * simulation runs. Bodies are referred to
+   * by their ID, which stays the same while
+   * other bodies come and go. IDs of removed
+   * bodies are reused by later additions.
+   */
+  int add_bodies(const std::vector<ConfigSphere>& bodies, std::vector<unsigned int>& new_ids);
+  int remove_bodies(const std::vector<unsigned int>& body_ids);
+
+  /*
+   * Like add_bodies, but bodies keep their
+   * orientation and spin. get_body_states reads
+   * bodies back out by ID.
+   */
+  int add_body_states(const std::vector<BodyState>& states, std::vector<unsigned int>& new_ids);
+  int get_body_states(const std::vector<unsigned int>& body_ids, std::vector<BodyState>& states);
+
+  /*
+   * Viewers that aren't reading a recording
+   * (e.g. ones watching a stream) build their
+   * engine from the same header and colliders
+   * that start a recording, then set every
+   * body's pose themselves. Both sides list
+   * bodies by ID, skipping removed ones.
+   * get_body_changes counts how often bodies
+   * were added or removed, so that writers know
+   * when to send the header again.
+   */
+  void write_init(std::ostream& out) const;
+  int load_init(std::istream& in);
+  void get_poses(std::vector<BodyPose>& poses) const;
+  int set_poses(const std::vector<BodyPose>& poses);
+  std::size_t get_body_changes() const;
+
   template <typename T, std::size_t align>
   struct Vec3x {
     std::vector<T, boost::alignment::aligned_allocator<T, align>> x;
@@ -60,30 +153,118 @@ public:
     std::vector<T, boost::alignment::aligned_allocator<T, align>> z;
   };
 
+  template <typename T, std::size_t align>
+  struct Vec4x {
+    std::vector<T, boost::alignment::aligned_allocator<T, align>> w;
+    std::vector<T, boost::alignment::aligned_allocator<T, align>> x;
+    std::vector<T, boost::alignment::aligned_allocator<T, align>> y;
+    std::vector<T, boost::alignment::aligned_allocator<T, align>> z;
+  };
+
   bool paused = false;
-  float playback_speed = 1.0f / 256.0f;
+
+  /*
+   * Playback normally follows the clock: each update
+   * moves playback_speed simulated seconds per second
+   * of dt, interpolating between the recorded frames.
+   * Offscreen export turns that off to step one
+   * simulated tick per update instead, and checks
+   * playback_ended to know when it has every frame.
+   */
+  float playback_speed = 1.0f;
+  bool pace_playback = true;
+  bool playback_ended() const;
 
   const Vec3x<float, 32> &get_pos() const;
   const Vec3x<float, 32> &get_vel() const;
   const Vec3x<float, 32> &get_force() const;
   const std::vector<float> &get_mass() const;
-  const std::vector<Quaternion> &get_ang_pos() const;
+  const Vec4x<float, 32> &get_ang_pos() const;
+  const Vec3x<float, 32> &get_ang_vel() const;
   const std::vector<std::unique_ptr<Collider>> &get_colliders() const;
+  const std::vector<unsigned int> &get_ids() const;
   std::size_t get_num_bodies() const;
   const float* get_boundary() const;
+  float get_speed() const;
+  std::size_t get_ticks_per_frame() const;
+  float get_max_speed();
+  float get_cfl() const;
+  std::size_t get_frame_ticks() const;
+  float get_frame_step() const;
 
 private:
+  /*
+   * Shared by the constructors of engines that
+   * only play bodies back.
+   */
+  struct PlaybackTag {};
+  explicit Engine(PlaybackTag);
+
   /*
    * Constants / configuration.
    */
-  float grav_constant, elasticity, boundary[6];
+  float grav_constant, elasticity, friction, ccd_speed, boundary[6];
+  float mutual_grav_constant, opening_angle, softening;
+  bool loose_octree;
+  float speed;
+  std::size_t ticks_per_frame;
+  float cfl;
+  std::size_t max_ticks_per_frame;
+  std::size_t reorder_interval;
+  std::size_t record_interval;
   std::size_t num_bodies;
 
   /*
    * For facilitating playback/record.
    */
-  bool record = false, playback = false; 
+  bool record = false, playback = false, reached_end = false; 
   std::fstream fs; 
+  float record_dt = 0.0f;
+  std::uint32_t record_ticks = 0;
+
+  /*
+   * Recordings only keep every record_interval-th
+   * tick, so playback interpolates between two
+   * recorded keyframes (0 is the earlier one) by
+   * ID: positions with cubic Hermite splines using
+   * the recorded velocities, orientations with
+   * slerp. key_interval is the simulated time
+   * between the keyframes, key_ticks the number
+   * of ticks between them, and key_time (or, when
+   * stepping tick by tick, key_step) is how far
+   * past keyframe 0 we are.
+   */
+  Vec3x<float, 32> key_pos[2], key_vel[2];
+  Vec4x<float, 32> key_ang_pos[2];
+  float key_interval = 0.0f, key_time = 0.0f;
+  std::size_t key_step = 0;
+  std::uint32_t key_ticks = 1;
+  bool have_next_key = false;
+
+  /*
+   * For facilitating checkpoints.
+   */
+  std::size_t tick = 0, checkpoint_interval = 0;
+  std::string checkpoint_file;
+  std::size_t body_changes = 0;
+
+  /*
+   * For facilitating live publishing. Snapshots
+   * list bodies by ID, so publish_rows holds the
+   * index of each body in ID order.
+   */
+  std::unique_ptr<SharedStatePublisher> publisher;
+  std::size_t publish_interval = 0;
+  std::vector<std::uint32_t> publish_rows, publish_ids;
+
+  /*
+   * For facilitating stats, with counters
+   * kept per thread while a tick runs.
+   */
+  std::unique_ptr<StatsWriter> stats_writer;
+  std::size_t stats_interval = 0;
+  std::vector<ThreadStats> thread_stats;
+  TickStats tick_stats{};
 
   /*
    * Dynamics data, organized using data
@@ -93,32 +274,100 @@ private:
   Vec3x<float, 32> vel;
   Vec3x<float, 32> force;
   std::vector<float> mass;
-  std::vector<Quaternion> ang_pos;
+
+  /*
+   * Rotational dynamics. Orientations are
+   * unit quaternions, and since all bodies
+   * are spheres, inertia is a scalar.
+   */
+  Vec4x<float, 32> ang_pos;
+  Vec3x<float, 32> ang_vel;
+  std::vector<float> inv_inertia;
   std::vector<std::unique_ptr<Collider>> colliders;
   WallCollider walls[6];
 
-  omp_lock_t collision_set_lock;
+  /*
+   * Bodies are periodically reordered along
+   * a space filling curve, so that bodies
+   * close in space are close in memory, and
+   * removing a body moves the last body into
+   * its slot. IDs stay the same: ids maps an
+   * index to its body's ID, and index_of maps
+   * an ID back to its index (or NO_INDEX, for
+   * IDs in free_ids, whose bodies were
+   * removed).
+   */
+  std::vector<unsigned int> ids, index_of, free_ids;
+
+  /*
+   * How much work each body's broadphase
+   * query took last tick (by index), used to
+   * split the next tick's queries into chunks
+   * of about equal cost.
+   */
+  std::vector<unsigned int> query_cost;
+
+  /*
+   * Bodies that move faster than ccd_speed (when
+   * it isn't 0) are swept from where they were at
+   * the start of the tick, which is kept in
+   * prev_pos, to where they end up, so that they
+   * can't pass through other bodies.
+   */
+  Vec3x<float, 32> prev_pos;
+
+  /*
+   * For adaptive substepping: the smallest body
+   * radius (recomputed after bodies change), and
+   * how many ticks the last frame took, and how
+   * long they were on average.
+   */
+  float min_radius = 0.0f;
+  bool min_radius_stale = true;
+  std::size_t frame_ticks = 0;
+  float frame_step = 0.0f;
 
+  void set_sphere_at(const std::size_t i, const ConfigSphere& body);
+  void resize_bodies(const std::size_t new_num_bodies);
   Transform get_transform_at(const std::size_t i);
   AABB get_aabb_at(const std::size_t i);
+  AABB get_swept_aabb_at(const std::size_t i, const float dt);
+  bool is_swept(const std::size_t i, const float dt);
+  CollisionResponse check_pair_collision(const unsigned int first, const unsigned int second, const bool swept);
+  CollisionResponse check_wall_collision(const std::size_t i, const unsigned int wall, const Transform& wall_pos, const bool swept);
+  void gravity_update();
   void dynamics_update(const float dt);
-  std::unique_ptr<Octree> make_octree();
-  std::vector<std::tuple<CollisionResponse, unsigned int, unsigned int>> find_collisions(const std::unique_ptr<Octree> octree);
+  void rotation_update(const float dt);
+  float get_radius_at(const std::size_t i);
+  void friction_response(const unsigned int first, const unsigned int second, const float nx, const float ny, const float nz, const float j);
+  void friction_response_with_wall(const unsigned int i, const float nx, const float ny, const float nz, const float j);
+  void wall_response(const unsigned int i, const unsigned int axis, const float sign, const float depth);
+  std::unique_ptr<Octree> make_octree(const float dt);
+  std::unique_ptr<LooseOctree> make_loose_octree(const float dt);
+  template <bool counting>
+  void collision_update(const float dt);
+  template <bool counting>
+  std::vector<std::tuple<CollisionResponse, unsigned int, unsigned int>> find_collisions(const std::unique_ptr<Octree> octree, const float dt);
+  template <bool counting>
+  std::vector<std::tuple<CollisionResponse, unsigned int, unsigned int>> find_collisions(const std::unique_ptr<LooseOctree> octree, const float dt);
   void collision_response(const std::vector<std::tuple<CollisionResponse, unsigned int, unsigned int>>& collisions);
-  void collision_response_with_walls();
+  template <bool counting>
+  void collision_response_with_walls(const float dt);
+  void reorder();
 
   /*
    * Functions for playback/record
    */
-  void dump_init_to_file();
-  void load_init_from_file();
-  void dump_tick_to_file(float dt);
-  float load_tick_from_file();
+  void dump_tick_to_file(float dt, std::uint32_t ticks);
+  int publish_state();
+  bool load_tick_from_file();
+  void playback_update(const float dt);
+  void interpolate_keyframes(const float t);
 
   /*
    * Utility functions for performing vector operations.
    */
-  void multiply_with_mass(float *const a, const float *const b, const float c, const __m256& c_a);
-  void fused_multiply_add(const float dt, const __m256& dt_a, float *const a, const float *const b);
-  void fused_multiply_add_with_mass(const float dt, const __m256& dt_a, float *const a, const float *const b, const float *const m);
+  void multiply_with_mass(float *const a, const float *const b, const float c, const __m256& c_a, const std::size_t begin, const std::size_t end);
+  void fused_multiply_add(const float dt, const __m256& dt_a, float *const a, const float *const b, const std::size_t begin, const std::size_t end);
+  void fused_multiply_add_with_mass(const float dt, const __m256& dt_a, float *const a, const float *const b, const float *const m, const std::size_t begin, const std::size_t end);
 };
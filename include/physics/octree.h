@@ -12,7 +12,9 @@
 
 #pragma once
 
+#include <cstddef>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 /*
@@ -23,10 +25,26 @@
  */
 static constexpr unsigned int NODE_SIZE = 16;
 
+/*
+ * Octrees never split a node below this
+ * depth. Bodies that don't fit in a node at
+ * this depth are kept in an overflow list.
+ */
+static constexpr unsigned int MAX_DEPTH = 32;
+
 struct AABB {
   float x1, x2, y1, y2, z1, z2;
 };
 
+/*
+ * How a built tree turned out, for stats.
+ * Nodes count overflow nodes too, and a
+ * leaf's bodies include its overflow chain.
+ */
+struct OctreeShape {
+  std::size_t nodes, max_depth, leaves, leaf_bodies, max_leaf_bodies;
+};
+
 /*
  * Get child AABB, splitting parent AABB
  * into eight pieces.
@@ -53,19 +71,88 @@ public:
   explicit Octree(const AABB& aabb); 
 
   void insert(const unsigned int to_store, const AABB& aabb);
-  void possibilities(const unsigned int id, const AABB& aabb, std::unordered_set<unsigned int>& dest);
+  void possibilities(const unsigned int id, const AABB& aabb, std::unordered_set<unsigned int>& dest) const;
+  std::vector<std::pair<unsigned int, unsigned int>> pairs() const;
+  std::size_t num_nodes() const;
+  OctreeShape shape() const;
+
+  /*
+   * Barnes-Hut support. Bodies are inserted as
+   * points, so each body is stored in exactly
+   * one node. Once every body is inserted, we
+   * aggregate the mass and center of mass of
+   * each subtree, and can then approximate the
+   * gravitational pull of far away subtrees by
+   * their aggregates.
+   */
+  void insert_point(const unsigned int to_store, const float x, const float y, const float z);
+  void compute_mass_aggregates(const float *const mass, const float *const x, const float *const y, const float *const z);
+  void gravity(const unsigned int id, const float x, const float y, const float z, const float opening_angle, const float softening,
+	       const float *const mass, const float *const bx, const float *const by, const float *const bz, float& ax, float& ay, float& az) const;
 
 private:
-  struct Node {
-    Node(): num_stored(0), first_child(0), bodies{} {}
+  /*
+   * Besides body IDs, nodes keep the AABBs of
+   * their bodies as separate, aligned arrays,
+   * so queries can test them in SIMD. Full
+   * nodes at the maximum depth keep further
+   * bodies in a chain of overflow nodes.
+   */
+  struct alignas(32) Node {
+    Node(): x1{}, x2{}, y1{}, y2{}, z1{}, z2{}, num_stored(0), first_child(0), next(0), bodies{} {}
+    float x1[NODE_SIZE], x2[NODE_SIZE], y1[NODE_SIZE], y2[NODE_SIZE], z1[NODE_SIZE], z2[NODE_SIZE];
     unsigned int num_stored;
     unsigned int first_child;
+    unsigned int next;
     unsigned int bodies[NODE_SIZE]; 
     bool is_leaf();
   }; 
 
-  void insert(const unsigned int to_store, const AABB& aabb, const unsigned int root, const AABB& node_aabb);
-  void possibilities(const unsigned int id, const AABB& aabb, std::unordered_set<unsigned int>& dest, const unsigned int root, const AABB& node_aabb);
+  void insert(const unsigned int to_store, const AABB& aabb, const unsigned int root, const AABB& node_aabb, const unsigned int depth);
+  void store(const unsigned int to_store, const AABB& aabb, unsigned int root);
+
+  AABB root_bound;
+  std::vector<Node> nodes;
+
+  /*
+   * Mass aggregates, stored per node.
+   */
+  std::vector<float> node_mass, node_com_x, node_com_y, node_com_z;
+  std::vector<std::pair<unsigned int, unsigned int>> overflow;
+};
+
+/*
+ * LooseOctree implements a linear loose
+ * octree. Each node's bounds are enlarged to
+ * twice the size of its octant, so every body
+ * can be stored in exactly one node: the
+ * deepest one whose loose bounds contain the
+ * body's AABB. Bodies too large for any child
+ * (or that arrive once a node is full and
+ * can't go deeper) are kept in a chain of
+ * overflow nodes hanging off the node. Since
+ * no body is stored twice, queries never
+ * return duplicates.
+ */
+class LooseOctree {
+public:
+  explicit LooseOctree(const AABB& aabb);
+
+  void insert(const unsigned int to_store, const AABB& aabb);
+  void possibilities(const unsigned int id, const AABB& aabb, std::vector<unsigned int>& dest) const;
+  std::size_t num_nodes() const;
+  OctreeShape shape() const;
+
+private:
+  struct Node {
+    Node(): num_stored(0), first_child(0), next(0), bodies{} {}
+    unsigned int num_stored;
+    unsigned int first_child;
+    unsigned int next;
+    unsigned int bodies[NODE_SIZE];
+  };
+
+  void store(const unsigned int to_store, unsigned int root);
 
   AABB root_bound;
   std::vector<Node> nodes;
@@ -28,6 +28,8 @@ struct Quaternion {
 
   Matrix3 convert() const; 
 
+  static Quaternion slerp(const Quaternion& a, Quaternion b, const float t); 
+
 private:
   float invSquareRoot(const float n) const; 
 };
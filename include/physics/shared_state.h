@@ -0,0 +1,130 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * Live state is published into a POSIX shared
+ * memory object: a header followed by a ring of
+ * SHARED_STATE_SLOTS slots. Each publish fills
+ * the slot after the last one, so readers of the
+ * latest snapshot are only disturbed if they
+ * take longer than SHARED_STATE_SLOTS - 1
+ * publishes. Every slot is a slot header
+ * followed by one array of capacity floats per
+ * SharedStateArray, in that order, and then an
+ * array of capacity body IDs. Rows are sorted
+ * by ID, the same order recordings use, and
+ * row i holds the body with ID ids[i], so rows
+ * can be matched up across snapshots even as
+ * the engine reorders or removes bodies.
+ */
+static constexpr char SHARED_STATE_MAGIC[8] = {'H', 'B', 'S', 'H', 'A', 'R', 'E', 'D'};
+static constexpr std::uint32_t SHARED_STATE_VERSION = 2;
+static constexpr std::uint32_t SHARED_STATE_SLOTS = 4;
+
+enum SharedStateArray : std::size_t {
+  POS_X, POS_Y, POS_Z, VEL_X, VEL_Y, VEL_Z, ANG_POS_W, ANG_POS_X, ANG_POS_Y, ANG_POS_Z, NUM_SHARED_STATE_ARRAYS
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "shared state needs lock free 64 bit atomics");
+
+/*
+ * latest is the sequence number of the newest
+ * complete snapshot (0 before the first), which
+ * lives in slot latest % num_slots. A publisher
+ * that outgrows its capacity sets retired and
+ * moves to a new object under the same name, so
+ * readers should then open it again.
+ */
+struct alignas(64) SharedStateHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t num_slots;
+  std::uint64_t capacity;
+  std::uint64_t slot_size;
+  std::atomic<std::uint64_t> latest;
+  std::atomic<std::uint32_t> retired;
+};
+
+/*
+ * Each slot is guarded by a seqlock: sequence is
+ * odd while the slot is being written. A reader
+ * notes sequence, reads, and then checks that
+ * sequence hasn't changed; if it has, what it
+ * read may be torn and it should try again.
+ */
+struct alignas(64) SharedStateSlot {
+  std::atomic<std::uint64_t> sequence;
+  std::uint64_t tick;
+  std::uint64_t num_bodies;
+};
+
+/*
+ * The writing side, owned by the engine. The
+ * shared memory object is removed again when
+ * the publisher is destroyed. Row k of a
+ * snapshot is taken from index rows[k] of each
+ * array, and has ID ids[k].
+ */
+class SharedStatePublisher {
+public:
+  SharedStatePublisher();
+  SharedStatePublisher(const SharedStatePublisher&) = delete;
+  SharedStatePublisher& operator=(const SharedStatePublisher&) = delete;
+  ~SharedStatePublisher();
+  int open(const std::string& name_i, const std::size_t capacity);
+  int publish(const std::uint64_t tick, const std::size_t num_bodies, const float *const arrays[NUM_SHARED_STATE_ARRAYS],
+	      const std::uint32_t *rows, const std::uint32_t *ids);
+private:
+  std::string name;
+  void *mapping;
+  std::size_t mapping_size;
+  std::uint64_t published;
+
+  void close();
+};
+
+/*
+ * The reading side. Readers read straight out
+ * of the mapping, without copying:
+ *
+ *   std::uint64_t sequence;
+ *   const SharedStateSlot *slot = reader.begin_read(sequence);
+ *   if (slot) {
+ *     ... read reader.array(slot, POS_X)[i] for body reader.ids(slot)[i] ...
+ *     if (!reader.end_read(slot, sequence)) ... throw away what was read, try again ...
+ *   }
+ */
+class SharedStateReader {
+public:
+  SharedStateReader();
+  SharedStateReader(const SharedStateReader&) = delete;
+  SharedStateReader& operator=(const SharedStateReader&) = delete;
+  ~SharedStateReader();
+  int open(const std::string& name);
+  const SharedStateSlot *begin_read(std::uint64_t& sequence) const;
+  bool end_read(const SharedStateSlot *slot, const std::uint64_t sequence) const;
+  const float *array(const SharedStateSlot *slot, const SharedStateArray which) const;
+  const std::uint32_t *ids(const SharedStateSlot *slot) const;
+  bool retired() const;
+private:
+  void *mapping;
+  std::size_t mapping_size;
+
+  void close();
+};
@@ -0,0 +1,60 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+#include <physics/octree.h>
+
+/*
+ * What one tick's collision detection did.
+ * Candidate pairs are what the broadphase
+ * handed over, narrowphase tests count every
+ * pair and wall test run, and contacts and
+ * wall hits are the tests that collided. Max
+ * penetration is the deepest of those.
+ */
+struct TickStats {
+  std::uint64_t tick;
+  OctreeShape octree;
+  std::uint64_t candidate_pairs, narrowphase_tests, contacts, wall_hits;
+  float max_penetration;
+};
+
+/*
+ * Each thread counts into its own copy, a
+ * cache line apart from the others, and the
+ * copies are summed once the threads are
+ * done.
+ */
+struct alignas(64) ThreadStats {
+  std::uint64_t candidate_pairs = 0, narrowphase_tests = 0, contacts = 0, wall_hits = 0;
+  float max_penetration = 0.0f;
+};
+
+/*
+ * Writes one line per TickStats, as CSV (with
+ * a header line) if the file name ends in
+ * .csv, and as JSON lines otherwise.
+ */
+class StatsWriter {
+public:
+  int open(const std::string& file_name);
+  int write(const TickStats& stats);
+private:
+  std::ofstream out;
+  bool csv = false;
+};
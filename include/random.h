@@ -0,0 +1,76 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#pragma once
+
+#include <cstdint>
+
+/*
+ * Philox4x32-10 counter-based random number
+ * generator (Salmon et al., "Parallel Random
+ * Numbers: As Easy as 1, 2, 3"). Instead of
+ * carrying state from one draw to the next,
+ * each draw is a pure function of a counter
+ * and a key. Keying on the config seed and
+ * counting by body index lets every thread
+ * generate any body independently, and the
+ * resulting scene doesn't depend on how the
+ * work was split between threads.
+ */
+struct Philox4x32 {
+  std::uint32_t v[4];
+};
+
+static constexpr std::uint32_t PHILOX_M0 = 0xD2511F53;
+static constexpr std::uint32_t PHILOX_M1 = 0xCD9E8D57;
+static constexpr std::uint32_t PHILOX_W0 = 0x9E3779B9;
+static constexpr std::uint32_t PHILOX_W1 = 0xBB67AE85;
+static constexpr unsigned int PHILOX_ROUNDS = 10;
+
+__attribute__((always_inline))
+inline Philox4x32 philox4x32(const Philox4x32& counter, const std::uint64_t key) {
+  std::uint32_t c0 = counter.v[0], c1 = counter.v[1], c2 = counter.v[2], c3 = counter.v[3];
+  std::uint32_t k0 = static_cast<std::uint32_t>(key), k1 = static_cast<std::uint32_t>(key >> 32);
+  for (unsigned int r = 0; r < PHILOX_ROUNDS; ++r) {
+    const std::uint64_t p0 = static_cast<std::uint64_t>(PHILOX_M0) * c0;
+    const std::uint64_t p1 = static_cast<std::uint64_t>(PHILOX_M1) * c2;
+    c0 = static_cast<std::uint32_t>(p1 >> 32) ^ c1 ^ k0;
+    c1 = static_cast<std::uint32_t>(p1);
+    c2 = static_cast<std::uint32_t>(p0 >> 32) ^ c3 ^ k1;
+    c3 = static_cast<std::uint32_t>(p0);
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+  return Philox4x32{{c0, c1, c2, c3}};
+}
+
+/*
+ * Draw four random numbers for element index
+ * of a given stream. Different streams (e.g.
+ * different RANDOM bodies in a config) never
+ * share counters.
+ */
+__attribute__((always_inline))
+inline Philox4x32 philox4x32(const std::uint64_t index, const std::uint32_t stream, const std::uint64_t key) {
+  return philox4x32(Philox4x32{{static_cast<std::uint32_t>(index), static_cast<std::uint32_t>(index >> 32), stream, 0}}, key);
+}
+
+/*
+ * Map a random 32 bit integer to a float
+ * uniformly distributed in [0, 1). We keep
+ * the top 24 bits, as that's all the
+ * precision a float mantissa can hold.
+ */
+__attribute__((always_inline))
+inline float uniform_float(const std::uint32_t bits) {
+  return static_cast<float>(bits >> 8) * (1.0f / 16777216.0f);
+}
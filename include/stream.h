@@ -0,0 +1,151 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <physics/engine.h>
+
+/*
+ * A viewer opens a stream by sending a hello:
+ * the most frames per second it wants (0 for as
+ * many as the server makes), and the precision
+ * it wants positions in. From then on, the server
+ * sends messages, each a type byte and a 64 bit
+ * length followed by that many bytes:
+ *
+ * 'I' holds exactly what starts a recording (the
+ *     boundary and every body's collider). It is
+ *     sent first, and again whenever bodies are
+ *     added or removed.
+ * 'F' holds a frame: its 64 bit number, its 64
+ *     bit body count, and then for every body its
+ *     position (in steps of the precision) and
+ *     orientation (in steps of 1 / 32767), each
+ *     component as the zigzag varint difference
+ *     from the last frame this viewer got (or from
+ *     0, right after an 'I').
+ */
+static constexpr char STREAM_MAGIC[8] = {'H', 'B', 'S', 'T', 'R', 'E', 'A', 'M'};
+static constexpr std::uint32_t STREAM_VERSION = 1;
+static constexpr std::size_t STREAM_POSE_VALUES = 7;
+
+struct StreamHello {
+  char magic[8];
+  std::uint32_t version;
+  float rate, precision;
+};
+
+/*
+ * Serves the engine's state to any number of
+ * viewers from its own thread. publish hands the
+ * thread the latest state, but only when some
+ * viewer is ready for a frame, and never waits
+ * on the network. Each viewer only gets a new
+ * frame once the last one has left the socket,
+ * so a slow viewer just gets fewer frames, each
+ * coded against the last one it actually got.
+ */
+class StreamServer {
+public:
+  StreamServer();
+  StreamServer(const StreamServer&) = delete;
+  StreamServer& operator=(const StreamServer&) = delete;
+  ~StreamServer();
+  int open(const std::uint16_t port_i);
+  std::uint16_t get_port() const;
+  std::size_t get_num_viewers() const;
+  void publish(const Engine& engine);
+private:
+  /*
+   * The engine's state at one publish, by body
+   * ID. One snapshot belongs to the engine
+   * thread, one to the network thread, and one
+   * is handed between them (under mutex) by
+   * swapping.
+   */
+  struct Snapshot {
+    std::uint64_t version = 0;
+    std::size_t body_changes = 0;
+    std::string init;
+    std::vector<BodyPose> poses;
+  };
+
+  struct Viewer {
+    int fd;
+    StreamHello hello;
+    std::size_t hello_received = 0;
+    bool greeted = false, have_init = false, dead = false;
+    std::chrono::steady_clock::duration period{};
+    std::chrono::steady_clock::time_point due{};
+    std::vector<char> out;
+    std::size_t out_sent = 0;
+    std::uint64_t version = 0;
+    std::size_t body_changes = 0;
+    std::vector<std::int32_t> base;
+  };
+
+  int listen_fd, wake_fds[2];
+  std::uint16_t port;
+  std::thread thread;
+  std::atomic<bool> stopping, wanted;
+  std::atomic<std::size_t> num_viewers;
+  std::mutex mutex;
+  Snapshot pending, shared, working;
+  std::uint64_t published;
+  std::vector<Viewer> viewers;
+
+  void serve();
+  void accept_viewers();
+  void read_hello(Viewer& viewer);
+  void encode(Viewer& viewer);
+  void flush(Viewer& viewer);
+};
+
+/*
+ * The viewing side. The first 'I' message is
+ * read with read_init, to build the viewer's
+ * engine from; poll then applies everything
+ * else that has arrived to that engine.
+ */
+class StreamClient {
+public:
+  StreamClient();
+  StreamClient(const StreamClient&) = delete;
+  StreamClient& operator=(const StreamClient&) = delete;
+  ~StreamClient();
+  int connect(const std::string& host, const std::string& port, const float rate, const float precision_i);
+  int read_init(std::string& init);
+  int poll(Engine& engine, const bool wait);
+  std::uint64_t get_frame() const;
+private:
+  int fd;
+  float precision;
+  std::vector<char> in;
+  std::size_t in_start;
+  std::vector<std::int32_t> base;
+  bool base_stale;
+  std::vector<BodyPose> poses;
+  std::uint64_t frame;
+
+  int next_message(const bool wait, char& type, std::string& payload);
+  int decode(const std::string& payload, const std::size_t expected_bodies);
+};
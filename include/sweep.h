@@ -0,0 +1,73 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#pragma once
+
+#include <iostream>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <json/json.h>
+
+#include <physics/engine.h>
+#include <cli.h>
+
+/*
+ * What we keep from each run of a sweep: the
+ * final kinetic energy, center of mass and
+ * largest body speed, and how long the run
+ * took (in seconds of wall time).
+ */
+struct SweepSummary {
+  double kinetic_energy, com_x, com_y, com_z, max_speed, seconds;
+};
+
+/*
+ * A parameter sweep runs one scene many times
+ * with different constants. The config JSON
+ * gains a SWEEP object holding how many TICKS
+ * each run lasts, how long each tick is (DT),
+ * and PARAMETERS, which maps top level config
+ * keys to arrays of values. Every combination
+ * of values is one run. Like Config, nothing is
+ * read on construction, so that initialize can
+ * return an error code.
+ */
+class Sweep {
+public:
+  explicit Sweep(char *json_file_name_i);
+  int initialize();
+  int run();
+  void write_csv(std::ostream &out) const;
+  std::size_t get_num_runs() const;
+  const std::vector<SweepSummary> &get_summaries() const;
+private:
+  char *json_file_name;
+  Json::Value root;
+  std::size_t ticks;
+  float dt;
+
+  /*
+   * The swept keys and the values each takes.
+   * Run i takes values by reading i as a mixed
+   * radix number, the last key changing fastest.
+   */
+  std::vector<std::string> keys;
+  std::vector<std::vector<Json::Value>> values;
+  std::size_t num_runs;
+
+  std::vector<SweepSummary> summaries;
+
+  Json::Value run_root(std::size_t run) const;
+  int run_world(const std::size_t run);
+};
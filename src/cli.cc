@@ -11,6 +11,25 @@
     along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
 
 #include <cli.h>
+#include <random.h>
+
+#include <algorithm>
+#include <chrono>
+#include <tuple>
+
+#include <math.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Body files start with a magic string and a
+ * format version.
+ */
+static constexpr char BODY_FILE_MAGIC[8] = {'H', 'B', 'B', 'O', 'D', 'I', 'E', 'S'};
+static constexpr std::uint32_t BODY_FILE_VERSION = 1;
 
 /*
  * Initialize a variable with the value of an
@@ -58,10 +77,31 @@ int Config::process_body(const Json::Value &root) {
     if (init_constant(root, "r", r, [](const Json::Value &jv) { return jv.isNumeric(); })) return -1;
     bodies.push_back(ConfigSphere{x, y, z, vx, vy, vz, m, r});
   }
+  else if (type == "FILE") {
+    std::string path;
+    if (init_constant(root, "path", path, [](const Json::Value &jv) { return jv.isString(); })) return -1;
+
+    /*
+     * Relative paths are relative to the
+     * directory of the JSON file.
+     */
+    std::string json_path = json_file_name;
+    std::size_t last_slash = json_path.find_last_of('/');
+    if (!path.empty() && path.front() != '/' && last_slash != std::string::npos) path = json_path.substr(0, last_slash + 1) + path;
+
+    BodyFile body_file;
+    if (body_file.open(path)) return -1;
+    body_files.push_back(std::move(body_file));
+  }
   else if (type == "RANDOM") {
     std::size_t old_size = bodies.size();
+    std::size_t old_num_files = body_files.size();
     
-    process_body(root["TEMPLATE"]);
+    if (process_body(root["TEMPLATE"])) return -1;
+    if (body_files.size() != old_num_files) {
+      std::cerr << "ERROR: A FILE body can't be used as the TEMPLATE of a RANDOM body." << std::endl;
+      return -1;
+    }
 
     decltype(bodies) config_bodies;
     config_bodies.insert(config_bodies.end(), std::make_move_iterator(bodies.begin() + static_cast<long int>(old_size)), std::make_move_iterator(bodies.end()));
@@ -76,22 +116,106 @@ int Config::process_body(const Json::Value &root) {
     if (init_constant(root, "max_x", max_x, [](const Json::Value &jv) { return jv.isNumeric(); })) return -1;
     if (init_constant(root, "max_y", max_y, [](const Json::Value &jv) { return jv.isNumeric(); })) return -1;
     if (init_constant(root, "max_z", max_z, [](const Json::Value &jv) { return jv.isNumeric(); })) return -1;
+    if (!(min_x <= max_x && min_y <= max_y && min_z <= max_z)) {
+      std::cerr << "ERROR: The RANDOM region needs min_x <= max_x, min_y <= max_y and min_z <= max_z." << std::endl;
+      return -1;
+    }
 
-    for (auto config_body : config_bodies) {
-      for (std::size_t i = 0; i < num_bodies_gen; ++i) {
-	float x = static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
-	float y = static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
-	float z = static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
+    /*
+     * By default, offsets are uniform over the
+     * region, so generated bodies may start out
+     * overlapping. LATTICE placement puts every
+     * body in its own cell of a jittered lattice
+     * instead, so bodies start at least min_gap
+     * apart (given templates share a position).
+     */
+    std::string placement = "UNIFORM";
+    float min_gap = 0.0f;
+    if (root["placement"].isString()) placement = root["placement"].as<std::string>();
+    if (root["min_gap"].isNumeric()) min_gap = root["min_gap"].as<float>();
+    if (!(min_gap >= 0.0f)) {
+      std::cerr << "ERROR: min_gap can't be negative." << std::endl;
+      return -1;
+    }
+    if (placement != "UNIFORM" && placement != "LATTICE") {
+      std::cerr << "ERROR: Unrecognized placement " << placement << "." << std::endl;
+      return -1;
+    }
+    const bool lattice = placement == "LATTICE";
+    const std::size_t num_generated = config_bodies.size() * num_bodies_gen;
+
+    float max_r = 0.0f;
+    for (const auto& config_body : config_bodies) {
+      std::visit([&](const auto& arg) noexcept { max_r = std::max(max_r, arg.r); }, config_body);
+    }
+    const float min_cell = 2.0f * max_r + min_gap;
+    const float width_x = max_x - min_x + min_cell, width_y = max_y - min_y + min_cell, width_z = max_z - min_z + min_cell;
+    auto lattice_size = [&](const float cell) {
+      return std::make_tuple(static_cast<std::size_t>(width_x / cell), static_cast<std::size_t>(width_y / cell), static_cast<std::size_t>(width_z / cell));
+    };
+
+    /*
+     * Start with cells just large enough to hold
+     * every body evenly spread over the region,
+     * and shrink them until enough cells fit.
+     * Whatever room a cell has beyond the
+     * minimum becomes jitter.
+     */
+    float cell = min_cell;
+    std::size_t nx = 0, ny = 0, nz = 0;
+    if (lattice && num_generated) {
+      cell = std::max(min_cell, cbrtf(width_x * width_y * width_z / static_cast<float>(num_generated)));
+      std::tie(nx, ny, nz) = lattice_size(cell);
+      while (nx * ny * nz < num_generated && cell > min_cell) {
+	cell = std::max(min_cell, 0.99f * cell);
+	std::tie(nx, ny, nz) = lattice_size(cell);
+      }
+      if (nx * ny * nz < num_generated) {
+	std::cerr << "ERROR: Can't fit " << num_generated << " bodies of radius " << max_r << " into the RANDOM region without overlap." << std::endl;
+	return -1;
+      }
+    }
+    const float jitter = cell - min_cell;
+    const double cell_ratio = lattice && num_generated ? static_cast<double>(nx * ny * nz) / static_cast<double>(num_generated) : 0.0;
+
+    /*
+     * Each generated body draws its offset from
+     * a counter-based generator keyed by the
+     * seed, using its index as the counter, so
+     * we can generate all of them in parallel and
+     * still get the same scene for the same seed.
+     * For lattice placement, body k takes a random
+     * cell out of its own run of cell_ratio cells,
+     * so no two bodies ever share a cell.
+     */
+    const std::size_t first = bodies.size();
+    const std::uint32_t stream = random_stream++;
+    bodies.resize(first + num_generated);
+#pragma omp parallel for
+    for (std::size_t k = 0; k < num_generated; ++k) {
+      const Philox4x32 rnd = philox4x32(k, stream, seed);
+      float x = uniform_float(rnd.v[0]);
+      float y = uniform_float(rnd.v[1]);
+      float z = uniform_float(rnd.v[2]);
+      if (lattice) {
+	const std::size_t run_begin = static_cast<std::size_t>(static_cast<double>(k) * cell_ratio);
+	const std::size_t run_end = std::min(nx * ny * nz, static_cast<std::size_t>(static_cast<double>(k + 1) * cell_ratio));
+	const std::size_t c = run_begin + static_cast<std::size_t>(uniform_float(rnd.v[3]) * static_cast<float>(run_end - run_begin));
+	x = min_x + static_cast<float>(c % nx) * cell + x * jitter;
+	y = min_y + static_cast<float>((c / nx) % ny) * cell + y * jitter;
+	z = min_z + static_cast<float>(c / (nx * ny)) * cell + z * jitter;
+      }
+      else {
 	x = x * (max_x - min_x) + min_x;
 	y = y * (max_y - min_y) + min_y;
 	z = z * (max_z - min_z) + min_z;
-	std::visit([&](auto arg) {
-	  arg.x += x;
-	  arg.y += y;
-	  arg.z += z;
-	  bodies.push_back(arg);
-	}, config_body);
       }
+      bodies[first + k] = std::visit([&](auto arg) noexcept -> std::variant<ConfigSphere> {
+	arg.x += x;
+	arg.y += y;
+	arg.z += z;
+	return arg;
+      }, config_bodies[k / num_bodies_gen]);
     }
   }
   else {
@@ -127,10 +251,31 @@ int Config::initialize() {
     return -1; 
   }
 
+  return initialize(root);
+}
+
+/*
+ * Read the config from an already parsed JSON
+ * value (e.g. one that a parameter sweep has
+ * modified).
+ */
+int Config::initialize(const Json::Value &root) {
   if (init_constant(root, "GRAVITY", grav_constant, [](const Json::Value &jv) { return jv.isNumeric(); })) return -1;
 
+  if (root["MUTUAL_GRAVITY"].isNumeric()) mutual_grav_constant = root["MUTUAL_GRAVITY"].as<float>();
+  if (root["OPENING_ANGLE"].isNumeric()) opening_angle = root["OPENING_ANGLE"].as<float>();
+  if (root["SOFTENING"].isNumeric()) softening = root["SOFTENING"].as<float>();
+
   if (root["ELASTICITY"].isNumeric()) elasticity = root["ELASTICITY"].as<float>();
 
+  if (root["FRICTION"].isNumeric()) friction = root["FRICTION"].as<float>();
+
+  if (root["CCD_SPEED"].isNumeric()) ccd_speed = root["CCD_SPEED"].as<float>();
+  if (ccd_speed < 0.0f) {
+    std::cerr << "ERROR: CCD_SPEED can't be negative." << std::endl;
+    return -1;
+  }
+
   if (root["SPEED"].isNumeric()) speed = root["SPEED"].as<float>();
 
   if (init_constant(root, "MIN_X", boundary[0], [](const Json::Value &jv) { return jv.isNumeric(); })) return -1;
@@ -156,6 +301,74 @@ int Config::initialize() {
   }
 
   if (root["TICKS_PER_FRAME"].isIntegral()) ticks_per_frame = root["TICKS_PER_FRAME"].as<std::size_t>();
+  if (!ticks_per_frame) {
+    std::cerr << "ERROR: TICKS_PER_FRAME must be at least 1." << std::endl;
+    return -1;
+  }
+
+  /*
+   * With a CFL number, TICKS_PER_FRAME is the
+   * fewest ticks a frame takes, and
+   * MAX_TICKS_PER_FRAME the most.
+   */
+  if (root["CFL"].isNumeric()) cfl = root["CFL"].as<float>();
+  if (root["MAX_TICKS_PER_FRAME"].isIntegral()) max_ticks_per_frame = root["MAX_TICKS_PER_FRAME"].as<std::size_t>();
+  if (cfl < 0.0f) {
+    std::cerr << "ERROR: CFL can't be negative." << std::endl;
+    return -1;
+  }
+  if (cfl > 0.0f && max_ticks_per_frame < ticks_per_frame) {
+    std::cerr << "ERROR: MAX_TICKS_PER_FRAME can't be smaller than TICKS_PER_FRAME." << std::endl;
+    return -1;
+  }
+
+  if (root["BROADPHASE"].isString()) {
+    std::string broadphase = root["BROADPHASE"].as<std::string>();
+    if (broadphase != "OCTREE" && broadphase != "LOOSE_OCTREE") {
+      std::cerr << "ERROR: Unrecognized broadphase " << broadphase << "." << std::endl;
+      return -1;
+    }
+    loose_octree = broadphase == "LOOSE_OCTREE";
+  }
+
+  if (root["CHECKPOINT_INTERVAL"].isIntegral()) checkpoint_interval = root["CHECKPOINT_INTERVAL"].as<std::size_t>();
+
+  /*
+   * Shared memory names are a single leading
+   * slash followed by the name itself.
+   */
+  if (root["PUBLISH"].isString()) {
+    publish_name = root["PUBLISH"].as<std::string>();
+    if (publish_name.empty() || publish_name.find('/', 1) != std::string::npos || publish_name == "/") {
+      std::cerr << "ERROR: PUBLISH must be a name like /hummingbird, not " << publish_name << "." << std::endl;
+      return -1;
+    }
+    if (publish_name[0] != '/') publish_name = "/" + publish_name;
+  }
+  if (root["PUBLISH_INTERVAL"].isIntegral()) publish_interval = root["PUBLISH_INTERVAL"].as<std::size_t>();
+  if (!publish_interval) {
+    std::cerr << "ERROR: PUBLISH_INTERVAL must be at least 1." << std::endl;
+    return -1;
+  }
+  if (root["STATS"].isString()) stats_file = root["STATS"].as<std::string>();
+  if (root["STATS_INTERVAL"].isIntegral()) stats_interval = root["STATS_INTERVAL"].as<std::size_t>();
+  if (!stats_interval) {
+    std::cerr << "ERROR: STATS_INTERVAL must be at least 1." << std::endl;
+    return -1;
+  }
+  if (root["REORDER_INTERVAL"].isIntegral()) reorder_interval = root["REORDER_INTERVAL"].as<std::size_t>();
+  if (root["RECORD_INTERVAL"].isIntegral()) record_interval = root["RECORD_INTERVAL"].as<std::size_t>();
+  if (!record_interval) {
+    std::cerr << "ERROR: RECORD_INTERVAL must be at least 1." << std::endl;
+    return -1;
+  }
+
+  /*
+   * Without a SEED, every run generates a
+   * different scene.
+   */
+  if (root["SEED"].isIntegral()) seed = root["SEED"].as<std::uint64_t>();
+  else seed = static_cast<std::uint64_t>(std::chrono::high_resolution_clock::now().time_since_epoch().count());
 
   const Json::Value &jv_bodies = root["BODIES"];
   if (!jv_bodies.isArray()) {
@@ -167,6 +380,88 @@ int Config::initialize() {
     if (process_body(val)) return -1;
   }
   num_bodies = bodies.size();
+  for (const auto& body_file : body_files) num_bodies += body_file.size();
 
   return 0;
 }
+
+BodyFile::BodyFile(): mapping(nullptr), mapping_size(0), num_bodies(0) {}
+
+BodyFile::BodyFile(BodyFile&& other) noexcept: mapping(other.mapping), mapping_size(other.mapping_size), num_bodies(other.num_bodies) {
+  other.mapping = nullptr;
+  other.mapping_size = 0;
+  other.num_bodies = 0;
+}
+
+BodyFile& BodyFile::operator=(BodyFile&& other) noexcept {
+  std::swap(mapping, other.mapping);
+  std::swap(mapping_size, other.mapping_size);
+  std::swap(num_bodies, other.num_bodies);
+  return *this;
+}
+
+BodyFile::~BodyFile() {
+  if (mapping) munmap(mapping, mapping_size);
+}
+
+/*
+ * Map a body file into memory and validate
+ * its header. We check that the file is large
+ * enough to hold every body the header claims,
+ * so the engine can trust size() later.
+ */
+int BodyFile::open(const std::string& file_name) {
+  int fd = ::open(file_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "ERROR: Couldn't open body file " << file_name << "." << std::endl;
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) || static_cast<std::size_t>(st.st_size) < sizeof(BodyFileHeader)) {
+    std::cerr << "ERROR: Body file " << file_name << " is too small to be a body file." << std::endl;
+    close(fd);
+    return -1;
+  }
+
+  std::size_t new_mapping_size = static_cast<std::size_t>(st.st_size);
+  void *new_mapping = mmap(nullptr, new_mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (new_mapping == MAP_FAILED) {
+    std::cerr << "ERROR: Couldn't map body file " << file_name << " into memory." << std::endl;
+    return -1;
+  }
+
+  const BodyFileHeader *header = static_cast<const BodyFileHeader*>(new_mapping);
+  if (!std::equal(header->magic, header->magic + sizeof(BODY_FILE_MAGIC), BODY_FILE_MAGIC) || header->version != BODY_FILE_VERSION) {
+    std::cerr << "ERROR: " << file_name << " is not a version " << BODY_FILE_VERSION << " body file." << std::endl;
+    munmap(new_mapping, new_mapping_size);
+    return -1;
+  }
+  if ((new_mapping_size - sizeof(BodyFileHeader)) / sizeof(ConfigSphere) < header->num_bodies) {
+    std::cerr << "ERROR: Body file " << file_name << " is truncated." << std::endl;
+    munmap(new_mapping, new_mapping_size);
+    return -1;
+  }
+
+  /*
+   * The engine reads the file from several
+   * threads at once, so ask the kernel to
+   * start paging it in now.
+   */
+  madvise(new_mapping, new_mapping_size, MADV_WILLNEED);
+
+  if (mapping) munmap(mapping, mapping_size);
+  mapping = new_mapping;
+  mapping_size = new_mapping_size;
+  num_bodies = header->num_bodies;
+  return 0;
+}
+
+const ConfigSphere* BodyFile::data() const {
+  return reinterpret_cast<const ConfigSphere*>(static_cast<const char*>(mapping) + sizeof(BodyFileHeader));
+}
+
+std::size_t BodyFile::size() const {
+  return num_bodies;
+}
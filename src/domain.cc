@@ -0,0 +1,527 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#include <domain.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <math.h>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static_assert(std::is_trivially_copyable<DomainBody>::value, "DomainBody is sent as raw bytes");
+
+SocketTransport::SocketTransport(const int rank_i, const int size_i, const int left_fd_i, const int right_fd_i): rank(rank_i), size(size_i), left_fd(left_fd_i), right_fd(right_fd_i) {
+  for (const int fd : {left_fd, right_fd}) {
+    if (fd >= 0) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+}
+
+SocketTransport::~SocketTransport() {
+  if (left_fd >= 0) close(left_fd);
+  if (right_fd >= 0) close(right_fd);
+}
+
+int SocketTransport::get_rank() const { return rank; }
+int SocketTransport::get_size() const { return size; }
+
+/*
+ * Send and receive at the same time, polling
+ * the socket for whichever it is ready to do.
+ * A blocking send of a big message could
+ * otherwise fill both socket buffers while the
+ * neighbor is also still sending.
+ */
+int SocketTransport::exchange(const int peer, const std::vector<char>& out, std::vector<char>& in) {
+  const int fd = peer == rank - 1 ? left_fd : (peer == rank + 1 ? right_fd : -1);
+  if (fd < 0) {
+    std::cerr << "ERROR: Rank " << rank << " has no connection to rank " << peer << "." << std::endl;
+    return -1;
+  }
+
+  const std::uint64_t out_size = out.size();
+  char out_header[sizeof(std::uint64_t)], in_header[sizeof(std::uint64_t)];
+  memcpy(out_header, &out_size, sizeof(out_header));
+  const std::size_t out_total = sizeof(out_header) + out.size();
+  std::size_t in_total = sizeof(in_header), sent = 0, received = 0;
+  bool have_header = false;
+  in.clear();
+
+  while (sent < out_total || received < in_total) {
+    pollfd poll_fd{fd, static_cast<short>((received < in_total ? POLLIN : 0) | (sent < out_total ? POLLOUT : 0)), 0};
+    if (poll(&poll_fd, 1, -1) < 0) {
+      if (errno == EINTR) continue;
+      std::cerr << "ERROR: Couldn't poll the connection to rank " << peer << "." << std::endl;
+      return -1;
+    }
+    if (poll_fd.revents & (POLLERR | POLLNVAL) || (poll_fd.revents & POLLHUP && !(poll_fd.revents & POLLIN))) {
+      std::cerr << "ERROR: Lost the connection to rank " << peer << "." << std::endl;
+      return -1;
+    }
+
+    if (poll_fd.revents & POLLIN) {
+      char *dest = received < sizeof(in_header) ? in_header + received : in.data() + (received - sizeof(in_header));
+      const std::size_t want = received < sizeof(in_header) ? sizeof(in_header) - received : in_total - received;
+      const ssize_t n = read(fd, dest, want);
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+	std::cerr << "ERROR: Lost the connection to rank " << peer << "." << std::endl;
+	return -1;
+      }
+      if (n > 0) received += static_cast<std::size_t>(n);
+      if (!have_header && received == sizeof(in_header)) {
+	std::uint64_t in_size;
+	memcpy(&in_size, in_header, sizeof(in_size));
+	in.resize(in_size);
+	in_total += in_size;
+	have_header = true;
+      }
+    }
+
+    if (poll_fd.revents & POLLOUT) {
+      const char *src = sent < sizeof(out_header) ? out_header + sent : out.data() + (sent - sizeof(out_header));
+      const std::size_t want = sent < sizeof(out_header) ? sizeof(out_header) - sent : out_total - sent;
+      const ssize_t n = send(fd, src, want, MSG_NOSIGNAL);
+      if (n < 0 && errno != EAGAIN && errno != EINTR) {
+	std::cerr << "ERROR: Lost the connection to rank " << peer << "." << std::endl;
+	return -1;
+      }
+      if (n > 0) sent += static_cast<std::size_t>(n);
+    }
+  }
+  return 0;
+}
+
+/*
+ * Neighbors are joined by socket pairs; pair k
+ * joins rank k to rank k + 1. Workers exec a
+ * fresh copy of ourselves rather than carrying
+ * on from the fork, since the OpenMP runtime
+ * doesn't survive a fork once its threads have
+ * started.
+ */
+std::unique_ptr<SocketTransport> SocketTransport::spawn_workers(const int size, const std::vector<std::string>& worker_args) {
+  if (size < 1) {
+    std::cerr << "ERROR: A distributed run needs at least one process." << std::endl;
+    return nullptr;
+  }
+  const std::size_t num_pairs = static_cast<std::size_t>(size - 1);
+  std::vector<int> pairs(2 * num_pairs);
+  for (std::size_t k = 0; k < num_pairs; ++k) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, &pairs[2 * k])) {
+      std::cerr << "ERROR: Couldn't create sockets for a distributed run." << std::endl;
+      for (std::size_t j = 0; j < 2 * k; ++j) close(pairs[j]);
+      return nullptr;
+    }
+  }
+
+  std::vector<pid_t> workers;
+  for (int rank = 1; rank < size; ++rank) {
+    const int left_fd = pairs[2 * static_cast<std::size_t>(rank - 1) + 1];
+    const int right_fd = rank < size - 1 ? pairs[2 * static_cast<std::size_t>(rank)] : -1;
+    std::vector<std::string> args = worker_args;
+    args.push_back(std::to_string(rank));
+    args.push_back(std::to_string(size));
+    args.push_back(std::to_string(left_fd));
+    args.push_back(std::to_string(right_fd));
+    std::vector<char*> argv;
+    for (auto &arg : args) argv.push_back(arg.data());
+    argv.push_back(nullptr);
+
+    const pid_t pid = fork();
+    if (pid == 0) {
+      for (const int fd : pairs) {
+	if (fd != left_fd && fd != right_fd) close(fd);
+      }
+      execv("/proc/self/exe", argv.data());
+      _exit(127);
+    }
+    if (pid < 0) {
+      std::cerr << "ERROR: Couldn't start process " << rank << " of a distributed run." << std::endl;
+      for (const int fd : pairs) close(fd);
+      for (const pid_t worker : workers) waitpid(worker, nullptr, 0);
+      return nullptr;
+    }
+    workers.push_back(pid);
+  }
+
+  for (std::size_t j = 1; j < pairs.size(); ++j) close(pairs[j]);
+  auto transport = std::make_unique<SocketTransport>(0, size, -1, size > 1 ? pairs[0] : -1);
+  transport->workers = std::move(workers);
+  return transport;
+}
+
+/*
+ * Close our own sockets first, so that workers
+ * stuck waiting on us (if we failed) see the
+ * connection drop and exit too.
+ */
+int SocketTransport::wait_workers() {
+  if (right_fd >= 0) close(right_fd);
+  right_fd = -1;
+  int failed = 0;
+  for (const pid_t worker : workers) {
+    int status;
+    if (waitpid(worker, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) failed = -1;
+  }
+  workers.clear();
+  if (failed) std::cerr << "ERROR: A process of the distributed run failed." << std::endl;
+  return failed;
+}
+
+/*
+ * Messages are flat arrays of DomainBody, each
+ * with its length in front.
+ */
+static void pack_bodies(std::vector<char>& out, const std::vector<DomainBody>& bodies) {
+  const std::uint64_t count = bodies.size();
+  const std::size_t offset = out.size();
+  out.resize(offset + sizeof(count) + bodies.size() * sizeof(DomainBody));
+  memcpy(out.data() + offset, &count, sizeof(count));
+  if (!bodies.empty()) memcpy(out.data() + offset + sizeof(count), bodies.data(), bodies.size() * sizeof(DomainBody));
+}
+
+static int unpack_bodies(const std::vector<char>& in, std::size_t& offset, std::vector<DomainBody>& bodies) {
+  std::uint64_t count;
+  if (in.size() - offset < sizeof(count)) return -1;
+  memcpy(&count, in.data() + offset, sizeof(count));
+  offset += sizeof(count);
+  if ((in.size() - offset) / sizeof(DomainBody) < count) return -1;
+  const std::size_t first = bodies.size();
+  bodies.resize(first + count);
+  if (count) memcpy(&bodies[first], in.data() + offset, count * sizeof(DomainBody));
+  offset += count * sizeof(DomainBody);
+  return 0;
+}
+
+/*
+ * What neighbors tell each other to balance the
+ * boundary between them.
+ */
+struct SlabLoad {
+  std::uint64_t num_owned;
+  float slab_min, slab_max;
+};
+
+/*
+ * What neighbors tell each other every tick to
+ * agree on how far out to send ghosts.
+ */
+struct SlabReach {
+  float max_speed, max_radius;
+};
+
+Domain::Domain(char *json_file_name_i, Transport &transport_i, const std::uint64_t seed_i): json_file_name(json_file_name_i), transport(transport_i), seed(seed_i), config(json_file_name_i), ticks(0), balance_interval(10), tick(0), dt(0.0f), slab_min(0.0f), slab_max(0.0f), max_radius(0.0f) {}
+
+float Domain::get_slab_min() const { return slab_min; }
+float Domain::get_slab_max() const { return slab_max; }
+std::size_t Domain::get_num_owned() const { return engine->get_num_bodies() - ghost_ids.size(); }
+const std::vector<DomainBody> &Domain::get_result() const { return result; }
+
+/*
+ * Read the config, and keep only the bodies in
+ * our slab. Every engine keeps the whole
+ * boundary box, so only the box's own faces
+ * act as walls.
+ */
+int Domain::initialize() {
+  std::ifstream json_file(json_file_name);
+  if (!json_file.is_open()) {
+    std::cerr << "ERROR: Couldn't open config file " << json_file_name << "." << std::endl;
+    return -1;
+  }
+
+  Json::Value root;
+  try {
+    json_file >> root;
+  }
+  catch(const Json::RuntimeError& e) {
+    std::cerr << "ERROR: Malformed JSON config file " << json_file_name << "." << std::endl;
+    return -1;
+  }
+
+  const Json::Value &distributed = root["DISTRIBUTED"];
+  if (!distributed.isObject()) {
+    std::cerr << "ERROR: Either couldn't find DISTRIBUTED in input JSON, or the value of DISTRIBUTED is not of the correct type." << std::endl;
+    return -1;
+  }
+  if (!distributed["TICKS"].isIntegral() || !distributed["DT"].isNumeric()) {
+    std::cerr << "ERROR: DISTRIBUTED needs an integer TICKS and a number DT." << std::endl;
+    return -1;
+  }
+  ticks = distributed["TICKS"].as<std::size_t>();
+  dt = distributed["DT"].as<float>();
+  if (distributed.isMember("BALANCE_INTERVAL")) {
+    if (!distributed["BALANCE_INTERVAL"].isIntegral()) {
+      std::cerr << "ERROR: BALANCE_INTERVAL must be an integer." << std::endl;
+      return -1;
+    }
+    balance_interval = distributed["BALANCE_INTERVAL"].as<std::size_t>();
+  }
+  root.removeMember("DISTRIBUTED");
+  if (!root["SEED"].isIntegral()) root["SEED"] = Json::Value::UInt64(seed);
+  if (config.initialize(root)) return -1;
+
+  /*
+   * A body feels mutual gravity from every other
+   * body, not just the ones near its slab.
+   */
+  if (config.mutual_grav_constant != 0.0f) {
+    std::cerr << "ERROR: MUTUAL_GRAVITY isn't supported in distributed runs." << std::endl;
+    return -1;
+  }
+
+  const int rank = transport.get_rank(), size = transport.get_size();
+  const float width = (config.boundary[1] - config.boundary[0]) / static_cast<float>(size);
+  slab_min = rank == 0 ? -INFINITY : config.boundary[0] + width * static_cast<float>(rank);
+  slab_max = rank == size - 1 ? INFINITY : config.boundary[0] + width * static_cast<float>(rank + 1);
+
+  std::vector<ConfigSphere> local;
+  std::vector<std::uint32_t> local_global;
+  std::uint32_t global_id = 0;
+  auto keep = [&](const ConfigSphere &sphere) {
+    max_radius = std::max(max_radius, sphere.r);
+    if (sphere.x >= slab_min && sphere.x < slab_max) {
+      local.push_back(sphere);
+      local_global.push_back(global_id);
+    }
+    ++global_id;
+  };
+  for (const auto &body : config.bodies) std::visit(keep, body);
+  for (const auto &body_file : config.body_files) {
+    for (std::size_t i = 0; i < body_file.size(); ++i) keep(body_file.data()[i]);
+  }
+  config.bodies.clear();
+  config.body_files.clear();
+  config.num_bodies = 0;
+
+  engine = std::make_unique<Engine>(config);
+  std::vector<unsigned int> new_ids;
+  if (engine->add_bodies(local, new_ids)) return -1;
+  for (std::size_t i = 0; i < new_ids.size(); ++i) {
+    if (new_ids[i] >= global_of.size()) global_of.resize(new_ids[i] + 1);
+    global_of[new_ids[i]] = local_global[i];
+  }
+  return 0;
+}
+
+/*
+ * Move the boundary between two neighbors a
+ * part of the way towards the busier one, by at
+ * most half the narrower slab (measured inside
+ * the boundary box, as the outer slabs have no
+ * outer edge). Both compute the same boundary
+ * from the same numbers, so they always agree
+ * on it.
+ */
+static float balanced_boundary(const SlabLoad &left, const SlabLoad &right, const float boundary, const float box_min, const float box_max) {
+  const std::uint64_t total = left.num_owned + right.num_owned;
+  if (total == 0) return boundary;
+  const float imbalance = (static_cast<float>(left.num_owned) - static_cast<float>(right.num_owned)) / static_cast<float>(total);
+  const float left_width = std::min(left.slab_max, box_max) - std::max(left.slab_min, box_min);
+  const float right_width = std::min(right.slab_max, box_max) - std::max(right.slab_min, box_min);
+  return boundary - 0.5f * imbalance * std::max(std::min(left_width, right_width), 0.0f);
+}
+
+int Domain::balance() {
+  const int rank = transport.get_rank(), size = transport.get_size();
+  const SlabLoad mine{get_num_owned(), slab_min, slab_max};
+  std::vector<char> out(sizeof(mine)), in;
+  memcpy(out.data(), &mine, sizeof(mine));
+  float new_min = slab_min, new_max = slab_max;
+
+  for (const int peer : {rank - 1, rank + 1}) {
+    if (peer < 0 || peer >= size) continue;
+    if (transport.exchange(peer, out, in)) return -1;
+    SlabLoad theirs;
+    if (in.size() != sizeof(theirs)) {
+      std::cerr << "ERROR: Malformed message from rank " << peer << "." << std::endl;
+      return -1;
+    }
+    memcpy(&theirs, in.data(), sizeof(theirs));
+    if (peer < rank) new_min = balanced_boundary(theirs, mine, slab_min, config.boundary[0], config.boundary[1]);
+    else new_max = balanced_boundary(mine, theirs, slab_max, config.boundary[0], config.boundary[1]);
+  }
+  slab_min = new_min;
+  slab_max = new_max;
+  return 0;
+}
+
+/*
+ * Take in a neighbor's migrants, which become
+ * ours, and its ghosts, which only stay for
+ * this tick.
+ */
+int Domain::add_received(const std::vector<char>& in) {
+  std::vector<DomainBody> migrants, ghosts;
+  std::size_t offset = 0;
+  if (unpack_bodies(in, offset, migrants) || unpack_bodies(in, offset, ghosts) || offset != in.size()) {
+    std::cerr << "ERROR: Malformed message from a neighboring rank." << std::endl;
+    return -1;
+  }
+
+  std::vector<BodyState> states;
+  std::vector<unsigned int> new_ids;
+  for (const auto &body : migrants) states.push_back(body.state);
+  if (engine->add_body_states(states, new_ids)) return -1;
+  for (std::size_t i = 0; i < new_ids.size(); ++i) {
+    if (new_ids[i] >= global_of.size()) global_of.resize(new_ids[i] + 1);
+    global_of[new_ids[i]] = migrants[i].global_id;
+  }
+
+  states.clear();
+  for (const auto &body : ghosts) states.push_back(body.state);
+  if (engine->add_body_states(states, new_ids)) return -1;
+  ghost_ids.insert(ghost_ids.end(), new_ids.begin(), new_ids.end());
+  return 0;
+}
+
+/*
+ * A body can only touch a neighbor's body this
+ * tick if both are within their radii plus a
+ * tick's worth of movement of the boundary.
+ * Both sides of a boundary must send ghosts as
+ * far out, or a fast body could hit a slow one
+ * that was never sent across, so neighbors
+ * swap their fastest speed and largest radius
+ * and both go by the larger ones. Ghosts only
+ * go to the next slab, so it must be at least
+ * that wide.
+ */
+int Domain::ghost_reach(float reach[2]) {
+  const int rank = transport.get_rank(), size = transport.get_size();
+  const SlabReach mine{engine->get_max_speed(), max_radius};
+  std::vector<char> out(sizeof(mine)), in;
+  memcpy(out.data(), &mine, sizeof(mine));
+  const float width = std::min(slab_max, config.boundary[1]) - std::max(slab_min, config.boundary[0]);
+
+  for (std::size_t side = 0; side < 2; ++side) {
+    reach[side] = 0.0f;
+    const int peer = side ? rank + 1 : rank - 1;
+    if (peer < 0 || peer >= size) continue;
+    if (transport.exchange(peer, out, in)) return -1;
+    SlabReach theirs;
+    if (in.size() != sizeof(theirs)) {
+      std::cerr << "ERROR: Malformed message from rank " << peer << "." << std::endl;
+      return -1;
+    }
+    memcpy(&theirs, in.data(), sizeof(theirs));
+    reach[side] = 2.0f * (std::max(mine.max_radius, theirs.max_radius) + std::max(mine.max_speed, theirs.max_speed) * dt);
+    if (width < reach[side]) {
+      std::cerr << "ERROR: The slab of rank " << rank << " is " << width << " wide, but bodies can reach " << reach[side]
+		<< " into it in one tick. Use fewer processes or a shorter DT." << std::endl;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * One tick. Bodies that left our slab move to
+ * the neighbor, and bodies within reach of a
+ * boundary are sent across as ghosts.
+ */
+int Domain::step() {
+  const int rank = transport.get_rank(), size = transport.get_size();
+  if (balance_interval && tick && tick % balance_interval == 0 && balance()) return -1;
+
+  const auto &pos = engine->get_pos();
+  const auto &ids = engine->get_ids();
+  float reach[2];
+  if (ghost_reach(reach)) return -1;
+  std::vector<unsigned int> migrant_ids[2], ghost_out_ids[2];
+  for (std::size_t i = 0; i < engine->get_num_bodies(); ++i) {
+    const float x = pos.x[i];
+    if (x < slab_min) migrant_ids[0].push_back(ids[i]);
+    else if (x >= slab_max) migrant_ids[1].push_back(ids[i]);
+    else {
+      if (rank > 0 && x < slab_min + reach[0]) ghost_out_ids[0].push_back(ids[i]);
+      if (rank < size - 1 && x >= slab_max - reach[1]) ghost_out_ids[1].push_back(ids[i]);
+    }
+  }
+
+  std::vector<char> out[2];
+  std::vector<BodyState> states;
+  for (std::size_t side = 0; side < 2; ++side) {
+    for (const auto *side_ids : {&migrant_ids[side], &ghost_out_ids[side]}) {
+      if (engine->get_body_states(*side_ids, states)) return -1;
+      std::vector<DomainBody> bodies(states.size());
+      for (std::size_t k = 0; k < states.size(); ++k) bodies[k] = DomainBody{global_of[(*side_ids)[k]], states[k]};
+      pack_bodies(out[side], bodies);
+    }
+    if (engine->remove_bodies(migrant_ids[side])) return -1;
+  }
+
+  std::vector<char> in;
+  if (rank > 0 && (transport.exchange(rank - 1, out[0], in) || add_received(in))) return -1;
+  if (rank < size - 1 && (transport.exchange(rank + 1, out[1], in) || add_received(in))) return -1;
+
+  engine->update(dt);
+  if (!ghost_ids.empty() && engine->remove_bodies(ghost_ids)) return -1;
+  ghost_ids.clear();
+  ++tick;
+  return 0;
+}
+
+/*
+ * Run every tick, then pass every body down
+ * the chain to rank 0.
+ */
+int Domain::run() {
+  for (std::size_t i = 0; i < ticks; ++i) {
+    if (step()) return -1;
+  }
+
+  const int rank = transport.get_rank(), size = transport.get_size();
+  const std::vector<unsigned int> &ids = engine->get_ids();
+  const std::vector<unsigned int> owned(ids.begin(), ids.begin() + static_cast<std::ptrdiff_t>(engine->get_num_bodies()));
+  std::vector<BodyState> states;
+  if (engine->get_body_states(owned, states)) return -1;
+  result.resize(states.size());
+  for (std::size_t k = 0; k < states.size(); ++k) result[k] = DomainBody{global_of[owned[k]], states[k]};
+
+  std::vector<char> out, in;
+  if (rank < size - 1) {
+    std::size_t offset = 0;
+    if (transport.exchange(rank + 1, out, in)) return -1;
+    if (unpack_bodies(in, offset, result) || offset != in.size()) {
+      std::cerr << "ERROR: Malformed message from rank " << rank + 1 << "." << std::endl;
+      return -1;
+    }
+  }
+  if (rank > 0) {
+    pack_bodies(out, result);
+    result.clear();
+    if (transport.exchange(rank - 1, out, in)) return -1;
+  }
+  std::sort(result.begin(), result.end(), [](const DomainBody &a, const DomainBody &b) { return a.global_id < b.global_id; });
+  return 0;
+}
+
+/*
+ * Save the gathered bodies (on rank 0) as a
+ * checkpoint, which can be viewed with -c.
+ */
+int Domain::save(const std::string& file_name) {
+  Engine world(config);
+  std::vector<BodyState> states(result.size());
+  std::vector<unsigned int> new_ids;
+  for (std::size_t k = 0; k < result.size(); ++k) states[k] = result[k].state;
+  if (world.add_body_states(states, new_ids)) return -1;
+  return world.save_checkpoint(file_name);
+}
@@ -30,6 +30,8 @@ static constexpr int DEFAULT_HEIGHT = 600;
  */
 extern "C" char _binary_shaders_vertex_glsl_start;
 extern "C" char _binary_shaders_fragment_glsl_start;
+extern "C" char _binary_shaders_impostor_vertex_glsl_start;
+extern "C" char _binary_shaders_impostor_fragment_glsl_start;
 
 /*
  * Unfortunately, we have to store global state
@@ -88,16 +90,19 @@ static constexpr unsigned int icosphere_base_tris[20][3] = {
 };
 
 /*
- * Some constants. ICOSPHERE_ITERS defines how refined
- * our sphere mesh will be. UNIFORM_SIZE defines how
- * many uniform model and normal matrices we can pass
- * to our shaders at once for instanced rendering.
+ * Some constants. LOD_PIXELS holds the projected
+ * radius (in pixels) a sphere needs to be drawn with
+ * each level of detail above the coarsest.
+ * FOV is the vertical field of view, in degrees.
+ * IMPOSTOR_BODIES is how many bodies a scene needs
+ * to start out drawn with impostors (I toggles).
  * MOVE_SPEED is how fast the camera moves in space.
  * SENSISITIVITY is how fast the camera turns in
  * response to mouse movement.
  */
-static constexpr unsigned int ICOSPHERE_ITERS = 2;
-static constexpr unsigned int UNIFORM_SIZE = 120;
+static constexpr float LOD_PIXELS[NUM_LODS - 1] = {4.0f, 16.0f, 64.0f};
+static constexpr float FOV = 80.0f;
+static constexpr std::size_t IMPOSTOR_BODIES = 1000000;
 static constexpr float MOVE_SPEED = 40.0f;
 static constexpr float SENSITIVITY = 1.0f;
 
@@ -105,14 +110,29 @@ static constexpr float SENSITIVITY = 1.0f;
  * Graphics constructor. Dead simple since actual
  * initialization happens in initialize.
  */
-Graphics::Graphics(Engine &engine_i): window(nullptr), engine(engine_i), identity(1.0f),
-					    cup(0.0f, 1.0f, 0.0f), cx(0.0f), cy(0.0f), cz(0.0f), cphi(0.0f), ctheta(0.0f) {}
+Graphics::Graphics(Engine &engine_i): window(nullptr), egl_display(EGL_NO_DISPLAY), egl_context(EGL_NO_CONTEXT), egl_surface(EGL_NO_SURFACE),
+					    fbo(0), fbo_renderbuffers{}, engine(engine_i), impostors(false),
+					    cup(0.0f, 1.0f, 0.0f), instance_buffer(0), instance_map(nullptr),
+					    instance_capacity(0), section_instances(0), fences{}, frame(0), cx(0.0f), cy(0.0f), cz(0.0f), cphi(0.0f), ctheta(0.0f) {}
 
 Graphics::~Graphics() {
+  if (instance_buffer) {
+    for (unsigned int section = 0; section < FRAMES_IN_FLIGHT; ++section) wait_for_section(section);
+    glDeleteBuffers(1, &instance_buffer);
+  }
+  if (egl_display != EGL_NO_DISPLAY) {
+    if (fbo) {
+      glDeleteFramebuffers(1, &fbo);
+      glDeleteRenderbuffers(2, fbo_renderbuffers);
+    }
+    eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (egl_surface != EGL_NO_SURFACE) eglDestroySurface(egl_display, egl_surface);
+    if (egl_context != EGL_NO_CONTEXT) eglDestroyContext(egl_display, egl_context);
+    eglTerminate(egl_display);
+    return;
+  }
   glfwDestroyWindow(window);
   glfwTerminate();
-  delete[] model_cache;
-  delete[] normal_cache;
 }
 
 /*
@@ -129,7 +149,8 @@ std::pair<unsigned int, unsigned int> Graphics::calc_icosphere_size(const unsign
 }
 
 /*
- * Our initialization function.
+ * Our initialization function for drawing to a
+ * window.
  */
 int Graphics::initialize() {
   /*
@@ -154,19 +175,169 @@ int Graphics::initialize() {
   glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
   glfwSetCursorPosCallback(window, mouse_callback); 
   glViewport(0, 0, width, height);
+
+  return initialize_pipeline();
+}
+
+/*
+ * Our initialization function for drawing offscreen,
+ * with no window system at all. We get an OpenGL
+ * context from EGL, preferably on Mesa's surfaceless
+ * platform, which needs no display server. Frames are
+ * drawn into a framebuffer object of the requested
+ * size. If the context can't be made current without
+ * a surface, we give it a pbuffer to satisfy EGL,
+ * but still draw into the framebuffer object.
+ */
+int Graphics::initialize_headless(const int frame_width, const int frame_height) {
+  width = frame_width;
+  height = frame_height;
+
+  const char* const client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  if (client_extensions && strstr(client_extensions, "EGL_MESA_platform_surfaceless")) {
+    egl_display = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+  }
+  if (egl_display == EGL_NO_DISPLAY) egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, nullptr, nullptr)) {
+    std::cerr << "ERROR: Couldn't initialize EGL. Aborting." << std::endl;
+    egl_display = EGL_NO_DISPLAY;
+    return -1;
+  }
+
+  const EGLint config_attribs[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+  const EGLint context_attribs[] = {EGL_CONTEXT_MAJOR_VERSION, 4, EGL_CONTEXT_MINOR_VERSION, 5,
+				    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT, EGL_NONE};
+  EGLConfig config;
+  EGLint num_configs = 0;
+  if (!eglBindAPI(EGL_OPENGL_API) || !eglChooseConfig(egl_display, config_attribs, &config, 1, &num_configs) || !num_configs) {
+    std::cerr << "ERROR: Couldn't find an EGL config for OpenGL. Aborting." << std::endl;
+    return -1;
+  }
+  egl_context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, context_attribs);
+  if (egl_context == EGL_NO_CONTEXT) {
+    std::cerr << "ERROR: Couldn't create an OpenGL 4.5 context with EGL. Aborting." << std::endl;
+    return -1;
+  }
+  if (!eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context)) {
+    const EGLint pbuffer_attribs[] = {EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE};
+    egl_surface = eglCreatePbufferSurface(egl_display, config, pbuffer_attribs);
+    if (egl_surface == EGL_NO_SURFACE || !eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context)) {
+      std::cerr << "ERROR: Couldn't make the EGL context current. Aborting." << std::endl;
+      return -1;
+    }
+  }
+
+  glGenFramebuffers(1, &fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glGenRenderbuffers(2, fbo_renderbuffers);
+  glBindRenderbuffer(GL_RENDERBUFFER, fbo_renderbuffers[0]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, fbo_renderbuffers[0]);
+  glBindRenderbuffer(GL_RENDERBUFFER, fbo_renderbuffers[1]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, fbo_renderbuffers[1]);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    std::cerr << "ERROR: Couldn't create a " << width << "x" << height << " framebuffer. Aborting." << std::endl;
+    return -1;
+  }
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+  glViewport(0, 0, width, height);
+
+  return initialize_pipeline();
+}
+
+/*
+ * Initialization shared by both of the above, once
+ * there's a current OpenGL context.
+ */
+int Graphics::initialize_pipeline() {
   glEnable(GL_DEPTH_TEST);
   glDepthMask(GL_TRUE);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
   /*
    * Load in shaders from linked object files,
-   * and compile them.
+   * and compile them into our two programs: one
+   * for meshes, one for sphere impostors.
+   */
+  if (create_shader_program(&_binary_shaders_vertex_glsl_start, &_binary_shaders_fragment_glsl_start, shader_program)) return -1;
+  if (create_shader_program(&_binary_shaders_impostor_vertex_glsl_start, &_binary_shaders_impostor_fragment_glsl_start, impostor_program)) return -1;
+
+  proj_view_loc = glGetUniformLocation(shader_program, "proj_view");
+  impostor_proj_view_loc = glGetUniformLocation(impostor_program, "proj_view");
+  impostor_cam_pos_loc = glGetUniformLocation(impostor_program, "cam_pos");
+  impostors = engine.get_num_bodies() >= IMPOSTOR_BODIES;
+  
+  /*
+   * Allocate our caches and create our OpenGL buffers
+   * and arrays. These hold information about the various
+   * meshes we use in our simulation. Each VAO / VBO / 
+   * optionally EBO combo represents a single mesh.
+   * Initialize our meshes.
    */
-  const char* const vertex_shader_text = &_binary_shaders_vertex_glsl_start;
-  const char* const fragment_shader_text = &_binary_shaders_fragment_glsl_start;
+  if (allocate_instance_buffer(engine.get_num_bodies())) return -1;
+
+  initialize_sphere_mesh();
+  initialize_walls_mesh();
+  glGenVertexArrays(1, &impostorVAO);
+
+  return 0;
+}
+
+/*
+ * (Re)create the persistently mapped instance
+ * buffer, with room for capacity bodies per frame in
+ * flight. Sections start at offsets the GL allows us
+ * to bind storage buffers at.
+ */
+int Graphics::allocate_instance_buffer(const std::size_t capacity) {
+  if (instance_buffer) {
+    for (unsigned int section = 0; section < FRAMES_IN_FLIGHT; ++section) wait_for_section(section);
+    glDeleteBuffers(1, &instance_buffer);
+    instance_buffer = 0;
+    instance_map = nullptr;
+  }
+
+  int offset_alignment = 0;
+  glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &offset_alignment);
+  const std::size_t instances_per_alignment = std::max<std::size_t>(1, static_cast<std::size_t>(offset_alignment) / sizeof(InstanceData));
+  section_instances = (capacity + 1 + instances_per_alignment - 1) / instances_per_alignment * instances_per_alignment;
+
+  const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  const auto buffer_size = static_cast<GLsizeiptr>(FRAMES_IN_FLIGHT * section_instances * sizeof(InstanceData));
+  glGenBuffers(1, &instance_buffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, instance_buffer);
+  glBufferStorage(GL_SHADER_STORAGE_BUFFER, buffer_size, nullptr, flags);
+  instance_map = static_cast<InstanceData*>(glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, buffer_size, flags));
+  if (!instance_map) {
+    std::cerr << "ERROR: Couldn't map the instance buffer." << std::endl;
+    return -1;
+  }
+  instance_capacity = capacity;
+  return 0;
+}
+
+/*
+ * Block until the GPU is done reading a section of
+ * the instance buffer. With several frames in
+ * flight, the fence has almost always signaled by
+ * the time we come back to a section.
+ */
+void Graphics::wait_for_section(const unsigned int section) {
+  if (!fences[section]) return;
+  while (glClientWaitSync(fences[section], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+  glDeleteSync(fences[section]);
+  fences[section] = nullptr;
+}
+
+/*
+ * Compile a vertex and fragment shader and link
+ * them into a shader program.
+ */
+int Graphics::create_shader_program(const char* const vertex_shader_text, const char* const fragment_shader_text, unsigned int& program) {
   int shader_comp_success = 0;
 
-  vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+  const unsigned int vertex_shader = glCreateShader(GL_VERTEX_SHADER);
   glShaderSource(vertex_shader, 1, &vertex_shader_text, nullptr);
   glCompileShader(vertex_shader);
   glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &shader_comp_success);
@@ -179,7 +350,7 @@ int Graphics::initialize() {
     return -1;
   }
 
-  fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+  const unsigned int fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
   glShaderSource(fragment_shader, 1, &fragment_shader_text, nullptr);
   glCompileShader(fragment_shader);
   glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &shader_comp_success);
@@ -192,43 +363,21 @@ int Graphics::initialize() {
     return -1;
   }
 
-  /*
-   * Link compiled shaders into a shader program.
-   */
-  shader_program = glCreateProgram();
-  glAttachShader(shader_program, vertex_shader);
-  glAttachShader(shader_program, fragment_shader);
-  glLinkProgram(shader_program);
-  glGetShaderiv(shader_program, GL_LINK_STATUS, &shader_comp_success);
+  program = glCreateProgram();
+  glAttachShader(program, vertex_shader);
+  glAttachShader(program, fragment_shader);
+  glLinkProgram(program);
+  glGetProgramiv(program, GL_LINK_STATUS, &shader_comp_success);
   if (!shader_comp_success) {
     char* const error_log = new char[1024];
-    glGetShaderInfoLog(shader_program, 1024, nullptr, error_log);
+    glGetProgramInfoLog(program, 1024, nullptr, error_log);
     std::cerr << "ERROR: Couldn't link the complete shader program. Here's the GL error log:" << std::endl;
     std::cerr << error_log << std::endl;
     delete[] error_log;
     return -1;
   }
-  glUseProgram(shader_program);
   glDeleteShader(vertex_shader);
   glDeleteShader(fragment_shader);
-
-  proj_view_loc = glGetUniformLocation(shader_program, "proj_view");
-  model_loc = glGetUniformLocation(shader_program, "model");
-  normal_loc = glGetUniformLocation(shader_program, "normal");
-  
-  /*
-   * Allocate our caches and create our OpenGL buffers
-   * and arrays. These hold information about the various
-   * meshes we use in our simulation. Each VAO / VBO / 
-   * optionally EBO combo represents a single mesh.
-   * Initialize our meshes.
-   */
-  model_cache = new glm::mat4[engine.get_num_bodies() + UNIFORM_SIZE];
-  normal_cache = new glm::mat4[engine.get_num_bodies() + UNIFORM_SIZE];
-
-  initialize_sphere_mesh();
-  initialize_walls_mesh();
-
   return 0;
 }
 
@@ -243,16 +392,15 @@ int Graphics::initialize() {
  * of already inserted point, where each point's
  * value is its index in the points array.
  */
-std::pair<std::vector<float>, std::vector<unsigned int>> Graphics::create_icosphere_mesh() {
+std::pair<std::vector<float>, std::vector<unsigned int>> Graphics::create_icosphere_mesh(const unsigned int iters) {
   /*
    * Initialize our vectors with the 0 iteration
    * icosphere (a.k.a. an icosahedron).
    */
-  auto icosphere_size = calc_icosphere_size(ICOSPHERE_ITERS);
+  auto icosphere_size = calc_icosphere_size(iters);
   std::vector<float> icosphere_pts(&icosphere_base_pts[0][0], &icosphere_base_pts[0][0] + 12 * 3);
   std::vector<unsigned int> icosphere_tris(&icosphere_base_tris[0][0], &icosphere_base_tris[0][0] + 20 * 3);
-  num_pts = icosphere_size.first;
-  num_tris = icosphere_size.second;
+  icosphere_pts.reserve(icosphere_size.first * 3);
   /*
    * Normalize to radius 1.
    */
@@ -269,9 +417,9 @@ std::pair<std::vector<float>, std::vector<unsigned int>> Graphics::create_icosph
   for (unsigned int i = 0; i < 12; ++i) {
     already_inserted_pts.insert({{icosphere_base_pts[i][0], icosphere_base_pts[i][1], icosphere_base_pts[i][2]}, i * 3});
   }
-  for (unsigned int i = 0; i < ICOSPHERE_ITERS; ++i) {
+  for (unsigned int i = 0; i < iters; ++i) {
     std::vector<unsigned int> new_tris;
-    new_tris.reserve(num_tris * 3);
+    new_tris.reserve(icosphere_tris.size() * 4);
 
     unsigned int old_pts_end = static_cast<unsigned int>(icosphere_pts.size() / 3);
     for (unsigned int t = 0; t < icosphere_tris.size(); t += 3) {
@@ -348,46 +496,48 @@ std::pair<std::vector<float>, std::vector<unsigned int>> Graphics::create_icosph
 }
 
 /*
- * Initialize the GL objects for our meshes.
+ * Initialize the GL objects for our meshes. Each
+ * level of detail gets its own sphere mesh.
  */
 void Graphics::initialize_sphere_mesh() {
-  /*
-   * Calculate the mesh for the icosphere.
-   */
-  auto icosphere = create_icosphere_mesh();
-  auto& icosphere_pts = icosphere.first;
-  auto& icosphere_tris = icosphere.second;
-
-  /*
-   * On an icosphere, each point is its own normal.
-   */
-  std::vector<float> icosphere_pts_with_norms;
-  icosphere_pts_with_norms.reserve(icosphere_pts.size());
-  for (std::size_t i = 0; i < icosphere_pts.size(); i += 3) {
+  glGenVertexArrays(NUM_LODS, sphereVAOs);
+  glGenBuffers(NUM_LODS, sphereVBOs);
+  glGenBuffers(NUM_LODS, sphereEBOs);
+  for (unsigned int lod = 0; lod < NUM_LODS; ++lod) {
+    /*
+     * Calculate the mesh for the icosphere.
+     */
+    auto icosphere = create_icosphere_mesh(lod);
+    auto& icosphere_pts = icosphere.first;
+    auto& icosphere_tris = icosphere.second;
+    lod_tris[lod] = static_cast<unsigned int>(icosphere_tris.size() / 3);
+
+    /*
+     * On an icosphere, each point is its own normal.
+     */
+    std::vector<float> icosphere_pts_with_norms;
+    icosphere_pts_with_norms.reserve(icosphere_pts.size() * 2);
+    for (std::size_t i = 0; i < icosphere_pts.size(); i += 3) {
       icosphere_pts_with_norms.push_back(icosphere_pts.at(i));
       icosphere_pts_with_norms.push_back(icosphere_pts.at(i+1));
       icosphere_pts_with_norms.push_back(icosphere_pts.at(i+2));
       icosphere_pts_with_norms.push_back(icosphere_pts.at(i));
       icosphere_pts_with_norms.push_back(icosphere_pts.at(i+1));
       icosphere_pts_with_norms.push_back(icosphere_pts.at(i+2));
-  }
-
-  glGenVertexArrays(1, &sphereVAO);
-  glBindVertexArray(sphereVAO);
+    }
 
-  glGenBuffers(1, &sphereVBO);
-  glBindBuffer(GL_ARRAY_BUFFER, sphereVBO);
+    glBindVertexArray(sphereVAOs[lod]);
+    glBindBuffer(GL_ARRAY_BUFFER, sphereVBOs[lod]);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sphereEBOs[lod]);
 
-  glGenBuffers(1, &sphereEBO);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sphereEBO);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), nullptr);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), reinterpret_cast<void*>(3 * sizeof(float)));
+    glEnableVertexAttribArray(1);
 
-  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), nullptr);
-  glEnableVertexAttribArray(0);
-  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), reinterpret_cast<void*>(3 * sizeof(float)));
-  glEnableVertexAttribArray(1);
-
-  glBufferData(GL_ARRAY_BUFFER, static_cast<long int>(icosphere_pts_with_norms.size() * sizeof(float)), icosphere_pts_with_norms.data(), GL_STATIC_DRAW);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, static_cast<long int>(icosphere_tris.size() * sizeof(unsigned int)), icosphere_tris.data(), GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, static_cast<long int>(icosphere_pts_with_norms.size() * sizeof(float)), icosphere_pts_with_norms.data(), GL_STATIC_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, static_cast<long int>(icosphere_tris.size() * sizeof(unsigned int)), icosphere_tris.data(), GL_STATIC_DRAW);
+  }
 }
 
 void Graphics::initialize_walls_mesh() {
@@ -442,75 +592,199 @@ void Graphics::initialize_walls_mesh() {
 
 /*
  * Render tick function that occurs every frame. First,
- * we handle user input. Then, we clear the screen buffer.
+ * we handle user input. Then, we draw the frame and
+ * swap buffers. To draw, we clear the screen buffer.
  * Next, we calculate various matrices / vectors related
- * to camera projection. Then, we, in parallel, calculate
- * the model and normal matrices for every body in our
- * scene. These matrices modify the position and normals
- * of our bodies, respectively. Next, we perform instanced
- * rendering of our bodies to minimize OpenGL API calls.
- * Finally, we swap buffers.
+ * to camera projection. Then, we, in parallel, cull the
+ * bodies outside the view frustum and sort the rest by
+ * level of detail into the instance buffer. Next, we
+ * perform instanced rendering of each level of detail
+ * to minimize OpenGL API calls.
  */
 void Graphics::render_tick(const float dt) {
   handle_input(dt);
+  draw_frame();
+  glfwSwapBuffers(window);
+  resized = false;
+  if (engine.get_cfl() > 0.0f) show_frame_ticks();
+}
 
+/*
+ * Only touch the title when the number of
+ * ticks changes, as setting it goes through
+ * the window system.
+ */
+void Graphics::show_frame_ticks() {
+  const std::size_t frame_ticks = engine.get_frame_ticks();
+  if (frame_ticks == shown_frame_ticks) return;
+  shown_frame_ticks = frame_ticks;
+  char title[128];
+  snprintf(title, sizeof(title), "Hummingbird - %zu ticks/frame, %.3g ms/tick", frame_ticks, 1000.0 * static_cast<double>(engine.get_frame_step()));
+  glfwSetWindowTitle(window, title);
+}
+
+/*
+ * Draw one frame into the current framebuffer.
+ */
+void Graphics::draw_frame() {
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
   if (resized) {
-    proj = glm::perspective(glm::radians(80.0f), static_cast<float>(width) / static_cast<float>(height), 0.1f, 100000.0f);
+    proj = glm::perspective(glm::radians(FOV), static_cast<float>(width) / static_cast<float>(height), 0.1f, 100000.0f);
   }
   const glm::vec3 cdir = glm::vec3(cos(ctheta) * cos(cphi), sin(cphi), sin(ctheta) * cos(cphi));
   const glm::vec3 cpos = glm::vec3(cx, cy, cz);
   const glm::mat4 view = glm::lookAt(cpos, cpos + cdir, cup);
   const glm::mat4 proj_view = proj * view;
-  glUniformMatrix4fv(proj_view_loc, 1, GL_FALSE, glm::value_ptr(proj_view));
 
-  glDisable(GL_CULL_FACE);
-  glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-  glBindVertexArray(wallsVAO);
-  
-  model_cache[0] = identity;
-  normal_cache[0] = identity;
-  glUniformMatrix4fv(model_loc, 1, GL_FALSE, glm::value_ptr(model_cache[0]));
-  glUniformMatrix4fv(normal_loc, 1, GL_FALSE, glm::value_ptr(normal_cache[0]));
-  glDrawElements(GL_QUADS, 24, GL_UNSIGNED_INT, 0);
-
-#pragma omp parallel for
-  for (std::size_t i = 0; i < engine.get_num_bodies(); ++i) {
-    const Collider* coll = engine.get_colliders()[i].get();
-    if (const SphereCollider* sphere_coll = dynamic_cast<const SphereCollider*>(coll)) {
-      const float scale_factor = sphere_coll->radius;
-      const auto& quat = engine.get_ang_pos()[i];
-      const glm::mat4 model_rot = glm::mat4_cast(glm::quat(quat.w, quat.x, quat.y, quat.z));
-      const glm::mat4 model_pos = glm::translate(identity, glm::vec3(engine.get_pos().x[i], engine.get_pos().y[i], engine.get_pos().z[i]));
-      const glm::mat4 model_scale = glm::scale(identity, glm::vec3(scale_factor, scale_factor, scale_factor));
-      model_cache[i] = model_pos * model_rot * model_scale;
-      normal_cache[i] = glm::inverse(model_cache[i]);
+  /*
+   * Bodies may have been added since the last
+   * frame, in which case we grow our instance
+   * buffer (geometrically, so that a steady stream
+   * of new bodies rarely reallocates).
+   */
+  const std::size_t num_bodies = engine.get_num_bodies();
+  if (num_bodies > instance_capacity && allocate_instance_buffer(std::max(2 * instance_capacity, num_bodies))) return;
+
+  const unsigned int section = frame % FRAMES_IN_FLIGHT;
+  wait_for_section(section);
+  InstanceData* const instances = instance_map + section * section_instances;
+  instances[0] = InstanceData{glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), glm::vec4(0.0f, 0.0f, 0.0f, 1.0f)};
+
+  /*
+   * The planes of the view frustum, pointing inwards,
+   * read off the rows of the projection-view matrix.
+   * A sphere is out of view when it lies entirely
+   * behind any one of them.
+   */
+  const glm::mat4 rows = glm::transpose(proj_view);
+  glm::vec4 planes[6] = {rows[3] + rows[0], rows[3] - rows[0], rows[3] + rows[1], rows[3] - rows[1], rows[3] + rows[2], rows[3] - rows[2]};
+  for (auto& plane : planes) plane /= glm::length(glm::vec3(plane));
+  const float pixels_per_unit = static_cast<float>(height) / (2.0f * tan(glm::radians(FOV) / 2.0f));
+
+  /*
+   * Cull and bin bodies in two parallel passes over
+   * the same static schedule. The first pass picks
+   * each body's level of detail by its projected
+   * radius and counts, per thread, how many bodies
+   * go in each level. After a prefix sum over those
+   * counts, the second pass writes each visible body
+   * into its level's range of the instance section,
+   * so that every level is contiguous.
+   */
+  const auto& pos = engine.get_pos();
+  const auto& quat = engine.get_ang_pos();
+  const auto& colliders = engine.get_colliders();
+  body_lods.resize(num_bodies);
+  std::size_t lod_starts[NUM_LODS + 1] = {};
+#pragma omp parallel
+  {
+#pragma omp single
+    thread_lod_counts.assign(static_cast<std::size_t>(omp_get_num_threads()), {});
+    auto& counts = thread_lod_counts[static_cast<std::size_t>(omp_get_thread_num())];
+#pragma omp for schedule(static)
+    for (std::size_t i = 0; i < num_bodies; ++i) {
+      const SphereCollider* sphere_coll = dynamic_cast<const SphereCollider*>(colliders[i].get());
+      const float radius = sphere_coll ? sphere_coll->radius : 0.0f;
+      const glm::vec4 center(pos.x[i], pos.y[i], pos.z[i], 1.0f);
+      unsigned char lod = 0;
+      for (const auto& plane : planes) {
+	if (glm::dot(plane, center) < -radius) {
+	  lod = NUM_LODS;
+	  break;
+	}
+      }
+      if (lod < NUM_LODS && !impostors) {
+	const float dist = glm::length(glm::vec3(center) - cpos);
+	const float pixels = dist > radius ? radius * pixels_per_unit / dist : LOD_PIXELS[NUM_LODS - 2];
+	while (lod < NUM_LODS - 1 && pixels >= LOD_PIXELS[lod]) ++lod;
+      }
+      if (lod < NUM_LODS) ++counts[lod];
+      body_lods[i] = lod;
+    }
+#pragma omp single
+    {
+      for (unsigned int lod = 0; lod < NUM_LODS; ++lod) {
+	lod_starts[lod + 1] = lod_starts[lod];
+	for (const auto& thread_counts : thread_lod_counts) lod_starts[lod + 1] += thread_counts[lod];
+      }
+      std::size_t thread_start[NUM_LODS];
+      for (unsigned int lod = 0; lod < NUM_LODS; ++lod) thread_start[lod] = lod_starts[lod];
+      for (auto& thread_counts : thread_lod_counts) {
+	for (unsigned int lod = 0; lod < NUM_LODS; ++lod) {
+	  const std::size_t count = thread_counts[lod];
+	  thread_counts[lod] = thread_start[lod];
+	  thread_start[lod] += count;
+	}
+      }
+    }
+#pragma omp for schedule(static)
+    for (std::size_t i = 0; i < num_bodies; ++i) {
+      const unsigned char lod = body_lods[i];
+      if (lod == NUM_LODS) continue;
+      const SphereCollider* sphere_coll = dynamic_cast<const SphereCollider*>(colliders[i].get());
+      const float radius = sphere_coll ? sphere_coll->radius : 0.0f;
+      instances[1 + counts[lod]++] = InstanceData{glm::vec4(pos.x[i], pos.y[i], pos.z[i], radius), glm::vec4(quat.x[i], quat.y[i], quat.z[i], quat.w[i])};
     }
   }
+  glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, instance_buffer, static_cast<GLintptr>(section * section_instances * sizeof(InstanceData)),
+		    static_cast<GLsizeiptr>(section_instances * sizeof(InstanceData)));
 
-  glEnable(GL_CULL_FACE);
+  glUseProgram(shader_program);
+  glUniformMatrix4fv(proj_view_loc, 1, GL_FALSE, glm::value_ptr(proj_view));
+  glDisable(GL_CULL_FACE);
+  glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+  glBindVertexArray(wallsVAO);
+  glDrawElementsInstancedBaseInstance(GL_QUADS, 24, GL_UNSIGNED_INT, 0, 1, 0);
   glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-  glBindVertexArray(sphereVAO);
-
-  std::size_t i = 0;
-  if (engine.get_num_bodies() >= UNIFORM_SIZE) {
-    for (; i <= engine.get_num_bodies() - UNIFORM_SIZE; i += UNIFORM_SIZE) {
-      glUniformMatrix4fv(model_loc, static_cast<int>(UNIFORM_SIZE), GL_FALSE, glm::value_ptr(model_cache[i]));
-      glUniformMatrix4fv(normal_loc, static_cast<int>(UNIFORM_SIZE), GL_FALSE, glm::value_ptr(normal_cache[i]));
-      glDrawElementsInstanced(GL_TRIANGLES, static_cast<int>(num_tris * 3), GL_UNSIGNED_INT, 0, static_cast<int>(UNIFORM_SIZE));
-    }
+
+  /*
+   * In impostor mode, every visible body is in the
+   * first level of detail, and is drawn as a quad
+   * whose sphere the fragment shader ray casts.
+   */
+  if (impostors) {
+    glUseProgram(impostor_program);
+    glUniformMatrix4fv(impostor_proj_view_loc, 1, GL_FALSE, glm::value_ptr(proj_view));
+    glUniform3f(impostor_cam_pos_loc, cx, cy, cz);
+    glBindVertexArray(impostorVAO);
+    if (lod_starts[NUM_LODS]) glDrawArraysInstancedBaseInstance(GL_TRIANGLE_STRIP, 0, 4, static_cast<int>(lod_starts[NUM_LODS]), 1);
   }
-  for (; i < engine.get_num_bodies(); ++i) {
-    glUniformMatrix4fv(model_loc, 1, GL_FALSE, glm::value_ptr(model_cache[i]));
-    glUniformMatrix4fv(normal_loc, 1, GL_FALSE, glm::value_ptr(normal_cache[i]));
-    glDrawElements(GL_TRIANGLES, static_cast<int>(num_tris * 3), GL_UNSIGNED_INT, 0);
+  else {
+    glEnable(GL_CULL_FACE);
+    for (unsigned int lod = 0; lod < NUM_LODS; ++lod) {
+      const std::size_t count = lod_starts[lod + 1] - lod_starts[lod];
+      if (!count) continue;
+      glBindVertexArray(sphereVAOs[lod]);
+      glDrawElementsInstancedBaseInstance(GL_TRIANGLES, static_cast<int>(lod_tris[lod] * 3), GL_UNSIGNED_INT, 0, static_cast<int>(count), static_cast<unsigned int>(1 + lod_starts[lod]));
+    }
   }
 
-  glfwSwapBuffers(window);
+  fences[section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  ++frame;
+}
+
+/*
+ * Draw a frame offscreen and read it back as tightly
+ * packed RGB rows, top row first.
+ */
+const std::vector<unsigned char>& Graphics::export_frame() {
+  draw_frame();
   resized = false;
+  const std::size_t row_size = 3 * static_cast<std::size_t>(width);
+  frame_pixels.resize(row_size * static_cast<std::size_t>(height));
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, frame_pixels.data());
+  for (std::size_t top = 0, bottom = static_cast<std::size_t>(height) - 1; top < bottom; ++top, --bottom) {
+    std::swap_ranges(frame_pixels.begin() + static_cast<long int>(top * row_size), frame_pixels.begin() + static_cast<long int>((top + 1) * row_size),
+		     frame_pixels.begin() + static_cast<long int>(bottom * row_size));
+  }
+  return frame_pixels;
 }
 
+int Graphics::get_width() const { return width; }
+int Graphics::get_height() const { return height; }
+
 /*
  * Handle user input. For keyboard input, we move
  * the camera. For mouse input, we turn the camera.
@@ -555,6 +829,13 @@ void Graphics::handle_input(float dt) {
   else if (!glfwGetKey(window, GLFW_KEY_RIGHT)) {
     released_right = true;
   }
+  if (glfwGetKey(window, GLFW_KEY_I) && released_i) {
+    impostors = !impostors;
+    released_i = false;
+  }
+  else if (!glfwGetKey(window, GLFW_KEY_I)) {
+    released_i = true;
+  }
   if (glfwGetKey(window, GLFW_KEY_ENTER) && released_enter) {
     engine.paused = !engine.paused;
     released_enter = false;
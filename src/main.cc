@@ -11,12 +11,20 @@
     along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
 
 #include <iostream>
+#include <fstream>
+#include <cstdio>
 #include <cstddef>
 #include <chrono>
+#include <sstream>
+#include <string>
+#include <thread>
 
 #include <physics/engine.h>
 #include <interface.h>
 #include <cli.h>
+#include <sweep.h>
+#include <domain.h>
+#include <stream.h>
 
 /*
  * Get the current Unix time in microseconds.
@@ -28,12 +36,35 @@ inline unsigned long long micro_sec() {
 
 int runEngine(int argc, char **argv, bool record); 
 int runPlayback(int argc, char **argv); 
+int runExport(int argc, char **argv); 
+int runSweep(int argc, char **argv); 
+int runDistributed(int argc, char **argv); 
+int runServe(int argc, char **argv); 
+int runView(int argc, char **argv); 
+int runWorker(int argc, char **argv); 
+int runResume(int argc, char **argv); 
+int runSimulation(Engine &engine);
 
 /**
  * Entry point for the program. 
  * Handles the flags for what to eventually run. 
  */
 int main(int argc, char **argv) {
+  if ((argc == 4 || argc == 5) && strcmp(argv[1], "-e") == 0) { // export flag
+    return runExport(argc, argv); 
+  }
+  if (argc == 4 && strcmp(argv[1], "-d") == 0) { // distributed flag
+    return runDistributed(argc, argv); 
+  }
+  if (argc == 4 && strcmp(argv[1], "-n") == 0) { // stream server flag
+    return runServe(argc, argv); 
+  }
+  if (argc >= 4 && argc <= 6 && strcmp(argv[1], "-v") == 0) { // stream viewer flag
+    return runView(argc, argv); 
+  }
+  if (argc == 8 && strcmp(argv[1], "-w") == 0) { // worker of a distributed run, started by -d
+    return runWorker(argc, argv); 
+  }
   if (argc != 2 && argc != 3) {
     std::cerr << "Usage: " << argv[0] << "<json_file> (use -h for help)" << std::endl;
     return -1;
@@ -44,6 +75,17 @@ int main(int argc, char **argv) {
       std::cout << "Flags:\n-h\t help" << std::endl; 
       std::cout << "-p \t playback from provided json_file" << std::endl; 
       std::cout << "-r \t record simulation" << std::endl; 
+      std::cout << "-c \t resume simulation from provided checkpoint" << std::endl; 
+      std::cout << "-s \t run the parameter sweep in provided json_file, without graphics" << std::endl; 
+      std::cout << "-d \t run provided json_file over several processes, without graphics:" << std::endl; 
+      std::cout << "   \t " << argv[0] << " -d <json_file> <processes>" << std::endl; 
+      std::cout << "-n \t run provided json_file without graphics, streaming it to viewers:" << std::endl; 
+      std::cout << "   \t " << argv[0] << " -n <json_file> <port>" << std::endl; 
+      std::cout << "-v \t view a simulation streamed by -n:" << std::endl; 
+      std::cout << "   \t " << argv[0] << " -v <host> <port> [frames_per_second] [precision]" << std::endl; 
+      std::cout << "-e \t export frames of provided .rec file without a display:" << std::endl; 
+      std::cout << "   \t " << argv[0] << " -e <rec_file> <prefix | -> [WIDTHxHEIGHT]" << std::endl; 
+      std::cout << "   \t writes <prefix>000000.ppm, ..., or raw RGB24 frames to stdout for -" << std::endl; 
       return 0; 
     }
     return runEngine(argc, argv, false); 
@@ -54,8 +96,12 @@ int main(int argc, char **argv) {
     return runPlayback(argc, argv); 
   } else if(strcmp(argv[1], "-r") == 0) { // record flag
     return runEngine(argc, argv, true); 
+  } else if(strcmp(argv[1], "-c") == 0) { // resume flag
+    return runResume(argc, argv); 
+  } else if(strcmp(argv[1], "-s") == 0) { // sweep flag
+    return runSweep(argc, argv); 
   } else {
-    std::cout << "Flag usage: " << argv[0] << " -[p/r] <json_file>" << std::endl; 
+    std::cout << "Flag usage: " << argv[0] << " -[p/r/c/s] <json_file>" << std::endl; 
     return -1; 
   }
 
@@ -72,8 +118,6 @@ int main(int argc, char **argv) {
  * or not to record based on a boolean input. 
  */
 int runEngine(int argc, char **argv, bool record) {
-  srand(static_cast<unsigned int>(micro_sec()));
-
   Config config(record ? argv[2] : argv[1]);
   if (config.initialize()) return -1;
 
@@ -83,7 +127,40 @@ int runEngine(int argc, char **argv, bool record) {
     output = output.substr(0, output.size()-5) + ".rec";
   }
   Engine engine(config, output); 
-  
+
+  if (config.checkpoint_interval) {
+    std::string checkpoint = config.json_file_name;
+    checkpoint = checkpoint.substr(0, checkpoint.size()-5) + ".chk";
+    engine.set_checkpointing(checkpoint, config.checkpoint_interval);
+  }
+  if (!config.publish_name.empty() && engine.set_publishing(config.publish_name, config.publish_interval)) return -1;
+  if (!config.stats_file.empty() && engine.set_stats(config.stats_file, config.stats_interval)) return -1;
+
+  return runSimulation(engine);
+}
+
+/*
+ * Resume a simulation from a checkpoint. The
+ * engine starts out empty and then takes all
+ * of its state from the checkpoint, so there
+ * is no config to parse. If the checkpointed
+ * run wrote automatic checkpoints, the resumed
+ * run keeps writing them to the same file.
+ */
+int runResume(int argc, char **argv) {
+  char no_json[] = "";
+  Config config(no_json);
+  Engine engine(config);
+  if (engine.load_checkpoint(argv[2])) return -1;
+
+  return runSimulation(engine);
+}
+
+/*
+ * Main loop shared by fresh and resumed
+ * simulations.
+ */
+int runSimulation(Engine &engine) {
   Graphics graphics(engine);
   if (graphics.initialize()) return -1;
   
@@ -93,15 +170,14 @@ int runEngine(int argc, char **argv, bool record) {
    * we can achieve a smooth animation while running at
    * an uncapped framerate.
    */
-  float dt = 0., ticks_per_frame = static_cast<float>(config.ticks_per_frame);
+  float dt = 0., speed = engine.get_speed();
 
   unsigned long long before = 0, after = 0;
 
   while (!graphics.should_close()) {
     before = micro_sec();
     
-    for (std::size_t i = 0; i < config.ticks_per_frame; ++i)
-      engine.update(config.speed * dt / ticks_per_frame);
+    engine.advance(speed * dt);
     graphics.render_tick(dt);
 
     after = micro_sec();
@@ -112,8 +188,6 @@ int runEngine(int argc, char **argv, bool record) {
 }
 
 int runPlayback(int argc, char **argv) {
-  srand(static_cast<unsigned int>(micro_sec()));
-
   std::string input = argv[2]; 
   if(input.substr(input.size()-4) != ".rec") {
     std::cout << input.substr(input.size()-4); 
@@ -121,6 +195,7 @@ int runPlayback(int argc, char **argv) {
     return -1;
   }
   Engine engine(argv[2]);
+  if (engine.playback_ended()) return -1;
   
   Graphics graphics(engine);
   if (graphics.initialize()) return -1;
@@ -138,7 +213,7 @@ int runPlayback(int argc, char **argv) {
   while (!graphics.should_close()) {
     before = micro_sec();
     
-    engine.update(0.0);
+    engine.update(dt);
     graphics.render_tick(dt);
 
     after = micro_sec();
@@ -147,3 +222,189 @@ int runPlayback(int argc, char **argv) {
   }
   return 0; 
 }
+
+/*
+ * Render a recording offscreen, one frame per simulated
+ * tick (interpolated, if the recording skipped ticks),
+ * as fast as we can. Frames either go to numbered
+ * PPM files or, if the output is "-", to stdout as raw
+ * RGB24, e.g. for piping into
+ * ffmpeg -f rawvideo -pix_fmt rgb24 -s WIDTHxHEIGHT -i - out.mp4
+ */
+int runExport([[maybe_unused]] int argc, char **argv) {
+  std::string input = argv[2]; 
+  if(input.size() < 4 || input.substr(input.size()-4) != ".rec") {
+    std::cerr << "ERROR: Must input a .rec file" << std::endl; 
+    return -1;
+  }
+  int width = 1280, height = 720;
+  if (argc == 5 && (sscanf(argv[4], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)) {
+    std::cerr << "ERROR: Frame size must look like WIDTHxHEIGHT, not " << argv[4] << "." << std::endl; 
+    return -1;
+  }
+  const std::string output = argv[3];
+  const bool to_stdout = output == "-";
+
+  Engine engine(input);
+  if (engine.playback_ended()) return -1;
+  engine.pace_playback = false;
+  Graphics graphics(engine);
+  if (graphics.initialize_headless(width, height)) return -1;
+
+  for (std::size_t frame = 0; !engine.playback_ended(); ++frame) {
+    const std::vector<unsigned char>& pixels = graphics.export_frame();
+    if (to_stdout) {
+      if (fwrite(pixels.data(), 1, pixels.size(), stdout) != pixels.size()) {
+	std::cerr << "ERROR: Couldn't write frame " << frame << " to stdout." << std::endl; 
+	return -1;
+      }
+    }
+    else {
+      char number[16];
+      snprintf(number, sizeof(number), "%06zu", frame);
+      const std::string file_name = output + number + ".ppm";
+      std::ofstream file(file_name, std::ios::binary | std::ios::trunc);
+      file << "P6\n" << graphics.get_width() << " " << graphics.get_height() << "\n255\n";
+      file.write(reinterpret_cast<const char*>(pixels.data()), static_cast<std::streamsize>(pixels.size()));
+      if (!file) {
+	std::cerr << "ERROR: Couldn't write " << file_name << "." << std::endl; 
+	return -1;
+      }
+    }
+    engine.update(0.0);
+  }
+  if (to_stdout) fflush(stdout);
+  return 0; 
+}
+
+/*
+ * Run a parameter sweep without graphics, and
+ * write its summaries to <json_file>.csv.
+ */
+int runSweep([[maybe_unused]] int argc, char **argv) {
+  Sweep sweep(argv[2]);
+  if (sweep.initialize()) return -1;
+  if (sweep.run()) return -1;
+
+  std::string output = argv[2];
+  output = output.substr(0, output.size()-5) + ".csv";
+  std::ofstream csv(output, std::ios::trunc);
+  sweep.write_csv(csv);
+  if (!csv) {
+    std::cerr << "ERROR: Couldn't write " << output << "." << std::endl; 
+    return -1;
+  }
+  return 0; 
+}
+
+/*
+ * Run a simulation without graphics, in real
+ * time, and stream it to whoever connects with
+ * -v. Runs until killed.
+ */
+int runServe([[maybe_unused]] int argc, char **argv) {
+  int port;
+  if (sscanf(argv[3], "%d", &port) != 1 || port < 0 || port > 65535) {
+    std::cerr << "ERROR: Port must be a number from 0 to 65535, not " << argv[3] << "." << std::endl; 
+    return -1;
+  }
+  Config config(argv[2]);
+  if (config.initialize()) return -1;
+  Engine engine(config);
+  if (!config.publish_name.empty() && engine.set_publishing(config.publish_name, config.publish_interval)) return -1;
+  if (!config.stats_file.empty() && engine.set_stats(config.stats_file, config.stats_interval)) return -1;
+
+  StreamServer server;
+  if (server.open(static_cast<std::uint16_t>(port))) return -1;
+  std::cout << "Streaming on port " << server.get_port() << std::endl; 
+
+  const auto frame = std::chrono::microseconds(1000000 / 60);
+  const float frame_dt = 1.0f / 60.0f, speed = engine.get_speed();
+  auto next = std::chrono::steady_clock::now();
+  for (;;) {
+    engine.advance(speed * frame_dt);
+    server.publish(engine);
+    next = std::max(next + frame, std::chrono::steady_clock::now() - frame);
+    std::this_thread::sleep_until(next);
+  }
+}
+
+/*
+ * Watch a simulation streamed by -n, at up to
+ * frames_per_second frames per second (default
+ * 60, 0 for every frame the server makes), with
+ * positions to the nearest precision (default
+ * 0.001). Viewing stops when the stream does.
+ */
+int runView(int argc, char **argv) {
+  float rate = 60.0f, precision = 0.001f;
+  if ((argc >= 5 && sscanf(argv[4], "%f", &rate) != 1) || (argc == 6 && sscanf(argv[5], "%f", &precision) != 1)) {
+    std::cerr << "ERROR: Frames per second and precision must be numbers." << std::endl; 
+    return -1;
+  }
+  StreamClient client;
+  if (client.connect(argv[2], argv[3], rate, precision)) return -1;
+  std::string init_bytes;
+  if (client.read_init(init_bytes)) return -1;
+  std::istringstream init(init_bytes);
+  Engine engine(init);
+  if (client.poll(engine, true)) return -1;
+
+  Graphics graphics(engine);
+  if (graphics.initialize()) return -1;
+
+  float dt = 0.;
+  unsigned long long before = 0, after = 0;
+  while (!graphics.should_close()) {
+    before = micro_sec();
+
+    if (client.poll(engine, false)) return -1;
+    graphics.render_tick(dt);
+
+    after = micro_sec();
+    dt = static_cast<float>(after - before) / 1000000.0f;
+  }
+  return 0; 
+}
+
+/*
+ * Run a distributed simulation without
+ * graphics. We are rank 0, and start the other
+ * ranks as workers. Every rank needs the same
+ * SEED, so we pick one for them all.
+ */
+int runDistributed([[maybe_unused]] int argc, char **argv) {
+  int size;
+  if (sscanf(argv[3], "%d", &size) != 1 || size < 1) {
+    std::cerr << "ERROR: The number of processes must be a positive integer, not " << argv[3] << "." << std::endl; 
+    return -1;
+  }
+  const std::uint64_t seed = static_cast<std::uint64_t>(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+  std::unique_ptr<SocketTransport> transport = SocketTransport::spawn_workers(size, {argv[0], "-w", argv[2], std::to_string(seed)});
+  if (!transport) return -1;
+
+  Domain domain(argv[2], *transport, seed);
+  const int failed = domain.initialize() || domain.run();
+  if (transport->wait_workers() || failed) return -1;
+
+  std::string output = argv[2];
+  output = output.substr(0, output.size()-5) + ".chk";
+  return domain.save(output);
+}
+
+/*
+ * One of the other ranks of a distributed run:
+ * -w <json_file> <seed> <rank> <size> <left_fd> <right_fd>
+ */
+int runWorker([[maybe_unused]] int argc, char **argv) {
+  unsigned long long seed;
+  int rank, size, left_fd, right_fd;
+  if (sscanf(argv[3], "%llu", &seed) != 1 || sscanf(argv[4], "%d", &rank) != 1 || sscanf(argv[5], "%d", &size) != 1 || sscanf(argv[6], "%d", &left_fd) != 1 || sscanf(argv[7], "%d", &right_fd) != 1) {
+    std::cerr << "ERROR: Malformed worker arguments." << std::endl; 
+    return -1;
+  }
+  SocketTransport transport(rank, size, left_fd, right_fd);
+  Domain domain(argv[2], transport, seed);
+  if (domain.initialize()) return -1;
+  return domain.run();
+}
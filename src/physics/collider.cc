@@ -65,34 +65,105 @@ CollisionResponse WallCollider::checkCollision([[maybe_unused]] const WallCollid
   return result;
 }
 
-void SphereCollider::serialize(std::fstream& fs) const {
+/*
+ * Double callback functions for swept checks.
+ */
+CollisionResponse SphereCollider::checkSweptCollision(const Collider& other, const Transform& myStart, const Transform& myEnd, const Transform& otherStart, const Transform& otherEnd) const {
+  return other.checkSweptCollision(*this, otherStart, otherEnd, myStart, myEnd);
+}
+
+CollisionResponse WallCollider::checkSweptCollision(const Collider& other, const Transform& myStart, const Transform& myEnd, const Transform& otherStart, const Transform& otherEnd) const {
+  return other.checkSweptCollision(*this, otherStart, otherEnd, myStart, myEnd);
+}
+
+/*
+ * Check for contact between 2 moving spheres.
+ * Relative to us, the other sphere moves from
+ * p to p + d, so contact starts at the first
+ * t in [0, 1] where |p + d * t| = r1 + r2.
+ * The normal is taken at that moment, so that
+ * spheres that passed through each other are
+ * still pushed apart the way they came from,
+ * and the depth is how far past touching they
+ * are along it at the end.
+ */
+CollisionResponse SphereCollider::checkSweptCollision(const SphereCollider& other, const Transform& myStart, const Transform& myEnd, const Transform& otherStart, const Transform& otherEnd) const {
+  const float rad_sum = radius + other.radius;
+  const Transform p = otherStart - myStart;
+  const Transform d = (otherEnd - otherStart) - (myEnd - myStart);
+  const float a = d * d, b = 2.0f * (p * d), c = p * p - rad_sum * rad_sum;
+  if (c <= 0.0f || a == 0.0f || b >= 0.0f) {
+    CollisionResponse result = checkCollision(other, myEnd, otherEnd);
+    result.toi = 0.0f;
+    return result;
+  }
+
+  CollisionResponse result;
+  const float disc = b * b - 4.0f * a * c;
+  const float toi = disc < 0.0f ? INFINITY : (-b - sqrt(disc)) / (2.0f * a);
+  result.collides = toi <= 1.0f;
+  if (result.collides) {
+    result.toi = toi;
+    result.normal = (p + d * toi) / rad_sum;
+    result.depth = rad_sum - (otherEnd - myEnd) * result.normal;
+  }
+  return result;
+}
+
+/*
+ * Walls are half spaces, so a sphere can't
+ * get past one without ending up touching
+ * it. The swept check only has to work out
+ * when in the sweep the sphere got there.
+ */
+CollisionResponse SphereCollider::checkSweptCollision(const WallCollider& other, const Transform& myStart, const Transform& myEnd, const Transform& otherStart, [[maybe_unused]] const Transform& otherEnd) const {
+  CollisionResponse result = checkCollision(other, myEnd, otherStart);
+  if (result.collides) {
+    const float start_dist = (myStart - otherStart) * result.normal;
+    const float end_dist = radius - result.depth;
+    result.toi = start_dist > radius ? (start_dist - radius) / (start_dist - end_dist) : 0.0f;
+  }
+  return result;
+}
+
+CollisionResponse WallCollider::checkSweptCollision(const SphereCollider& other, const Transform& myStart, const Transform& myEnd, const Transform& otherStart, const Transform& otherEnd) const {
+  return other.checkSweptCollision(*this, otherStart, otherEnd, myStart, myEnd);
+}
+
+CollisionResponse WallCollider::checkSweptCollision([[maybe_unused]] const WallCollider& other, [[maybe_unused]] const Transform& myStart, [[maybe_unused]] const Transform& myEnd, [[maybe_unused]] const Transform& otherStart, [[maybe_unused]] const Transform& otherEnd) const {
+  CollisionResponse result;
+  result.collides = false;
+  return result;
+}
+
+void SphereCollider::serialize(std::ostream& out) const {
   ColliderType type = ColliderType::Sphere;
-  fs.write(reinterpret_cast<const char*>(&type), static_cast<std::streamsize>(sizeof(ColliderType)));
-  fs.write(reinterpret_cast<const char*>(&radius), static_cast<std::streamsize>(sizeof(float)));
+  out.write(reinterpret_cast<const char*>(&type), static_cast<std::streamsize>(sizeof(ColliderType)));
+  out.write(reinterpret_cast<const char*>(&radius), static_cast<std::streamsize>(sizeof(float)));
 }
 
-void WallCollider::serialize(std::fstream& fs) const {
+void WallCollider::serialize(std::ostream& out) const {
   ColliderType type = ColliderType::Wall;
-  fs.write(reinterpret_cast<const char*>(&type), static_cast<std::streamsize>(sizeof(ColliderType)));
-  fs.write(reinterpret_cast<const char*>(&nx), static_cast<std::streamsize>(sizeof(float)));
-  fs.write(reinterpret_cast<const char*>(&ny), static_cast<std::streamsize>(sizeof(float)));
-  fs.write(reinterpret_cast<const char*>(&nz), static_cast<std::streamsize>(sizeof(float)));
+  out.write(reinterpret_cast<const char*>(&type), static_cast<std::streamsize>(sizeof(ColliderType)));
+  out.write(reinterpret_cast<const char*>(&nx), static_cast<std::streamsize>(sizeof(float)));
+  out.write(reinterpret_cast<const char*>(&ny), static_cast<std::streamsize>(sizeof(float)));
+  out.write(reinterpret_cast<const char*>(&nz), static_cast<std::streamsize>(sizeof(float)));
 }
 
-std::unique_ptr<Collider> deserialize_collider(std::fstream& fs) {
+std::unique_ptr<Collider> deserialize_collider(std::istream& in) {
   ColliderType type;
-  fs.read(reinterpret_cast<char*>(&type), static_cast<std::streamsize>(sizeof(ColliderType)));
+  in.read(reinterpret_cast<char*>(&type), static_cast<std::streamsize>(sizeof(ColliderType)));
   switch (type) {
   case ColliderType::Sphere: {
     float radius;
-    fs.read(reinterpret_cast<char*>(&radius), static_cast<std::streamsize>(sizeof(float)));
+    in.read(reinterpret_cast<char*>(&radius), static_cast<std::streamsize>(sizeof(float)));
     return std::make_unique<SphereCollider>(radius);
   }
   case ColliderType::Wall: {
     float nx, ny, nz;
-    fs.read(reinterpret_cast<char*>(&nx), static_cast<std::streamsize>(sizeof(float)));
-    fs.read(reinterpret_cast<char*>(&ny), static_cast<std::streamsize>(sizeof(float)));
-    fs.read(reinterpret_cast<char*>(&nz), static_cast<std::streamsize>(sizeof(float)));
+    in.read(reinterpret_cast<char*>(&nx), static_cast<std::streamsize>(sizeof(float)));
+    in.read(reinterpret_cast<char*>(&ny), static_cast<std::streamsize>(sizeof(float)));
+    in.read(reinterpret_cast<char*>(&nz), static_cast<std::streamsize>(sizeof(float)));
     return std::make_unique<WallCollider>(nx, ny, nz);
   }
   default: return nullptr;
@@ -19,10 +19,42 @@
 using vector32f = std::vector<float, boost::alignment::aligned_allocator<float, 32>>;
 
 /*
- * Number of threads used for collision 
- * detection.
+ * Per-body phases hand each thread whole
+ * blocks of this many bodies (a multiple of
+ * 8, so that AVX loads stay aligned).
+ */
+static constexpr std::size_t BODY_BLOCK = 4096;
+
+/*
+ * Broadphase queries are split into about
+ * this many chunks per thread, which threads
+ * pull one at a time, so that a thread stuck
+ * with a dense cluster doesn't hold up the
+ * others.
+ */
+static constexpr std::size_t CHUNKS_PER_THREAD = 8;
+
+/*
+ * Checkpoint files start with a magic string
+ * and a format version, so that we can
+ * reject files that aren't checkpoints (or
+ * that were written by an incompatible
+ * version of Hummingbird).
+ */
+static constexpr char CHECKPOINT_MAGIC[8] = {'H', 'B', 'C', 'H', 'K', 'P', 'T', '\0'};
+static constexpr std::uint32_t CHECKPOINT_VERSION = 8;
+
+/*
+ * Likewise for recordings.
  */
-static constexpr unsigned int NUM_COLLISION_DETECTION_THREADS = 32;
+static constexpr char RECORDING_MAGIC[8] = {'H', 'B', 'R', 'E', 'C', 'O', 'R', 'D'};
+static constexpr std::uint32_t RECORDING_VERSION = 2;
+
+/*
+ * Marks IDs in the ID table that don't
+ * belong to any body.
+ */
+static constexpr unsigned int NO_INDEX = ~0u;
 
 /*
  * Construct engine based on configuration,
@@ -30,51 +62,75 @@ static constexpr unsigned int NUM_COLLISION_DETECTION_THREADS = 32;
  */
 Engine::Engine(const Config& cfg): grav_constant(cfg.grav_constant),
 				   elasticity(cfg.elasticity),
+				   friction(cfg.friction),
+				   ccd_speed(cfg.ccd_speed),
 				   boundary{cfg.boundary[0], cfg.boundary[1], cfg.boundary[2], cfg.boundary[3], cfg.boundary[4], cfg.boundary[5]},
+				   mutual_grav_constant(cfg.mutual_grav_constant),
+				   opening_angle(cfg.opening_angle),
+				   softening(cfg.softening),
+				   loose_octree(cfg.loose_octree),
+				   speed(cfg.speed),
+				   ticks_per_frame(cfg.ticks_per_frame),
+				   cfl(cfg.cfl),
+				   max_ticks_per_frame(cfg.max_ticks_per_frame),
+				   reorder_interval(cfg.reorder_interval),
+				   record_interval(cfg.record_interval),
 				   num_bodies(cfg.num_bodies),
 				   record(false),
 				   playback(false),
 				   force{vector32f(num_bodies, 0.0f), vector32f(num_bodies, 0.0f), vector32f(num_bodies, 0.0f)},
 				   walls{WallCollider(1.0f, 0.0f, 0.0f), WallCollider(-1.0f, 0.0f, 0.0f), WallCollider(0.0f, 1.0f, 0.0f), WallCollider(0.0f, -1.0f, 0.0f), WallCollider(0.0f, 0.0f, 1.0f), WallCollider(0.0f, 0.0f, -1.0f)} {
   /*
-   * Reserve space so  that we don't waste
-   * heap allocations.
+   * Size every array up front, so that bodies
+   * can be written into their slots from many
+   * threads at once.
    */
-  pos.x.reserve(num_bodies);
-  pos.y.reserve(num_bodies);
-  pos.z.reserve(num_bodies);
-
-  vel.x.reserve(num_bodies);
-  vel.y.reserve(num_bodies);
-  vel.z.reserve(num_bodies);
+  pos.x.resize(num_bodies);
+  pos.y.resize(num_bodies);
+  pos.z.resize(num_bodies);
 
-  mass.reserve(num_bodies);
-  ang_pos.reserve(num_bodies);
-  colliders.reserve(num_bodies);
+  vel.x.resize(num_bodies);
+  vel.y.resize(num_bodies);
+  vel.z.resize(num_bodies);
 
-  omp_init_lock(&collision_set_lock);
+  mass.resize(num_bodies);
+  for (auto arr : {&ang_pos.w, &ang_pos.x, &ang_pos.y, &ang_pos.z, &ang_vel.x, &ang_vel.y, &ang_vel.z}) arr->resize(num_bodies);
+  inv_inertia.resize(num_bodies);
+  colliders.resize(num_bodies);
+  ids.resize(num_bodies);
+  std::iota(ids.begin(), ids.end(), 0u);
+  index_of = ids;
+  query_cost.assign(num_bodies, 1u);
 
   /*
    * Config bodies are stored as variants,
    * so we use std::visit to deduce types.
    */
-  for (auto vari : cfg.bodies) {
+  const std::size_t num_config_bodies = cfg.bodies.size();
+#pragma omp parallel for
+  for (std::size_t i = 0; i < num_config_bodies; ++i) {
     std::visit([&](auto&& body) {
       using T = std::decay_t<decltype(body)>;
       if constexpr (std::is_same_v<T, ConfigSphere>) {
-	pos.x.push_back(body.x);
-	pos.y.push_back(body.y);
-	pos.z.push_back(body.z);
-
-	vel.x.push_back(body.vx);
-	vel.y.push_back(body.vy);
-	vel.z.push_back(body.vz);
-
-	mass.push_back(body.m);
-	ang_pos.push_back(Quaternion{0.0f, 0.0f, 0.0f, 0.0f});
-	colliders.push_back(std::make_unique<SphereCollider>(body.r));
+	set_sphere_at(i, body);
       }
-    }, vari);
+    }, cfg.bodies[i]);
+  }
+
+  /*
+   * Bodies from body files come after the
+   * config bodies, and are copied straight
+   * out of the mapped files.
+   */
+  std::size_t first = num_config_bodies;
+  for (const auto& body_file : cfg.body_files) {
+    const ConfigSphere *file_bodies = body_file.data();
+    const std::size_t num_file_bodies = body_file.size();
+#pragma omp parallel for
+    for (std::size_t i = 0; i < num_file_bodies; ++i) {
+      set_sphere_at(first + i, file_bodies[i]);
+    }
+    first += num_file_bodies;
   }
 
   /*
@@ -82,28 +138,70 @@ Engine::Engine(const Config& cfg): grav_constant(cfg.grav_constant),
    * constant.
    */
   const __m256 grav_constant_a = _mm256_set_ps(-grav_constant, -grav_constant, -grav_constant, -grav_constant, -grav_constant, -grav_constant, -grav_constant, -grav_constant);
-  multiply_with_mass(force.y.data(), mass.data(), -grav_constant, grav_constant_a);
+  multiply_with_mass(force.y.data(), mass.data(), -grav_constant, grav_constant_a, 0, num_bodies);
 }
 
 Engine::Engine(const Config& cfg, std::string file_name): Engine(cfg) {
   if (file_name != "") {
     record = true;
     fs = std::fstream(file_name, std::ios::binary | std::ios::trunc | std::ios::out);
-    dump_init_to_file();
+    write_init(fs);
   }
 }
 
-Engine::Engine(const std::string& file_name):
+/*
+ * A run that stops between kept ticks still
+ * ends its recording on the last tick, with a
+ * shorter final keyframe.
+ */
+Engine::~Engine() {
+  if (record && record_ticks) dump_tick_to_file(record_dt, record_ticks);
+}
+
+Engine::Engine(PlaybackTag):
+  friction(0.0f),
+  ccd_speed(0.0f),
+  mutual_grav_constant(0.0f),
+  opening_angle(0.5f),
+  softening(0.01f),
+  loose_octree(false),
+  speed(1.0f),
+  ticks_per_frame(1),
+  cfl(0.0f),
+  max_ticks_per_frame(1),
+  reorder_interval(0),
+  record_interval(1),
+  num_bodies(0),
   record(false),
   playback(true),
-  fs(file_name, std::ios::binary | std::ios::in),
-  walls{WallCollider(1.0f, 0.0f, 0.0f), WallCollider(-1.0f, 0.0f, 0.0f), WallCollider(0.0f, 1.0f, 0.0f), WallCollider(0.0f, -1.0f, 0.0f), WallCollider(0.0f, 0.0f, 1.0f), WallCollider(0.0f, 0.0f, -1.0f)} {
-  load_init_from_file();
-  load_tick_from_file();
+  walls{WallCollider(1.0f, 0.0f, 0.0f), WallCollider(-1.0f, 0.0f, 0.0f), WallCollider(0.0f, 1.0f, 0.0f), WallCollider(0.0f, -1.0f, 0.0f), WallCollider(0.0f, 0.0f, 1.0f), WallCollider(0.0f, 0.0f, -1.0f)} {}
+
+Engine::Engine(const std::string& file_name): Engine(PlaybackTag{}) {
+  fs = std::fstream(file_name, std::ios::binary | std::ios::in);
+  /*
+   * Start out showing the first recorded frame.
+   * A recording we can't read plays as empty.
+   */
+  if (load_init(fs) || !load_tick_from_file()) {
+    num_bodies = 0;
+    reached_end = true;
+    return;
+  }
+  std::swap(key_pos[0], key_pos[1]);
+  std::swap(key_vel[0], key_vel[1]);
+  std::swap(key_ang_pos[0], key_ang_pos[1]);
+  have_next_key = load_tick_from_file();
+  interpolate_keyframes(0.0f);
 }
 
-Engine::~Engine() {
-  omp_destroy_lock(&collision_set_lock);
+/*
+ * There are no recorded frames to step
+ * through, so playback stays where set_poses
+ * last put it.
+ */
+Engine::Engine(std::istream& init): Engine(PlaybackTag{}) {
+  if (load_init(init)) num_bodies = 0;
+  reached_end = true;
 }
 
 /*
@@ -113,32 +211,150 @@ const Engine::Vec3x<float, 32> &Engine::get_pos() const { return pos; }
 const Engine::Vec3x<float, 32> &Engine::get_vel() const { return vel; }
 const Engine::Vec3x<float, 32> &Engine::get_force() const { return force; }
 const std::vector<float> &Engine::get_mass() const { return mass; }
-const std::vector<Quaternion> &Engine::get_ang_pos() const { return ang_pos; }
+const Engine::Vec4x<float, 32> &Engine::get_ang_pos() const { return ang_pos; }
+const Engine::Vec3x<float, 32> &Engine::get_ang_vel() const { return ang_vel; }
+const std::vector<unsigned int> &Engine::get_ids() const { return ids; }
 const std::vector<std::unique_ptr<Collider>> &Engine::get_colliders() const { return colliders; }
 std::size_t Engine::get_num_bodies() const { return num_bodies; }
 const float* Engine::get_boundary() const { return boundary; }
+float Engine::get_speed() const { return speed; }
+std::size_t Engine::get_ticks_per_frame() const { return ticks_per_frame; }
+std::size_t Engine::get_body_changes() const { return body_changes; }
+float Engine::get_cfl() const { return cfl; }
+std::size_t Engine::get_frame_ticks() const { return frame_ticks; }
+float Engine::get_frame_step() const { return frame_step; }
+bool Engine::playback_ended() const { return reached_end; }
 
 void Engine::update(const float dt) {
   if (paused) return;
-  if (playback) {
-    float now_dt = load_tick_from_file();
-    if (now_dt > dt) {
-      std::this_thread::sleep_for(std::chrono::nanoseconds(static_cast<int>(round(1000000.0 * (now_dt - dt) / playback_speed))));
+  if (playback) playback_update(dt);
+  else {
+    if (reorder_interval && tick % reorder_interval == 0) reorder();
+    if (mutual_grav_constant != 0.0f) gravity_update();
+    /*
+     * Both phases split bodies the same way
+     * and touch different arrays, so one team
+     * runs them back to back without waiting
+     * in between.
+     */
+    if (ccd_speed > 0.0f) prev_pos = pos;
+#pragma omp parallel
+    {
+      dynamics_update(dt);
+      rotation_update(dt);
     }
+    if (stats_interval && tick % stats_interval == 0) collision_update<true>(dt);
+    else collision_update<false>(dt);
+    if (record) {
+      record_dt += dt;
+      ++record_ticks;
+      if ((tick + 1) % record_interval == 0) {
+	dump_tick_to_file(record_dt, record_ticks);
+	record_dt = 0.0f;
+	record_ticks = 0;
+      }
+    }
+    ++tick;
+    if (checkpoint_interval && tick % checkpoint_interval == 0) save_checkpoint(checkpoint_file);
+    if (publish_interval && tick % publish_interval == 0) publish_state();
   }
-  else {
-    dynamics_update(dt);
-    auto octree = make_octree();
-    auto collisions = find_collisions(std::move(octree));
-    collision_response(collisions);
-    collision_response_with_walls();
-    if (record) dump_tick_to_file(dt);
+}
+
+/*
+ * Without a CFL number, a frame is split into
+ * ticks_per_frame equal ticks. With one, each
+ * tick is made short enough that no body moves
+ * more than cfl times the smallest radius in it,
+ * measuring the fastest body again before every
+ * tick. Ticks never get longer than with
+ * ticks_per_frame ticks, nor shorter than with
+ * max_ticks_per_frame ticks, and the last tick
+ * takes whatever time is left.
+ */
+std::size_t Engine::advance(const float frame_dt) {
+  if (cfl == 0.0f || playback) {
+    for (std::size_t i = 0; i < ticks_per_frame; ++i) update(frame_dt / static_cast<float>(ticks_per_frame));
+    frame_ticks = ticks_per_frame;
+    frame_step = frame_dt / static_cast<float>(ticks_per_frame);
+    return frame_ticks;
+  }
+  if (paused) return 0;
+
+  if (min_radius_stale) {
+    float r = INFINITY;
+#pragma omp parallel for reduction(min : r)
+    for (std::size_t i = 0; i < num_bodies; ++i) r = std::min(r, get_radius_at(i));
+    min_radius = r;
+    min_radius_stale = false;
+  }
+
+  const float min_step = frame_dt / static_cast<float>(max_ticks_per_frame);
+  const float max_step = frame_dt / static_cast<float>(ticks_per_frame);
+  float remaining = frame_dt;
+  frame_ticks = 0;
+  while (remaining > 0.0f) {
+    const float max_speed = get_max_speed();
+    float step = max_speed > 0.0f ? cfl * min_radius / max_speed : max_step;
+    step = std::min(std::max(step, min_step), max_step);
+    if (step >= remaining || frame_ticks + 1 == max_ticks_per_frame) step = remaining;
+    update(step);
+    remaining -= step;
+    ++frame_ticks;
+  }
+  frame_step = frame_ticks ? frame_dt / static_cast<float>(frame_ticks) : 0.0f;
+  return frame_ticks;
+}
+
+/*
+ * Speed of the fastest body.
+ */
+float Engine::get_max_speed() {
+  const float *const vx = vel.x.data(), *const vy = vel.y.data(), *const vz = vel.z.data();
+  float max_speed2 = 0.0f;
+#pragma omp parallel for simd reduction(max : max_speed2)
+  for (std::size_t i = 0; i < num_bodies; ++i) {
+    const float speed2 = vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i];
+    max_speed2 = speed2 > max_speed2 ? speed2 : max_speed2;
+  }
+  return sqrtf(max_speed2);
+}
+
+/*
+ * Recompute forces when bodies attract each
+ * other. We start from the uniform gravity
+ * force, then add the mutual gravitation
+ * between bodies, approximated with
+ * Barnes-Hut on an octree of body centers.
+ */
+void Engine::gravity_update() {
+  const __m256 grav_constant_a = _mm256_set_ps(-grav_constant, -grav_constant, -grav_constant, -grav_constant, -grav_constant, -grav_constant, -grav_constant, -grav_constant);
+  std::fill(force.x.begin(), force.x.end(), 0.0f);
+  multiply_with_mass(force.y.data(), mass.data(), -grav_constant, grav_constant_a, 0, num_bodies);
+  std::fill(force.z.begin(), force.z.end(), 0.0f);
+
+  Octree octree(*reinterpret_cast<AABB*>(boundary));
+  for (unsigned int i = 0; i < num_bodies; ++i) {
+    octree.insert_point(i, pos.x[i], pos.y[i], pos.z[i]);
+  }
+  octree.compute_mass_aggregates(mass.data(), pos.x.data(), pos.y.data(), pos.z.data());
+
+#pragma omp parallel for schedule(dynamic, 256)
+  for (unsigned int i = 0; i < num_bodies; ++i) {
+    float ax = 0.0f, ay = 0.0f, az = 0.0f;
+    octree.gravity(i, pos.x[i], pos.y[i], pos.z[i], opening_angle, softening, mass.data(), pos.x.data(), pos.y.data(), pos.z.data(), ax, ay, az);
+    const float factor = mutual_grav_constant * mass[i];
+    force.x[i] += ax * factor;
+    force.y[i] += ay * factor;
+    force.z[i] += az * factor;
   }
 }
 
 /*
  * Update positions / velocities / forces of 
- * bodies.
+ * bodies. Called from inside a parallel
+ * region, which shares out the blocks of
+ * bodies (or, outside of one, by a single
+ * thread doing every block).
  */
 void Engine::dynamics_update(const float dt) {
   /*
@@ -148,54 +364,306 @@ void Engine::dynamics_update(const float dt) {
    */
   const __m256 dt_a = _mm256_set_ps(dt, dt, dt, dt, dt, dt, dt, dt);
 
-  /*
-   * Update velocities from forces.
-   */
-  fused_multiply_add_with_mass(dt, dt_a, vel.x.data(), force.x.data(), mass.data());
-  fused_multiply_add_with_mass(dt, dt_a, vel.y.data(), force.y.data(), mass.data());
-  fused_multiply_add_with_mass(dt, dt_a, vel.z.data(), force.z.data(), mass.data());
+  const std::size_t num_blocks = (num_bodies + BODY_BLOCK - 1) / BODY_BLOCK;
+#pragma omp for schedule(static) nowait
+  for (std::size_t block = 0; block < num_blocks; ++block) {
+    const std::size_t begin = block * BODY_BLOCK, end = std::min(begin + BODY_BLOCK, num_bodies);
+
+    /*
+     * Update velocities from forces.
+     */
+    fused_multiply_add_with_mass(dt, dt_a, vel.x.data(), force.x.data(), mass.data(), begin, end);
+    fused_multiply_add_with_mass(dt, dt_a, vel.y.data(), force.y.data(), mass.data(), begin, end);
+    fused_multiply_add_with_mass(dt, dt_a, vel.z.data(), force.z.data(), mass.data(), begin, end);
+
+    /*
+     * Update positions from velocities.
+     */
+    fused_multiply_add(dt, dt_a, pos.x.data(), vel.x.data(), begin, end);
+    fused_multiply_add(dt, dt_a, pos.y.data(), vel.y.data(), begin, end);
+    fused_multiply_add(dt, dt_a, pos.z.data(), vel.z.data(), begin, end);
+  }
+}
+
+/*
+ * Integrate orientations from angular
+ * velocities, eight bodies at a time. Each
+ * quaternion moves along dq/dt = 0.5 * w * q
+ * (with w the angular velocity as a pure
+ * quaternion), and is then renormalized
+ * with a refined reciprocal square root, so
+ * that drift never builds up. Blocks are
+ * shared out like in dynamics_update.
+ */
+void Engine::rotation_update(const float dt) {
+  const __m256 half_dt_a = _mm256_set1_ps(0.5f * dt);
+  const __m256 half_a = _mm256_set1_ps(0.5f);
+  const __m256 three_halves_a = _mm256_set1_ps(1.5f);
+  const std::size_t num_blocks = (num_bodies + BODY_BLOCK - 1) / BODY_BLOCK;
+#pragma omp for schedule(static) nowait
+  for (std::size_t block = 0; block < num_blocks; ++block) {
+    const std::size_t begin = block * BODY_BLOCK, end = std::min(begin + BODY_BLOCK, num_bodies);
+    std::size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+      const __m256 qw = _mm256_load_ps(ang_pos.w.data() + i);
+      const __m256 qx = _mm256_load_ps(ang_pos.x.data() + i);
+      const __m256 qy = _mm256_load_ps(ang_pos.y.data() + i);
+      const __m256 qz = _mm256_load_ps(ang_pos.z.data() + i);
+      const __m256 wx = _mm256_mul_ps(_mm256_load_ps(ang_vel.x.data() + i), half_dt_a);
+      const __m256 wy = _mm256_mul_ps(_mm256_load_ps(ang_vel.y.data() + i), half_dt_a);
+      const __m256 wz = _mm256_mul_ps(_mm256_load_ps(ang_vel.z.data() + i), half_dt_a);
+
+      const __m256 nw = _mm256_sub_ps(qw, _mm256_fmadd_ps(wx, qx, _mm256_fmadd_ps(wy, qy, _mm256_mul_ps(wz, qz))));
+      const __m256 nx = _mm256_add_ps(qx, _mm256_fmsub_ps(wx, qw, _mm256_fmsub_ps(wz, qy, _mm256_mul_ps(wy, qz))));
+      const __m256 ny = _mm256_add_ps(qy, _mm256_fmsub_ps(wy, qw, _mm256_fmsub_ps(wx, qz, _mm256_mul_ps(wz, qx))));
+      const __m256 nz = _mm256_add_ps(qz, _mm256_fmsub_ps(wz, qw, _mm256_fmsub_ps(wy, qx, _mm256_mul_ps(wx, qy))));
+
+      const __m256 norm2 = _mm256_fmadd_ps(nw, nw, _mm256_fmadd_ps(nx, nx, _mm256_fmadd_ps(ny, ny, _mm256_mul_ps(nz, nz))));
+      __m256 inv_norm = _mm256_rsqrt_ps(norm2);
+      inv_norm = _mm256_mul_ps(inv_norm, _mm256_fnmadd_ps(_mm256_mul_ps(half_a, norm2), _mm256_mul_ps(inv_norm, inv_norm), three_halves_a));
+      _mm256_store_ps(ang_pos.w.data() + i, _mm256_mul_ps(nw, inv_norm));
+      _mm256_store_ps(ang_pos.x.data() + i, _mm256_mul_ps(nx, inv_norm));
+      _mm256_store_ps(ang_pos.y.data() + i, _mm256_mul_ps(ny, inv_norm));
+      _mm256_store_ps(ang_pos.z.data() + i, _mm256_mul_ps(nz, inv_norm));
+    }
+    for (; i < end; ++i) {
+      const float wx = 0.5f * dt * ang_vel.x[i], wy = 0.5f * dt * ang_vel.y[i], wz = 0.5f * dt * ang_vel.z[i];
+      const float qw = ang_pos.w[i], qx = ang_pos.x[i], qy = ang_pos.y[i], qz = ang_pos.z[i];
+      Quaternion q{qw - (wx * qx + wy * qy + wz * qz), qx + wx * qw + wy * qz - wz * qy, qy + wy * qw + wz * qx - wx * qz, qz + wz * qw + wx * qy - wy * qx};
+      q.normalize();
+      ang_pos.w[i] = q.w;
+      ang_pos.x[i] = q.x;
+      ang_pos.y[i] = q.y;
+      ang_pos.z[i] = q.z;
+    }
+  }
+}
+
+/*
+ * Spread the low 10 bits of v out so that
+ * there are two zero bits between each of
+ * them, ready to be interleaved with the
+ * bits of two other coordinates.
+ */
+__attribute__((always_inline))
+inline std::uint32_t spread_bits(std::uint32_t v) {
+  v = (v | (v << 16)) & 0x030000FFu;
+  v = (v | (v << 8)) & 0x0300F00Fu;
+  v = (v | (v << 4)) & 0x030C30C3u;
+  v = (v | (v << 2)) & 0x09249249u;
+  return v;
+}
+
+/*
+ * Permute every body array into Morton
+ * order, so that bodies that are close in
+ * space end up close in memory. Positions
+ * are quantized to a 1024^3 grid over the
+ * boundary, and each body's Morton code is
+ * packed above its current index, so a
+ * single sort of 64 bit keys gives a
+ * deterministic order.
+ */
+void Engine::reorder() {
+  const float scale_x = 1024.0f / (boundary[1] - boundary[0]);
+  const float scale_y = 1024.0f / (boundary[3] - boundary[2]);
+  const float scale_z = 1024.0f / (boundary[5] - boundary[4]);
+  std::vector<std::uint64_t> keys(num_bodies);
+#pragma omp parallel for
+  for (std::size_t i = 0; i < num_bodies; ++i) {
+    const auto quantize = [](const float v) { return static_cast<std::uint32_t>(std::min(std::max(v, 0.0f), 1023.0f)); };
+    const std::uint32_t code = spread_bits(quantize((pos.x[i] - boundary[0]) * scale_x))
+      | (spread_bits(quantize((pos.y[i] - boundary[2]) * scale_y)) << 1)
+      | (spread_bits(quantize((pos.z[i] - boundary[4]) * scale_z)) << 2);
+    keys[i] = (static_cast<std::uint64_t>(code) << 32) | i;
+  }
+  std::sort(keys.begin(), keys.end());
 
   /*
-   * Update positions from velocities.
+   * Gather every array through the new order.
    */
-  fused_multiply_add(dt, dt_a, pos.x.data(), vel.x.data());
-  fused_multiply_add(dt, dt_a, pos.y.data(), vel.y.data());
-  fused_multiply_add(dt, dt_a, pos.z.data(), vel.z.data());
+  vector32f scratch(num_bodies);
+  for (auto arr : {&pos.x, &pos.y, &pos.z, &vel.x, &vel.y, &vel.z, &force.x, &force.y, &force.z,
+		   &ang_pos.w, &ang_pos.x, &ang_pos.y, &ang_pos.z, &ang_vel.x, &ang_vel.y, &ang_vel.z}) {
+#pragma omp parallel for
+    for (std::size_t i = 0; i < num_bodies; ++i) scratch[i] = (*arr)[static_cast<std::uint32_t>(keys[i])];
+    arr->swap(scratch);
+  }
+  std::vector<float> new_mass(num_bodies), new_inv_inertia(num_bodies);
+  std::vector<std::unique_ptr<Collider>> new_colliders(num_bodies);
+  std::vector<unsigned int> new_ids(num_bodies), new_query_cost(num_bodies, 1u);
+  const bool have_query_cost = query_cost.size() == num_bodies;
+#pragma omp parallel for
+  for (std::size_t i = 0; i < num_bodies; ++i) {
+    const std::uint32_t from = static_cast<std::uint32_t>(keys[i]);
+    new_mass[i] = mass[from];
+    new_inv_inertia[i] = inv_inertia[from];
+    new_colliders[i] = std::move(colliders[from]);
+    new_ids[i] = ids[from];
+    index_of[new_ids[i]] = static_cast<unsigned int>(i);
+    if (have_query_cost) new_query_cost[i] = query_cost[from];
+  }
+  mass = std::move(new_mass);
+  inv_inertia = std::move(new_inv_inertia);
+  colliders = std::move(new_colliders);
+  ids = std::move(new_ids);
+  query_cost = std::move(new_query_cost);
 }
 
 /*
  * Construct octree for collision detection.
  */
-std::unique_ptr<Octree> Engine::make_octree() {
+std::unique_ptr<Octree> Engine::make_octree(const float dt) {
   auto octree = std::make_unique<Octree>(*reinterpret_cast<AABB*>(boundary));
   for (unsigned int i = 0; i < num_bodies; ++i) {
-    octree->insert(i, get_aabb_at(i));
+    octree->insert(i, get_swept_aabb_at(i, dt));
   }
   return octree;
 }
 
 /*
- * Perform collision detection.
+ * Construct loose octree for collision
+ * detection.
  */
-std::vector<std::tuple<CollisionResponse, unsigned int, unsigned int>> Engine::find_collisions(const std::unique_ptr<Octree> octree) {
-  std::vector<std::tuple<CollisionResponse, unsigned int, unsigned int>> collisions;
-  std::unordered_set<unsigned int> working_sets[NUM_COLLISION_DETECTION_THREADS];
-#pragma omp parallel for num_threads(NUM_COLLISION_DETECTION_THREADS) 
+std::unique_ptr<LooseOctree> Engine::make_loose_octree(const float dt) {
+  auto octree = std::make_unique<LooseOctree>(*reinterpret_cast<AABB*>(boundary));
   for (unsigned int i = 0; i < num_bodies; ++i) {
-    auto& working_set = working_sets[omp_get_thread_num()];
-    octree->possibilities(i, get_aabb_at(i), working_set);
-    auto& my_coll = *colliders[i];
-    auto my_trans = get_transform_at(i);
-    for (unsigned int other : working_set) {
-      auto resp = my_coll.checkCollision(*colliders[other], my_trans, get_transform_at(other));
-      if (resp.collides) {
-	omp_set_lock(&collision_set_lock);
-	collisions.emplace_back(resp, i, other);
-	omp_unset_lock(&collision_set_lock);
+    octree->insert(i, get_swept_aabb_at(i, dt));
+  }
+  return octree;
+}
+
+/*
+ * Split the bodies into chunks of about
+ * equal total cost, going by each body's
+ * cost last tick. Returns the first body of
+ * every chunk, followed by num_bodies.
+ */
+static std::vector<std::size_t> balance_chunks(const std::vector<unsigned int>& cost) {
+  const std::size_t num_chunks = std::min(cost.size(), CHUNKS_PER_THREAD * static_cast<std::size_t>(omp_get_max_threads()));
+  const std::uint64_t total = std::accumulate(cost.begin(), cost.end(), std::uint64_t{0});
+  std::vector<std::size_t> bounds{0};
+  std::uint64_t running = 0;
+  for (std::size_t i = 0; i < cost.size() && bounds.size() < num_chunks; ++i) {
+    running += cost[i];
+    if (running * num_chunks >= total * bounds.size()) bounds.push_back(i + 1);
+  }
+  bounds.push_back(cost.size());
+  return bounds;
+}
+
+/*
+ * Detect and respond to collisions. When
+ * counting, the same steps also fill in
+ * this tick's stats and write them out.
+ */
+template <bool counting>
+void Engine::collision_update(const float dt) {
+  if constexpr (counting) thread_stats.assign(static_cast<std::size_t>(omp_get_max_threads()), ThreadStats{});
+  std::vector<std::tuple<CollisionResponse, unsigned int, unsigned int>> collisions;
+  if (loose_octree) {
+    auto octree = make_loose_octree(dt);
+    if constexpr (counting) tick_stats.octree = octree->shape();
+    collisions = find_collisions<counting>(std::move(octree), dt);
+  }
+  else {
+    auto octree = make_octree(dt);
+    if constexpr (counting) tick_stats.octree = octree->shape();
+    collisions = find_collisions<counting>(std::move(octree), dt);
+  }
+  collision_response(collisions);
+  collision_response_with_walls<counting>(dt);
+  if constexpr (counting) {
+    tick_stats.tick = tick;
+    tick_stats.candidate_pairs = tick_stats.narrowphase_tests = tick_stats.contacts = tick_stats.wall_hits = 0;
+    tick_stats.max_penetration = 0.0f;
+    for (const auto& counts : thread_stats) {
+      tick_stats.candidate_pairs += counts.candidate_pairs;
+      tick_stats.narrowphase_tests += counts.narrowphase_tests;
+      tick_stats.contacts += counts.contacts;
+      tick_stats.wall_hits += counts.wall_hits;
+      tick_stats.max_penetration = std::max(tick_stats.max_penetration, counts.max_penetration);
+    }
+    stats_writer->write(tick_stats);
+  }
+}
+
+/*
+ * Count one narrowphase test, and whether it
+ * found a contact between bodies or a wall.
+ */
+static inline void count_test(ThreadStats& counts, const CollisionResponse& resp, const bool wall) {
+  ++counts.narrowphase_tests;
+  if (!resp.collides) return;
+  ++(wall ? counts.wall_hits : counts.contacts);
+  counts.max_penetration = std::max(counts.max_penetration, resp.depth);
+}
+
+/*
+ * Perform collision detection. The octree
+ * hands us every overlapping pair once, so
+ * we only need to run the narrowphase on
+ * them. Every pair costs about the same, so
+ * each thread takes one contiguous run of
+ * pairs, and appending the runs in thread
+ * order keeps the pairs in order.
+ */
+template <bool counting>
+std::vector<std::tuple<CollisionResponse, unsigned int, unsigned int>> Engine::find_collisions(const std::unique_ptr<Octree> octree, const float dt) {
+  const auto pairs = octree->pairs();
+  if constexpr (counting) thread_stats[0].candidate_pairs += pairs.size();
+  std::vector<std::vector<std::tuple<CollisionResponse, unsigned int, unsigned int>>> found(static_cast<std::size_t>(omp_get_max_threads()));
+#pragma omp parallel for schedule(static)
+  for (std::size_t p = 0; p < pairs.size(); ++p) {
+    const auto [first, second] = pairs[p];
+    auto resp = check_pair_collision(first, second, is_swept(first, dt) || is_swept(second, dt));
+    if constexpr (counting) count_test(thread_stats[static_cast<std::size_t>(omp_get_thread_num())], resp, false);
+    if (resp.collides) found[static_cast<std::size_t>(omp_get_thread_num())].emplace_back(resp, first, second);
+  }
+  std::vector<std::tuple<CollisionResponse, unsigned int, unsigned int>> collisions;
+  for (const auto& thread_found : found) collisions.insert(collisions.end(), thread_found.begin(), thread_found.end());
+  return collisions;
+}
+
+/*
+ * Perform collision detection with a loose
+ * octree. Queries never return a body twice,
+ * so each thread collects candidates in a
+ * plain vector. Queries in dense clusters
+ * cost far more than ones in empty space,
+ * so we split the bodies by last tick's
+ * costs, and threads pull chunks as they
+ * finish. Collisions are kept per chunk,
+ * so they come out in body order no matter
+ * which thread found them.
+ */
+template <bool counting>
+std::vector<std::tuple<CollisionResponse, unsigned int, unsigned int>> Engine::find_collisions(const std::unique_ptr<LooseOctree> octree, const float dt) {
+  if (query_cost.size() != num_bodies) query_cost.assign(num_bodies, 1u);
+  const auto bounds = balance_chunks(query_cost);
+  const std::size_t num_chunks = bounds.size() - 1;
+  std::vector<std::vector<std::tuple<CollisionResponse, unsigned int, unsigned int>>> found(num_chunks);
+#pragma omp parallel
+  {
+    std::vector<unsigned int> working_set;
+#pragma omp for schedule(dynamic, 1)
+    for (std::size_t chunk = 0; chunk < num_chunks; ++chunk) {
+      for (unsigned int i = static_cast<unsigned int>(bounds[chunk]); i < bounds[chunk + 1]; ++i) {
+	octree->possibilities(i, get_swept_aabb_at(i, dt), working_set);
+	if constexpr (counting) thread_stats[static_cast<std::size_t>(omp_get_thread_num())].candidate_pairs += working_set.size();
+	const bool my_swept = is_swept(i, dt);
+	for (unsigned int other : working_set) {
+	  auto resp = check_pair_collision(i, other, my_swept || is_swept(other, dt));
+	  if constexpr (counting) count_test(thread_stats[static_cast<std::size_t>(omp_get_thread_num())], resp, false);
+	  if (resp.collides) found[chunk].emplace_back(resp, i, other);
+	}
+	query_cost[i] = static_cast<unsigned int>(working_set.size()) + 1u;
+	working_set.clear();
       }
     }
-    working_set.clear();
   }
+  std::vector<std::tuple<CollisionResponse, unsigned int, unsigned int>> collisions;
+  for (const auto& chunk_found : found) collisions.insert(collisions.end(), chunk_found.begin(), chunk_found.end());
   return collisions;
 }
 
@@ -228,108 +696,212 @@ void Engine::collision_response(const std::vector<std::tuple<CollisionResponse,
     vel.x[second] -= nx * j / mass2;
     vel.y[second] -= ny * j / mass2;
     vel.z[second] -= nz * j / mass2;
+    if (friction > 0.0f) friction_response(first, second, nx, ny, nz, j);
   }
 }
 
 /*
- * Perform collision detection with walls.
+ * Apply Coulomb friction at a contact
+ * between two bodies. The normal points from
+ * the second body towards the first, and j
+ * is the normal impulse of the contact. The
+ * friction impulse opposes the sliding
+ * velocity at the contact point, and is
+ * just large enough to stop the sliding,
+ * but never larger than friction * j.
+ * Since it acts off center, it also spins
+ * both bodies.
+ */
+void Engine::friction_response(const unsigned int first, const unsigned int second, const float nx, const float ny, const float nz, const float j) {
+  const float rad1 = get_radius_at(first), rad2 = get_radius_at(second);
+  const float r1x = -nx * rad1, r1y = -ny * rad1, r1z = -nz * rad1;
+  const float r2x = nx * rad2, r2y = ny * rad2, r2z = nz * rad2;
+  float vx = vel.x[first] + ang_vel.y[first] * r1z - ang_vel.z[first] * r1y - vel.x[second] - (ang_vel.y[second] * r2z - ang_vel.z[second] * r2y);
+  float vy = vel.y[first] + ang_vel.z[first] * r1x - ang_vel.x[first] * r1z - vel.y[second] - (ang_vel.z[second] * r2x - ang_vel.x[second] * r2z);
+  float vz = vel.z[first] + ang_vel.x[first] * r1y - ang_vel.y[first] * r1x - vel.z[second] - (ang_vel.x[second] * r2y - ang_vel.y[second] * r2x);
+  const float vn = vx * nx + vy * ny + vz * nz;
+  vx -= vn * nx;
+  vy -= vn * ny;
+  vz -= vn * nz;
+  const float vt = sqrtf(vx * vx + vy * vy + vz * vz);
+  if (vt < 1e-6f) return;
+  const float tx = vx / vt, ty = vy / vt, tz = vz / vt;
+
+  /*
+   * Lever arms are along the normal, so they
+   * are perpendicular to the tangent.
+   */
+  const float k = 1.0f / mass[first] + 1.0f / mass[second] + inv_inertia[first] * rad1 * rad1 + inv_inertia[second] * rad2 * rad2;
+  const float jt = std::min(vt / k, friction * fabsf(j));
+  vel.x[first] -= jt * tx / mass[first];
+  vel.y[first] -= jt * ty / mass[first];
+  vel.z[first] -= jt * tz / mass[first];
+  vel.x[second] += jt * tx / mass[second];
+  vel.y[second] += jt * ty / mass[second];
+  vel.z[second] += jt * tz / mass[second];
+  ang_vel.x[first] -= inv_inertia[first] * jt * (r1y * tz - r1z * ty);
+  ang_vel.y[first] -= inv_inertia[first] * jt * (r1z * tx - r1x * tz);
+  ang_vel.z[first] -= inv_inertia[first] * jt * (r1x * ty - r1y * tx);
+  ang_vel.x[second] += inv_inertia[second] * jt * (r2y * tz - r2z * ty);
+  ang_vel.y[second] += inv_inertia[second] * jt * (r2z * tx - r2x * tz);
+  ang_vel.z[second] += inv_inertia[second] * jt * (r2x * ty - r2y * tx);
+}
+
+/*
+ * Apply Coulomb friction at a contact with
+ * a wall, whose normal points into the
+ * simulation. Walls don't move, so only the
+ * body's velocities change.
+ */
+void Engine::friction_response_with_wall(const unsigned int i, const float nx, const float ny, const float nz, const float j) {
+  const float rad = get_radius_at(i);
+  const float rx = -nx * rad, ry = -ny * rad, rz = -nz * rad;
+  float vx = vel.x[i] + ang_vel.y[i] * rz - ang_vel.z[i] * ry;
+  float vy = vel.y[i] + ang_vel.z[i] * rx - ang_vel.x[i] * rz;
+  float vz = vel.z[i] + ang_vel.x[i] * ry - ang_vel.y[i] * rx;
+  const float vn = vx * nx + vy * ny + vz * nz;
+  vx -= vn * nx;
+  vy -= vn * ny;
+  vz -= vn * nz;
+  const float vt = sqrtf(vx * vx + vy * vy + vz * vz);
+  if (vt < 1e-6f) return;
+  const float tx = vx / vt, ty = vy / vt, tz = vz / vt;
+
+  const float k = 1.0f / mass[i] + inv_inertia[i] * rad * rad;
+  const float jt = std::min(vt / k, friction * fabsf(j));
+  vel.x[i] -= jt * tx / mass[i];
+  vel.y[i] -= jt * ty / mass[i];
+  vel.z[i] -= jt * tz / mass[i];
+  ang_vel.x[i] -= inv_inertia[i] * jt * (ry * tz - rz * ty);
+  ang_vel.y[i] -= inv_inertia[i] * jt * (rz * tx - rx * tz);
+  ang_vel.z[i] -= inv_inertia[i] * jt * (rx * ty - ry * tx);
+}
+
+/*
+ * Push a body back out of a wall along axis
+ * (0 for x, 1 for y, 2 for z), sign being the
+ * direction of the wall's normal along it, and
+ * bounce it off.
  */
-void Engine::collision_response_with_walls() {
+void Engine::wall_response(const unsigned int i, const unsigned int axis, const float sign, const float depth) {
+  auto &p = axis == 0 ? pos.x : axis == 1 ? pos.y : pos.z;
+  auto &v = axis == 0 ? vel.x : axis == 1 ? vel.y : vel.z;
+  p[i] += sign * depth;
+  if (friction > 0.0f) {
+    const float j = mass[i] * (1.0f + elasticity) * fabsf(v[i]);
+    v[i] *= -elasticity;
+    friction_response_with_wall(i, axis == 0 ? sign : 0.0f, axis == 1 ? sign : 0.0f, axis == 2 ? sign : 0.0f, j);
+  }
+  else v[i] *= -elasticity;
+}
+
+/*
+ * Perform collision detection with walls,
+ * in the order of boundary: min x, max x,
+ * min y, and so on. Each body only touches
+ * its own state, so bodies are handled in
+ * parallel.
+ */
+template <bool counting>
+void Engine::collision_response_with_walls(const float dt) {
+  const Transform wall_pos[6] = {Transform{boundary[0], 0.0f, 0.0f}, Transform{boundary[1], 0.0f, 0.0f},
+				 Transform{0.0f, boundary[2], 0.0f}, Transform{0.0f, boundary[3], 0.0f},
+				 Transform{0.0f, 0.0f, boundary[4]}, Transform{0.0f, 0.0f, boundary[5]}};
+#pragma omp parallel for schedule(static)
   for (unsigned int i = 0; i < num_bodies; ++i) {
-    CollisionResponse resp = colliders[i]->checkCollision(walls[0], get_transform_at(i), Transform{boundary[0], 0.0f, 0.0f});
-    if (resp.collides) {
-      pos.x[i] += resp.depth;
-      vel.x[i] *= -elasticity;
-    }
-    resp = colliders[i]->checkCollision(walls[1], get_transform_at(i), Transform{boundary[1], 0.0f, 0.0f});
-    if (resp.collides) {
-      pos.x[i] -= resp.depth;
-      vel.x[i] *= -elasticity;
-    }
-    resp = colliders[i]->checkCollision(walls[2], get_transform_at(i), Transform{0.0f, boundary[2], 0.0f});
-    if (resp.collides) {
-      pos.y[i] += resp.depth;
-      vel.y[i] *= -elasticity;
-    }
-    resp = colliders[i]->checkCollision(walls[3], get_transform_at(i), Transform{0.0f, boundary[3], 0.0f});
-    if (resp.collides) {
-      pos.y[i] -= resp.depth;
-      vel.y[i] *= -elasticity;
-    }
-    resp = colliders[i]->checkCollision(walls[4], get_transform_at(i), Transform{0.0f, 0.0f, boundary[4]});
-    if (resp.collides) {
-      pos.z[i] += resp.depth;
-      vel.z[i] *= -elasticity;
-    }
-    resp = colliders[i]->checkCollision(walls[5], get_transform_at(i), Transform{0.0f, 0.0f, boundary[5]});
-    if (resp.collides) {
-      pos.z[i] -= resp.depth;
-      vel.z[i] *= -elasticity;
+    const bool swept = is_swept(i, dt);
+    ThreadStats *const counts = counting ? &thread_stats[static_cast<std::size_t>(omp_get_thread_num())] : nullptr;
+    for (unsigned int wall = 0; wall < 6; ++wall) {
+      const CollisionResponse resp = check_wall_collision(i, wall, wall_pos[wall], swept);
+      if constexpr (counting) count_test(*counts, resp, true);
+      if (resp.collides) wall_response(i, wall / 2, wall % 2 ? -1.0f : 1.0f, resp.depth);
     }
   }
 }
 
 /*
- * Helper to perform a[i] = b[i] * c using
- * AVX instructions.
+ * Helper to perform a[i] = b[i] * c for i
+ * in [begin, end) using AVX instructions.
+ * begin must be a multiple of 8.
  */
-void Engine::multiply_with_mass(float *const a, const float *const b, const float c, const __m256& c_a) {
-  std::size_t i = 0;
-  if (num_bodies >= 8) {
-    for (; i <= num_bodies - 8; i += 8) {
-      const __m256 b_a = _mm256_set_ps(b[i + 7], b[i + 6], b[i + 5], b[i + 4], b[i + 3], b[i + 2], b[i + 1], b[i]);
-      const __m256 result = _mm256_mul_ps(b_a, c_a);
-      _mm256_store_ps(a + i, result);
-    }
+void Engine::multiply_with_mass(float *const a, const float *const b, const float c, const __m256& c_a, const std::size_t begin, const std::size_t end) {
+  std::size_t i = begin;
+  for (; i + 8 <= end; i += 8) {
+    const __m256 b_a = _mm256_set_ps(b[i + 7], b[i + 6], b[i + 5], b[i + 4], b[i + 3], b[i + 2], b[i + 1], b[i]);
+    const __m256 result = _mm256_mul_ps(b_a, c_a);
+    _mm256_store_ps(a + i, result);
   }
-  for (; i < num_bodies; ++i) {
+  for (; i < end; ++i) {
     a[i] = b[i] * c;
   }
 }
 
 /*
- * Helper to perform a[i] += b[i] * dt
- * using AVX instructions.
+ * Helper to perform a[i] += b[i] * dt for
+ * i in [begin, end) using AVX instructions.
  */
-void Engine::fused_multiply_add(const float dt, const __m256& dt_a, float *const a, const float *const b) {
-  std::size_t i = 0;
-  if (num_bodies >= 8) {
-    for (; i <= num_bodies - 8; i += 8) {
-      const __m256 a_a = _mm256_set_ps(a[i + 7], a[i + 6], a[i + 5], a[i + 4], a[i + 3], a[i + 2], a[i + 1], a[i]);
-      const __m256 b_a = _mm256_set_ps(b[i + 7], b[i + 6], b[i + 5], b[i + 4], b[i + 3], b[i + 2], b[i + 1], b[i]);
-      const __m256 result = _mm256_fmadd_ps(b_a, dt_a, a_a);
-      _mm256_store_ps(a + i, result);
-    }
+void Engine::fused_multiply_add(const float dt, const __m256& dt_a, float *const a, const float *const b, const std::size_t begin, const std::size_t end) {
+  std::size_t i = begin;
+  for (; i + 8 <= end; i += 8) {
+    const __m256 a_a = _mm256_set_ps(a[i + 7], a[i + 6], a[i + 5], a[i + 4], a[i + 3], a[i + 2], a[i + 1], a[i]);
+    const __m256 b_a = _mm256_set_ps(b[i + 7], b[i + 6], b[i + 5], b[i + 4], b[i + 3], b[i + 2], b[i + 1], b[i]);
+    const __m256 result = _mm256_fmadd_ps(b_a, dt_a, a_a);
+    _mm256_store_ps(a + i, result);
   }
-  for (; i < num_bodies; ++i) {
+  for (; i < end; ++i) {
     a[i] += b[i] * dt;
   }
 }
 
 /*
  * Helper to perform a[i] += b[i] * dt / m[i]
- * using AVX instructions.
- */
-void Engine::fused_multiply_add_with_mass(const float dt, const __m256& dt_a, float *const a, const float *const b, const float *const m) {
-  std::size_t i = 0;
-  if (num_bodies >= 8) {
-    for (; i <= num_bodies - 8; i += 8) {
-      const __m256 a_a = _mm256_set_ps(a[i + 7], a[i + 6], a[i + 5], a[i + 4], a[i + 3], a[i + 2], a[i + 1], a[i]);
-      const __m256 b_a = _mm256_set_ps(b[i + 7], b[i + 6], b[i + 5], b[i + 4], b[i + 3], b[i + 2], b[i + 1], b[i]);
-      const __m256 m_a = _mm256_set_ps(m[i + 7], m[i + 6], m[i + 5], m[i + 4], m[i + 3], m[i + 2], m[i + 1], m[i]);
-      const __m256 result = _mm256_fmadd_ps(_mm256_div_ps(b_a, m_a), dt_a, a_a);
-      _mm256_store_ps(a + i, result);
-    }
+ * for i in [begin, end) using AVX
+ * instructions.
+ */
+void Engine::fused_multiply_add_with_mass(const float dt, const __m256& dt_a, float *const a, const float *const b, const float *const m, const std::size_t begin, const std::size_t end) {
+  std::size_t i = begin;
+  for (; i + 8 <= end; i += 8) {
+    const __m256 a_a = _mm256_set_ps(a[i + 7], a[i + 6], a[i + 5], a[i + 4], a[i + 3], a[i + 2], a[i + 1], a[i]);
+    const __m256 b_a = _mm256_set_ps(b[i + 7], b[i + 6], b[i + 5], b[i + 4], b[i + 3], b[i + 2], b[i + 1], b[i]);
+    const __m256 m_a = _mm256_set_ps(m[i + 7], m[i + 6], m[i + 5], m[i + 4], m[i + 3], m[i + 2], m[i + 1], m[i]);
+    const __m256 result = _mm256_fmadd_ps(_mm256_div_ps(b_a, m_a), dt_a, a_a);
+    _mm256_store_ps(a + i, result);
   }
-  for (; i < num_bodies; ++i) {
+  for (; i < end; ++i) {
     a[i] += b[i] * dt  / m[i];
   }
 }
 
+void Engine::set_sphere_at(const std::size_t i, const ConfigSphere& body) {
+  pos.x[i] = body.x;
+  pos.y[i] = body.y;
+  pos.z[i] = body.z;
+
+  vel.x[i] = body.vx;
+  vel.y[i] = body.vy;
+  vel.z[i] = body.vz;
+
+  mass[i] = body.m;
+  ang_pos.w[i] = 1.0f;
+  ang_pos.x[i] = 0.0f;
+  ang_pos.y[i] = 0.0f;
+  ang_pos.z[i] = 0.0f;
+  ang_vel.x[i] = 0.0f;
+  ang_vel.y[i] = 0.0f;
+  ang_vel.z[i] = 0.0f;
+  inv_inertia[i] = body.m > 0.0f && body.r > 0.0f ? 1.0f / (0.4f * body.m * body.r * body.r) : 0.0f;
+  colliders[i] = std::make_unique<SphereCollider>(body.r);
+}
+
 Transform Engine::get_transform_at(const std::size_t i) {
   return Transform{pos.x[i], pos.y[i], pos.z[i]};
 }
 
+float Engine::get_radius_at(const std::size_t i) {
+  if (SphereCollider* coll = dynamic_cast<SphereCollider*>(colliders[i].get())) return coll->radius;
+  return 0.0f;
+}
+
 AABB Engine::get_aabb_at(const std::size_t i) {
   const auto& unknown_coll = colliders[i].get();
   float pos_x = pos.x[i];
@@ -342,45 +914,711 @@ AABB Engine::get_aabb_at(const std::size_t i) {
   else return AABB{0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
 }
 
-void Engine::dump_init_to_file() {
-  fs.write(reinterpret_cast<const char*>(&num_bodies), static_cast<std::streamsize>(sizeof(std::size_t)));
+/*
+ * Swept bodies get an AABB that covers their
+ * whole path through the tick.
+ */
+AABB Engine::get_swept_aabb_at(const std::size_t i, const float dt) {
+  const AABB aabb = get_aabb_at(i);
+  if (!is_swept(i, dt)) return aabb;
+  const float dx = prev_pos.x[i] - pos.x[i];
+  const float dy = prev_pos.y[i] - pos.y[i];
+  const float dz = prev_pos.z[i] - pos.z[i];
+  return AABB{aabb.x1 + std::min(dx, 0.0f), aabb.x2 + std::max(dx, 0.0f),
+	      aabb.y1 + std::min(dy, 0.0f), aabb.y2 + std::max(dy, 0.0f),
+	      aabb.z1 + std::min(dz, 0.0f), aabb.z2 + std::max(dz, 0.0f)};
+}
+
+/*
+ * Whether a body moved faster than ccd_speed
+ * this tick.
+ */
+bool Engine::is_swept(const std::size_t i, const float dt) {
+  if (ccd_speed == 0.0f) return false;
+  const float dx = pos.x[i] - prev_pos.x[i];
+  const float dy = pos.y[i] - prev_pos.y[i];
+  const float dz = pos.z[i] - prev_pos.z[i];
+  const float reach = ccd_speed * dt;
+  return dx * dx + dy * dy + dz * dz > reach * reach;
+}
+
+/*
+ * Narrowphase between two bodies, swept from
+ * their start of tick positions if either of
+ * them is fast.
+ */
+CollisionResponse Engine::check_pair_collision(const unsigned int first, const unsigned int second, const bool swept) {
+  if (!swept) return colliders[first]->checkCollision(*colliders[second], get_transform_at(first), get_transform_at(second));
+  return colliders[first]->checkSweptCollision(*colliders[second],
+					       Transform{prev_pos.x[first], prev_pos.y[first], prev_pos.z[first]}, get_transform_at(first),
+					       Transform{prev_pos.x[second], prev_pos.y[second], prev_pos.z[second]}, get_transform_at(second));
+}
+
+/*
+ * Narrowphase between a body and a wall. A
+ * swept body that reached the wall partway
+ * through the tick spends the rest of the
+ * tick bouncing back off it (by elasticity
+ * times the distance it went past), rather
+ * than stopping at the wall.
+ */
+CollisionResponse Engine::check_wall_collision(const std::size_t i, const unsigned int wall, const Transform& wall_pos, const bool swept) {
+  if (!swept) return colliders[i]->checkCollision(walls[wall], get_transform_at(i), wall_pos);
+  CollisionResponse resp = colliders[i]->checkSweptCollision(walls[wall], Transform{prev_pos.x[i], prev_pos.y[i], prev_pos.z[i]}, get_transform_at(i), wall_pos, wall_pos);
+  if (resp.collides && resp.toi > 0.0f) resp.depth *= 1.0f + elasticity;
+  return resp;
+}
+
+void Engine::write_init(std::ostream& out) const {
+  out.write(RECORDING_MAGIC, sizeof(RECORDING_MAGIC));
+  out.write(reinterpret_cast<const char*>(&RECORDING_VERSION), static_cast<std::streamsize>(sizeof(RECORDING_VERSION)));
+  out.write(reinterpret_cast<const char*>(&record_interval), static_cast<std::streamsize>(sizeof(std::size_t)));
+  out.write(reinterpret_cast<const char*>(&num_bodies), static_cast<std::streamsize>(sizeof(std::size_t)));
   for (auto i = 0; i < 6; ++i) {
-    fs.write(reinterpret_cast<const char*>(&boundary[i]), static_cast<std::streamsize>(sizeof(float)));
+    out.write(reinterpret_cast<const char*>(&boundary[i]), static_cast<std::streamsize>(sizeof(float)));
   }
-  for (auto& coll : colliders) {
-    coll->serialize(fs);
+  for (std::size_t id = 0; id < index_of.size(); ++id) {
+    if (index_of[id] != NO_INDEX) colliders[index_of[id]]->serialize(out);
   }
 }
 
-void Engine::load_init_from_file() {
-  fs.read(reinterpret_cast<char*>(&num_bodies), static_cast<std::streamsize>(sizeof(std::size_t)));
+/*
+ * Reading a header starts playback over with
+ * a new set of bodies, all at the origin until
+ * their poses are set.
+ */
+int Engine::load_init(std::istream& in) {
+  char magic[sizeof(RECORDING_MAGIC)];
+  std::uint32_t version = 0;
+  in.read(magic, sizeof(magic));
+  in.read(reinterpret_cast<char*>(&version), static_cast<std::streamsize>(sizeof(version)));
+  if (!in || !std::equal(magic, magic + sizeof(magic), RECORDING_MAGIC)) {
+    std::cerr << "ERROR: Not a Hummingbird recording." << std::endl;
+    return -1;
+  }
+  if (version != RECORDING_VERSION) {
+    std::cerr << "ERROR: Recording has version " << version << ", but this build of Hummingbird reads version " << RECORDING_VERSION << "." << std::endl;
+    return -1;
+  }
+  std::size_t file_record_interval = 0, file_num_bodies = 0;
+  float file_boundary[6];
+  in.read(reinterpret_cast<char*>(&file_record_interval), static_cast<std::streamsize>(sizeof(std::size_t)));
+  in.read(reinterpret_cast<char*>(&file_num_bodies), static_cast<std::streamsize>(sizeof(std::size_t)));
+  in.read(reinterpret_cast<char*>(file_boundary), static_cast<std::streamsize>(6 * sizeof(float)));
+
+  /*
+   * Headers also come in from stream servers,
+   * so the body count is checked against what
+   * the rest of the stream can hold (at least a
+   * type and a float per collider) before we
+   * size anything by it, and nothing is changed
+   * until every collider has been read.
+   */
+  const std::streamoff colliders_start = in.tellg();
+  in.seekg(0, std::ios::end);
+  const std::streamoff header_end = in.tellg();
+  in.seekg(colliders_start);
+  if (!in || !file_record_interval || colliders_start < 0 || header_end < colliders_start || file_num_bodies >= NO_INDEX ||
+      file_num_bodies > static_cast<std::size_t>(header_end - colliders_start) / (sizeof(ColliderType) + sizeof(float))) {
+    std::cerr << "ERROR: Recording is truncated or corrupt." << std::endl;
+    return -1;
+  }
+  std::vector<std::unique_ptr<Collider>> file_colliders;
+  file_colliders.reserve(file_num_bodies);
+  for (std::size_t i = 0; i < file_num_bodies; ++i) {
+    file_colliders.push_back(deserialize_collider(in));
+    if (!in || !file_colliders.back()) {
+      std::cerr << "ERROR: Recording is truncated or corrupt." << std::endl;
+      return -1;
+    }
+  }
+
+  record_interval = file_record_interval;
+  num_bodies = file_num_bodies;
+  std::copy(file_boundary, file_boundary + 6, boundary);
+  colliders = std::move(file_colliders);
   pos.x.resize(num_bodies);
   pos.y.resize(num_bodies);
   pos.z.resize(num_bodies);
-  ang_pos.resize(num_bodies);
-  for (auto i = 0; i < 6; ++i) {
-    fs.read(reinterpret_cast<char*>(&boundary[i]), static_cast<std::streamsize>(sizeof(float)));
+  for (auto arr : {&ang_pos.w, &ang_pos.x, &ang_pos.y, &ang_pos.z}) arr->resize(num_bodies);
+  for (auto& key : key_pos) for (auto arr : {&key.x, &key.y, &key.z}) arr->resize(num_bodies);
+  for (auto& key : key_vel) for (auto arr : {&key.x, &key.y, &key.z}) arr->resize(num_bodies);
+  for (auto& key : key_ang_pos) for (auto arr : {&key.w, &key.x, &key.y, &key.z}) arr->resize(num_bodies);
+  ids.resize(num_bodies);
+  std::iota(ids.begin(), ids.end(), 0u);
+  index_of = ids;
+  ++body_changes;
+  return 0;
+}
+
+/*
+ * Poses of every body, in the order write_init
+ * lists them.
+ */
+void Engine::get_poses(std::vector<BodyPose>& poses) const {
+  poses.resize(num_bodies);
+  std::size_t k = 0;
+  for (std::size_t id = 0; id < index_of.size(); ++id) {
+    const unsigned int i = index_of[id];
+    if (i == NO_INDEX) continue;
+    poses[k++] = BodyPose{pos.x[i], pos.y[i], pos.z[i], ang_pos.w[i], ang_pos.x[i], ang_pos.y[i], ang_pos.z[i]};
+  }
+}
+
+int Engine::set_poses(const std::vector<BodyPose>& poses) {
+  if (poses.size() != num_bodies) {
+    std::cerr << "ERROR: Got poses for " << poses.size() << " bodies, but there are " << num_bodies << "." << std::endl;
+    return -1;
   }
+#pragma omp parallel for
   for (std::size_t i = 0; i < num_bodies; ++i) {
-    colliders.push_back(deserialize_collider(fs));
+    pos.x[i] = poses[i].x;
+    pos.y[i] = poses[i].y;
+    pos.z[i] = poses[i].z;
+    ang_pos.w[i] = poses[i].qw;
+    ang_pos.x[i] = poses[i].qx;
+    ang_pos.y[i] = poses[i].qy;
+    ang_pos.z[i] = poses[i].qz;
   }
+  return 0;
 }
 
-void Engine::dump_tick_to_file(float dt) {
-  fs.write(reinterpret_cast<const char*>(pos.x.data()), static_cast<std::streamsize>(pos.x.size() * sizeof(float)));
-  fs.write(reinterpret_cast<const char*>(pos.y.data()), static_cast<std::streamsize>(pos.y.size() * sizeof(float)));
-  fs.write(reinterpret_cast<const char*>(pos.z.data()), static_cast<std::streamsize>(pos.z.size() * sizeof(float)));
-  fs.write(reinterpret_cast<const char*>(ang_pos.data()), static_cast<std::streamsize>(pos.z.size() * sizeof(Quaternion)));
+/*
+ * Recordings always list bodies by their
+ * external ID, no matter how the engine has
+ * reordered them. Each recorded frame holds
+ * positions, velocities, orientations, and
+ * the simulated time and number of ticks
+ * since the last frame.
+ */
+void Engine::dump_tick_to_file(float dt, std::uint32_t ticks) {
+  vector32f scratch(num_bodies);
+  for (auto arr : {&pos.x, &pos.y, &pos.z, &vel.x, &vel.y, &vel.z}) {
+#pragma omp parallel for
+    for (std::size_t id = 0; id < num_bodies; ++id) scratch[id] = (*arr)[index_of[id]];
+    fs.write(reinterpret_cast<const char*>(scratch.data()), static_cast<std::streamsize>(num_bodies * sizeof(float)));
+  }
+  std::vector<Quaternion> ang_pos_by_id(num_bodies);
+#pragma omp parallel for
+  for (std::size_t id = 0; id < num_bodies; ++id) {
+    const unsigned int i = index_of[id];
+    ang_pos_by_id[id] = Quaternion{ang_pos.w[i], ang_pos.x[i], ang_pos.y[i], ang_pos.z[i]};
+  }
+  fs.write(reinterpret_cast<const char*>(ang_pos_by_id.data()), static_cast<std::streamsize>(num_bodies * sizeof(Quaternion)));
   fs.write(reinterpret_cast<char*>(&dt), static_cast<std::streamsize>(sizeof(float)));
+  fs.write(reinterpret_cast<char*>(&ticks), static_cast<std::streamsize>(sizeof(ticks)));
+}
+
+/*
+ * Read the next recorded frame into keyframe
+ * 1. Returns false once the recording runs out.
+ */
+bool Engine::load_tick_from_file() {
+  if (fs.peek() == EOF) return false;
+  Vec3x<float, 32>& next_pos = key_pos[1];
+  Vec3x<float, 32>& next_vel = key_vel[1];
+  for (auto arr : {&next_pos.x, &next_pos.y, &next_pos.z, &next_vel.x, &next_vel.y, &next_vel.z}) {
+    fs.read(reinterpret_cast<char*>(arr->data()), static_cast<std::streamsize>(num_bodies * sizeof(float)));
+  }
+  std::vector<Quaternion> ang_pos_by_id(num_bodies);
+  fs.read(reinterpret_cast<char*>(ang_pos_by_id.data()), static_cast<std::streamsize>(num_bodies * sizeof(Quaternion)));
+  for (std::size_t i = 0; i < num_bodies; ++i) {
+    key_ang_pos[1].w[i] = ang_pos_by_id[i].w;
+    key_ang_pos[1].x[i] = ang_pos_by_id[i].x;
+    key_ang_pos[1].y[i] = ang_pos_by_id[i].y;
+    key_ang_pos[1].z[i] = ang_pos_by_id[i].z;
+  }
+  fs.read(reinterpret_cast<char*>(&key_interval), static_cast<std::streamsize>(sizeof(float)));
+  fs.read(reinterpret_cast<char*>(&key_ticks), static_cast<std::streamsize>(sizeof(key_ticks)));
+  return fs && key_ticks > 0;
+}
+
+/*
+ * Move playback forward. Following the clock,
+ * we move dt * playback_speed simulated seconds;
+ * stepping, we move one simulated tick, i.e. a
+ * key_ticks-th of the way to the next keyframe.
+ * Each time we pass keyframe 1, it becomes
+ * keyframe 0 and we read the next one.
+ */
+void Engine::playback_update(const float dt) {
+  if (!have_next_key) {
+    reached_end = true;
+    return;
+  }
+  bool advance = false;
+  if (pace_playback) {
+    key_time += dt * playback_speed;
+    advance = key_time >= key_interval;
+  }
+  else {
+    advance = ++key_step >= key_ticks;
+  }
+  while (advance) {
+    key_time = std::max(key_time - key_interval, 0.0f);
+    key_step = 0;
+    std::swap(key_pos[0], key_pos[1]);
+    std::swap(key_vel[0], key_vel[1]);
+    std::swap(key_ang_pos[0], key_ang_pos[1]);
+    have_next_key = load_tick_from_file();
+    advance = pace_playback && have_next_key && key_time >= key_interval;
+  }
+  if (!have_next_key) key_time = 0.0f;
+
+  const float t = !have_next_key ? 0.0f : pace_playback ? key_time / key_interval : static_cast<float>(key_step) / static_cast<float>(key_ticks);
+  interpolate_keyframes(t);
+}
+
+/*
+ * Fill in positions and orientations a fraction
+ * t of the way from keyframe 0 to keyframe 1.
+ */
+void Engine::interpolate_keyframes(const float t) {
+  if (t == 0.0f) {
+    pos = key_pos[0];
+    ang_pos = key_ang_pos[0];
+    return;
+  }
+  const float t2 = t * t, t3 = t2 * t;
+  const float h00 = 2.0f * t3 - 3.0f * t2 + 1.0f;
+  const float h10 = (t3 - 2.0f * t2 + t) * key_interval;
+  const float h01 = -2.0f * t3 + 3.0f * t2;
+  const float h11 = (t3 - t2) * key_interval;
+  const Vec3x<float, 32>* const p = key_pos;
+  const Vec3x<float, 32>* const v = key_vel;
+  const Vec4x<float, 32>* const q = key_ang_pos;
+#pragma omp parallel for
+  for (std::size_t i = 0; i < num_bodies; ++i) {
+    pos.x[i] = h00 * p[0].x[i] + h10 * v[0].x[i] + h01 * p[1].x[i] + h11 * v[1].x[i];
+    pos.y[i] = h00 * p[0].y[i] + h10 * v[0].y[i] + h01 * p[1].y[i] + h11 * v[1].y[i];
+    pos.z[i] = h00 * p[0].z[i] + h10 * v[0].z[i] + h01 * p[1].z[i] + h11 * v[1].z[i];
+    const Quaternion rot = Quaternion::slerp(Quaternion{q[0].w[i], q[0].x[i], q[0].y[i], q[0].z[i]}, Quaternion{q[1].w[i], q[1].x[i], q[1].y[i], q[1].z[i]}, t);
+    ang_pos.w[i] = rot.w;
+    ang_pos.x[i] = rot.x;
+    ang_pos.y[i] = rot.y;
+    ang_pos.z[i] = rot.z;
+  }
+}
+
+/*
+ * Write the full state of the simulation to
+ * a checkpoint file. Each SoA array is
+ * written in bulk. We write to a temporary
+ * file first and then rename it, so that a
+ * crash in the middle of writing never
+ * clobbers the previous checkpoint.
+ */
+int Engine::save_checkpoint(const std::string& file_name) const {
+  const std::string tmp_file_name = file_name + ".tmp";
+  std::fstream cfs(tmp_file_name, std::ios::binary | std::ios::trunc | std::ios::out);
+  if (!cfs.is_open()) {
+    std::cerr << "ERROR: Couldn't open checkpoint file " << tmp_file_name << " for writing." << std::endl;
+    return -1;
+  }
+
+  const std::uint32_t version = CHECKPOINT_VERSION;
+  cfs.write(CHECKPOINT_MAGIC, static_cast<std::streamsize>(sizeof(CHECKPOINT_MAGIC)));
+  cfs.write(reinterpret_cast<const char*>(&version), static_cast<std::streamsize>(sizeof(std::uint32_t)));
+  cfs.write(reinterpret_cast<const char*>(&num_bodies), static_cast<std::streamsize>(sizeof(std::size_t)));
+  cfs.write(reinterpret_cast<const char*>(&tick), static_cast<std::streamsize>(sizeof(std::size_t)));
+  cfs.write(reinterpret_cast<const char*>(&checkpoint_interval), static_cast<std::streamsize>(sizeof(std::size_t)));
+  cfs.write(reinterpret_cast<const char*>(&ticks_per_frame), static_cast<std::streamsize>(sizeof(std::size_t)));
+  cfs.write(reinterpret_cast<const char*>(&max_ticks_per_frame), static_cast<std::streamsize>(sizeof(std::size_t)));
+  cfs.write(reinterpret_cast<const char*>(&reorder_interval), static_cast<std::streamsize>(sizeof(std::size_t)));
+  cfs.write(reinterpret_cast<const char*>(&speed), static_cast<std::streamsize>(sizeof(float)));
+  cfs.write(reinterpret_cast<const char*>(&grav_constant), static_cast<std::streamsize>(sizeof(float)));
+  cfs.write(reinterpret_cast<const char*>(&elasticity), static_cast<std::streamsize>(sizeof(float)));
+  cfs.write(reinterpret_cast<const char*>(&friction), static_cast<std::streamsize>(sizeof(float)));
+  cfs.write(reinterpret_cast<const char*>(&ccd_speed), static_cast<std::streamsize>(sizeof(float)));
+  cfs.write(reinterpret_cast<const char*>(&cfl), static_cast<std::streamsize>(sizeof(float)));
+  cfs.write(reinterpret_cast<const char*>(&mutual_grav_constant), static_cast<std::streamsize>(sizeof(float)));
+  cfs.write(reinterpret_cast<const char*>(&opening_angle), static_cast<std::streamsize>(sizeof(float)));
+  cfs.write(reinterpret_cast<const char*>(&softening), static_cast<std::streamsize>(sizeof(float)));
+  cfs.write(reinterpret_cast<const char*>(&loose_octree), static_cast<std::streamsize>(sizeof(bool)));
+  cfs.write(reinterpret_cast<const char*>(boundary), static_cast<std::streamsize>(6 * sizeof(float)));
+
+  for (auto arr : {&pos.x, &pos.y, &pos.z, &vel.x, &vel.y, &vel.z, &force.x, &force.y, &force.z,
+		   &ang_pos.w, &ang_pos.x, &ang_pos.y, &ang_pos.z, &ang_vel.x, &ang_vel.y, &ang_vel.z}) {
+    cfs.write(reinterpret_cast<const char*>(arr->data()), static_cast<std::streamsize>(num_bodies * sizeof(float)));
+  }
+  cfs.write(reinterpret_cast<const char*>(mass.data()), static_cast<std::streamsize>(num_bodies * sizeof(float)));
+  cfs.write(reinterpret_cast<const char*>(inv_inertia.data()), static_cast<std::streamsize>(num_bodies * sizeof(float)));
+  const std::size_t num_ids = index_of.size();
+  cfs.write(reinterpret_cast<const char*>(&num_ids), static_cast<std::streamsize>(sizeof(std::size_t)));
+  cfs.write(reinterpret_cast<const char*>(ids.data()), static_cast<std::streamsize>(num_bodies * sizeof(unsigned int)));
+  for (auto& coll : colliders) {
+    coll->serialize(cfs);
+  }
+
+  cfs.close();
+  if (cfs.fail() || std::rename(tmp_file_name.c_str(), file_name.c_str())) {
+    std::cerr << "ERROR: Couldn't write checkpoint file " << file_name << "." << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Replace the state of the simulation with
+ * the state stored in a checkpoint file. On
+ * failure, the engine is left untouched.
+ */
+int Engine::load_checkpoint(const std::string& file_name) {
+  std::fstream cfs(file_name, std::ios::binary | std::ios::in);
+  if (!cfs.is_open()) {
+    std::cerr << "ERROR: Couldn't open checkpoint file " << file_name << "." << std::endl;
+    return -1;
+  }
+
+  char magic[sizeof(CHECKPOINT_MAGIC)] = {};
+  std::uint32_t version = 0;
+  cfs.read(magic, static_cast<std::streamsize>(sizeof(CHECKPOINT_MAGIC)));
+  cfs.read(reinterpret_cast<char*>(&version), static_cast<std::streamsize>(sizeof(std::uint32_t)));
+  if (!cfs || !std::equal(magic, magic + sizeof(CHECKPOINT_MAGIC), CHECKPOINT_MAGIC)) {
+    std::cerr << "ERROR: " << file_name << " is not a checkpoint file." << std::endl;
+    return -1;
+  }
+  if (version != CHECKPOINT_VERSION) {
+    std::cerr << "ERROR: Checkpoint file " << file_name << " has version " << version << ", expected version " << CHECKPOINT_VERSION << "." << std::endl;
+    return -1;
+  }
+
+  std::size_t new_num_bodies = 0, new_tick = 0, new_checkpoint_interval = 0, new_ticks_per_frame = 0, new_max_ticks_per_frame = 0, new_reorder_interval = 0;
+  float new_speed = 0.0f, new_grav_constant = 0.0f, new_elasticity = 0.0f, new_friction = 0.0f, new_ccd_speed = 0.0f, new_cfl = 0.0f, new_boundary[6];
+  float new_mutual_grav_constant = 0.0f, new_opening_angle = 0.0f, new_softening = 0.0f;
+  bool new_loose_octree = false;
+  cfs.read(reinterpret_cast<char*>(&new_num_bodies), static_cast<std::streamsize>(sizeof(std::size_t)));
+  cfs.read(reinterpret_cast<char*>(&new_tick), static_cast<std::streamsize>(sizeof(std::size_t)));
+  cfs.read(reinterpret_cast<char*>(&new_checkpoint_interval), static_cast<std::streamsize>(sizeof(std::size_t)));
+  cfs.read(reinterpret_cast<char*>(&new_ticks_per_frame), static_cast<std::streamsize>(sizeof(std::size_t)));
+  cfs.read(reinterpret_cast<char*>(&new_max_ticks_per_frame), static_cast<std::streamsize>(sizeof(std::size_t)));
+  cfs.read(reinterpret_cast<char*>(&new_reorder_interval), static_cast<std::streamsize>(sizeof(std::size_t)));
+  cfs.read(reinterpret_cast<char*>(&new_speed), static_cast<std::streamsize>(sizeof(float)));
+  cfs.read(reinterpret_cast<char*>(&new_grav_constant), static_cast<std::streamsize>(sizeof(float)));
+  cfs.read(reinterpret_cast<char*>(&new_elasticity), static_cast<std::streamsize>(sizeof(float)));
+  cfs.read(reinterpret_cast<char*>(&new_friction), static_cast<std::streamsize>(sizeof(float)));
+  cfs.read(reinterpret_cast<char*>(&new_ccd_speed), static_cast<std::streamsize>(sizeof(float)));
+  cfs.read(reinterpret_cast<char*>(&new_cfl), static_cast<std::streamsize>(sizeof(float)));
+  cfs.read(reinterpret_cast<char*>(&new_mutual_grav_constant), static_cast<std::streamsize>(sizeof(float)));
+  cfs.read(reinterpret_cast<char*>(&new_opening_angle), static_cast<std::streamsize>(sizeof(float)));
+  cfs.read(reinterpret_cast<char*>(&new_softening), static_cast<std::streamsize>(sizeof(float)));
+  cfs.read(reinterpret_cast<char*>(&new_loose_octree), static_cast<std::streamsize>(sizeof(bool)));
+  cfs.read(reinterpret_cast<char*>(new_boundary), static_cast<std::streamsize>(6 * sizeof(float)));
+
+  /*
+   * Every body takes at least its 18 floats
+   * and its ID, so a body count the rest of
+   * the file can't hold means the file is
+   * corrupt, and we mustn't size anything by
+   * it.
+   */
+  const std::streamoff body_data_start = cfs.tellg();
+  cfs.seekg(0, std::ios::end);
+  const std::streamoff file_end = cfs.tellg();
+  cfs.seekg(body_data_start);
+  if (!cfs || body_data_start < 0 || file_end < body_data_start || new_num_bodies >= NO_INDEX ||
+      new_num_bodies > static_cast<std::size_t>(file_end - body_data_start) / (18 * sizeof(float) + sizeof(unsigned int))) {
+    std::cerr << "ERROR: Checkpoint file " << file_name << " is truncated or corrupt." << std::endl;
+    return -1;
+  }
+
+  Vec3x<float, 32> new_pos, new_vel, new_force, new_ang_vel;
+  Vec4x<float, 32> new_ang_pos;
+  std::vector<float> new_mass(new_num_bodies), new_inv_inertia(new_num_bodies);
+  std::vector<unsigned int> new_ids(new_num_bodies);
+  std::vector<std::unique_ptr<Collider>> new_colliders;
+  new_colliders.reserve(new_num_bodies);
+  for (auto arr : {&new_pos.x, &new_pos.y, &new_pos.z, &new_vel.x, &new_vel.y, &new_vel.z, &new_force.x, &new_force.y, &new_force.z,
+		   &new_ang_pos.w, &new_ang_pos.x, &new_ang_pos.y, &new_ang_pos.z, &new_ang_vel.x, &new_ang_vel.y, &new_ang_vel.z}) {
+    arr->resize(new_num_bodies);
+    cfs.read(reinterpret_cast<char*>(arr->data()), static_cast<std::streamsize>(new_num_bodies * sizeof(float)));
+  }
+  cfs.read(reinterpret_cast<char*>(new_mass.data()), static_cast<std::streamsize>(new_num_bodies * sizeof(float)));
+  cfs.read(reinterpret_cast<char*>(new_inv_inertia.data()), static_cast<std::streamsize>(new_num_bodies * sizeof(float)));
+  std::size_t new_num_ids = 0;
+  cfs.read(reinterpret_cast<char*>(&new_num_ids), static_cast<std::streamsize>(sizeof(std::size_t)));
+  cfs.read(reinterpret_cast<char*>(new_ids.data()), static_cast<std::streamsize>(new_num_bodies * sizeof(unsigned int)));
+  for (std::size_t i = 0; i < new_num_bodies && cfs; ++i) {
+    new_colliders.push_back(deserialize_collider(cfs));
+    if (!new_colliders.back()) break;
+  }
+  if (!cfs || new_colliders.size() != new_num_bodies || (new_num_bodies && !new_colliders.back())) {
+    std::cerr << "ERROR: Checkpoint file " << file_name << " is truncated or corrupt." << std::endl;
+    return -1;
+  }
+
+  /*
+   * Every body must have its own ID. IDs
+   * without a body are free to be reused.
+   */
+  if (new_num_ids < new_num_bodies || new_num_ids >= NO_INDEX) {
+    std::cerr << "ERROR: Checkpoint file " << file_name << " has invalid body IDs." << std::endl;
+    return -1;
+  }
+  std::vector<unsigned int> new_index_of(new_num_ids, NO_INDEX), new_free_ids;
+  for (std::size_t i = 0; i < new_num_bodies; ++i) {
+    if (new_ids[i] >= new_num_ids || new_index_of[new_ids[i]] != NO_INDEX) {
+      std::cerr << "ERROR: Checkpoint file " << file_name << " has invalid body IDs." << std::endl;
+      return -1;
+    }
+    new_index_of[new_ids[i]] = static_cast<unsigned int>(i);
+  }
+  for (std::size_t id = new_num_ids; id-- > 0;) {
+    if (new_index_of[id] == NO_INDEX) new_free_ids.push_back(static_cast<unsigned int>(id));
+  }
+
+  num_bodies = new_num_bodies;
+  tick = new_tick;
+  checkpoint_interval = new_checkpoint_interval;
+  ticks_per_frame = new_ticks_per_frame;
+  max_ticks_per_frame = new_max_ticks_per_frame;
+  reorder_interval = new_reorder_interval;
+  speed = new_speed;
+  grav_constant = new_grav_constant;
+  elasticity = new_elasticity;
+  friction = new_friction;
+  ccd_speed = new_ccd_speed;
+  cfl = new_cfl;
+  min_radius_stale = true;
+  ++body_changes;
+  mutual_grav_constant = new_mutual_grav_constant;
+  opening_angle = new_opening_angle;
+  softening = new_softening;
+  loose_octree = new_loose_octree;
+  std::copy(new_boundary, new_boundary + 6, boundary);
+  pos = std::move(new_pos);
+  vel = std::move(new_vel);
+  force = std::move(new_force);
+  mass = std::move(new_mass);
+  ang_pos = std::move(new_ang_pos);
+  ang_vel = std::move(new_ang_vel);
+  inv_inertia = std::move(new_inv_inertia);
+  colliders = std::move(new_colliders);
+  ids = std::move(new_ids);
+  index_of = std::move(new_index_of);
+  free_ids = std::move(new_free_ids);
+  checkpoint_file = file_name;
+  return 0;
+}
+
+/*
+ * Automatically write a checkpoint every
+ * interval ticks. An interval of 0 disables
+ * automatic checkpoints.
+ */
+void Engine::set_checkpointing(const std::string& file_name, const std::size_t interval) {
+  checkpoint_file = file_name;
+  checkpoint_interval = interval;
+}
+
+/*
+ * The current state goes out right away, so
+ * readers have something to read before the
+ * first interval is up.
+ */
+int Engine::set_publishing(const std::string& name, const std::size_t interval) {
+  if (!interval) {
+    std::cerr << "ERROR: PUBLISH_INTERVAL must be at least 1." << std::endl;
+    return -1;
+  }
+  publisher = std::make_unique<SharedStatePublisher>();
+  if (publisher->open(name, num_bodies)) {
+    publisher.reset();
+    return -1;
+  }
+  publish_interval = interval;
+  return publish_state();
+}
+
+/*
+ * Stats start with the next counted tick.
+ */
+int Engine::set_stats(const std::string& file_name, const std::size_t interval) {
+  if (!interval) {
+    std::cerr << "ERROR: STATS_INTERVAL must be at least 1." << std::endl;
+    return -1;
+  }
+  stats_writer = std::make_unique<StatsWriter>();
+  if (stats_writer->open(file_name)) {
+    stats_writer.reset();
+    return -1;
+  }
+  stats_interval = interval;
+  return 0;
 }
 
-float Engine::load_tick_from_file() {
-  if (fs.peek() == EOF) return 0.0f;
-  fs.read(reinterpret_cast<char*>(pos.x.data()), static_cast<std::streamsize>(pos.x.size() * sizeof(float)));
-  fs.read(reinterpret_cast<char*>(pos.y.data()), static_cast<std::streamsize>(pos.y.size() * sizeof(float)));
-  fs.read(reinterpret_cast<char*>(pos.z.data()), static_cast<std::streamsize>(pos.z.size() * sizeof(float)));
-  fs.read(reinterpret_cast<char*>(ang_pos.data()), static_cast<std::streamsize>(pos.z.size() * sizeof(Quaternion)));
-  float dt;
-  fs.read(reinterpret_cast<char*>(&dt), static_cast<std::streamsize>(sizeof(float)));
-  return dt;
+const TickStats& Engine::get_tick_stats() const { return tick_stats; }
+
+int Engine::publish_state() {
+  const float *const arrays[NUM_SHARED_STATE_ARRAYS] = {pos.x.data(), pos.y.data(), pos.z.data(), vel.x.data(), vel.y.data(), vel.z.data(),
+							ang_pos.w.data(), ang_pos.x.data(), ang_pos.y.data(), ang_pos.z.data()};
+  publish_rows.clear();
+  publish_ids.clear();
+  for (std::size_t id = 0; id < index_of.size(); ++id) {
+    if (index_of[id] == NO_INDEX) continue;
+    publish_rows.push_back(index_of[id]);
+    publish_ids.push_back(static_cast<std::uint32_t>(id));
+  }
+  return publisher->publish(tick, num_bodies, arrays, publish_rows.data(), publish_ids.data());
+}
+
+/*
+ * Resize every body array. When the arrays
+ * need to grow past their capacity, we at
+ * least double it, so that a steady stream
+ * of additions and removals doesn't keep
+ * reallocating. Shrinking never reallocates.
+ */
+void Engine::resize_bodies(const std::size_t new_num_bodies) {
+  if (new_num_bodies > mass.capacity()) {
+    const std::size_t new_capacity = std::max(new_num_bodies, 2 * mass.capacity());
+    for (auto arr : {&pos.x, &pos.y, &pos.z, &vel.x, &vel.y, &vel.z, &force.x, &force.y, &force.z,
+		     &ang_pos.w, &ang_pos.x, &ang_pos.y, &ang_pos.z, &ang_vel.x, &ang_vel.y, &ang_vel.z}) arr->reserve(new_capacity);
+    mass.reserve(new_capacity);
+    inv_inertia.reserve(new_capacity);
+    colliders.reserve(new_capacity);
+    ids.reserve(new_capacity);
+  }
+  for (auto arr : {&pos.x, &pos.y, &pos.z, &vel.x, &vel.y, &vel.z, &force.x, &force.y, &force.z,
+		   &ang_pos.w, &ang_pos.x, &ang_pos.y, &ang_pos.z, &ang_vel.x, &ang_vel.y, &ang_vel.z}) arr->resize(new_num_bodies);
+  mass.resize(new_num_bodies);
+  inv_inertia.resize(new_num_bodies);
+  colliders.resize(new_num_bodies);
+  ids.resize(new_num_bodies);
+  num_bodies = new_num_bodies;
+  min_radius_stale = true;
+  ++body_changes;
+}
+
+/*
+ * Add a batch of bodies to the end of the
+ * body arrays. The IDs given to the new
+ * bodies are written to new_ids, in the
+ * same order as the bodies.
+ */
+int Engine::add_bodies(const std::vector<ConfigSphere>& bodies, std::vector<unsigned int>& new_ids) {
+  if (record || playback) {
+    std::cerr << "ERROR: Bodies can't be added while recording or playing back." << std::endl;
+    return -1;
+  }
+  if (num_bodies + bodies.size() >= NO_INDEX) {
+    std::cerr << "ERROR: Too many bodies." << std::endl;
+    return -1;
+  }
+
+  const std::size_t first = num_bodies;
+  resize_bodies(num_bodies + bodies.size());
+  new_ids.resize(bodies.size());
+  for (std::size_t i = 0; i < bodies.size(); ++i) {
+    unsigned int id;
+    if (free_ids.empty()) {
+      id = static_cast<unsigned int>(index_of.size());
+      index_of.push_back(NO_INDEX);
+    }
+    else {
+      id = free_ids.back();
+      free_ids.pop_back();
+    }
+    index_of[id] = static_cast<unsigned int>(first + i);
+    ids[first + i] = id;
+    new_ids[i] = id;
+  }
+
+#pragma omp parallel for
+  for (std::size_t i = 0; i < bodies.size(); ++i) {
+    set_sphere_at(first + i, bodies[i]);
+    force.x[first + i] = 0.0f;
+    force.y[first + i] = -grav_constant * bodies[i].m;
+    force.z[first + i] = 0.0f;
+  }
+  return 0;
+}
+
+int Engine::add_body_states(const std::vector<BodyState>& states, std::vector<unsigned int>& new_ids) {
+  std::vector<ConfigSphere> bodies(states.size());
+  for (std::size_t i = 0; i < states.size(); ++i) {
+    const BodyState& state = states[i];
+    bodies[i] = ConfigSphere{state.x, state.y, state.z, state.vx, state.vy, state.vz, state.m, state.r};
+  }
+  const std::size_t first = num_bodies;
+  if (add_bodies(bodies, new_ids)) return -1;
+  for (std::size_t i = 0; i < states.size(); ++i) {
+    const BodyState& state = states[i];
+    ang_pos.w[first + i] = state.qw;
+    ang_pos.x[first + i] = state.qx;
+    ang_pos.y[first + i] = state.qy;
+    ang_pos.z[first + i] = state.qz;
+    ang_vel.x[first + i] = state.wx;
+    ang_vel.y[first + i] = state.wy;
+    ang_vel.z[first + i] = state.wz;
+  }
+  return 0;
+}
+
+int Engine::get_body_states(const std::vector<unsigned int>& body_ids, std::vector<BodyState>& states) {
+  states.resize(body_ids.size());
+  for (std::size_t k = 0; k < body_ids.size(); ++k) {
+    const unsigned int id = body_ids[k];
+    if (id >= index_of.size() || index_of[id] == NO_INDEX) {
+      std::cerr << "ERROR: There is no body with ID " << id << "." << std::endl;
+      return -1;
+    }
+    const unsigned int i = index_of[id];
+    states[k] = BodyState{pos.x[i], pos.y[i], pos.z[i], vel.x[i], vel.y[i], vel.z[i],
+			  ang_pos.w[i], ang_pos.x[i], ang_pos.y[i], ang_pos.z[i], ang_vel.x[i], ang_vel.y[i], ang_vel.z[i],
+			  mass[i], get_radius_at(i)};
+  }
+  return 0;
+}
+
+/*
+ * Remove a batch of bodies by ID. Each
+ * removed body's slot is filled by the
+ * current last body, so the arrays stay
+ * dense. If any ID is unknown (or given
+ * twice), nothing is removed.
+ */
+int Engine::remove_bodies(const std::vector<unsigned int>& body_ids) {
+  if (record || playback) {
+    std::cerr << "ERROR: Bodies can't be removed while recording or playing back." << std::endl;
+    return -1;
+  }
+
+  std::vector<unsigned int> indices;
+  indices.reserve(body_ids.size());
+  for (unsigned int id : body_ids) {
+    if (id >= index_of.size() || index_of[id] == NO_INDEX) {
+      std::cerr << "ERROR: There is no body with ID " << id << "." << std::endl;
+      return -1;
+    }
+    indices.push_back(index_of[id]);
+  }
+  std::sort(indices.begin(), indices.end());
+  if (std::adjacent_find(indices.begin(), indices.end()) != indices.end()) {
+    std::cerr << "ERROR: Can't remove the same body twice." << std::endl;
+    return -1;
+  }
+
+  /*
+   * Going from the highest index down, the
+   * last body is never one still waiting to
+   * be removed.
+   */
+  std::size_t last = num_bodies;
+  for (auto it = indices.rbegin(); it != indices.rend(); ++it) {
+    const unsigned int i = *it;
+    --last;
+    free_ids.push_back(ids[i]);
+    index_of[ids[i]] = NO_INDEX;
+    if (i == last) continue;
+    for (auto arr : {&pos.x, &pos.y, &pos.z, &vel.x, &vel.y, &vel.z, &force.x, &force.y, &force.z,
+		     &ang_pos.w, &ang_pos.x, &ang_pos.y, &ang_pos.z, &ang_vel.x, &ang_vel.y, &ang_vel.z}) (*arr)[i] = (*arr)[last];
+    mass[i] = mass[last];
+    inv_inertia[i] = inv_inertia[last];
+    colliders[i] = std::move(colliders[last]);
+    ids[i] = ids[last];
+    index_of[ids[i]] = i;
+  }
+  resize_bodies(last);
+  return 0;
 }
@@ -12,6 +12,14 @@
 
 #include <physics/octree.h>
 
+#include <algorithm>
+#include <tuple>
+#include <utility>
+
+#include <immintrin.h>
+#include <math.h>
+#include <omp.h>
+
 __attribute__((always_inline))
 inline bool intersects(const AABB& aabb1, const AABB& aabb2) {
   return (aabb1.x1 <= aabb2.x2) & (aabb2.x1 <= aabb1.x2)
@@ -27,10 +35,10 @@ Octree::Octree(const AABB& aabb): root_bound(aabb), nodes(1) {}
  * body's ID is actually stored.
  */
 void Octree::insert(const unsigned int to_store, const AABB& aabb) {
-  insert(to_store, aabb, 0, root_bound);
+  insert(to_store, aabb, 0, root_bound, 0);
 }
 
-void Octree::insert(const unsigned int to_store, const AABB& aabb, const unsigned int root, const AABB& node_aabb) {
+void Octree::insert(const unsigned int to_store, const AABB& aabb, const unsigned int root, const AABB& node_aabb, const unsigned int depth) {
   /*
    * Only insert if body is in tree node.
    */
@@ -38,11 +46,14 @@ void Octree::insert(const unsigned int to_store, const AABB& aabb, const unsigne
 
   /*
    * Only insert in current node if there's
-   * space.
+   * space. Many bodies piled on top of each
+   * other would otherwise split nodes forever,
+   * so at the maximum depth the node's
+   * overflow chain takes the body instead.
    */
   auto& node = nodes[root];
-  if (node.num_stored < NODE_SIZE) {
-    node.bodies[node.num_stored++] = to_store;
+  if (node.num_stored < NODE_SIZE || depth == MAX_DEPTH) {
+    store(to_store, aabb, root);
     return;
   }
 
@@ -64,14 +75,54 @@ void Octree::insert(const unsigned int to_store, const AABB& aabb, const unsigne
    * Attempt to insert into all children that
    * we overlap.
    */
-  insert(to_store, aabb, first_child, get_sub_aabb<false, false, false>(node_aabb));
-  insert(to_store, aabb, first_child + 1, get_sub_aabb<true, false, false>(node_aabb));
-  insert(to_store, aabb, first_child + 2, get_sub_aabb<false, true, false>(node_aabb));
-  insert(to_store, aabb, first_child + 3, get_sub_aabb<true, true, false>(node_aabb));
-  insert(to_store, aabb, first_child + 4, get_sub_aabb<false, false, true>(node_aabb));
-  insert(to_store, aabb, first_child + 5, get_sub_aabb<true, false, true>(node_aabb));
-  insert(to_store, aabb, first_child + 6, get_sub_aabb<false, true, true>(node_aabb));
-  insert(to_store, aabb, first_child + 7, get_sub_aabb<true, true, true>(node_aabb));
+  insert(to_store, aabb, first_child, get_sub_aabb<false, false, false>(node_aabb), depth + 1);
+  insert(to_store, aabb, first_child + 1, get_sub_aabb<true, false, false>(node_aabb), depth + 1);
+  insert(to_store, aabb, first_child + 2, get_sub_aabb<false, true, false>(node_aabb), depth + 1);
+  insert(to_store, aabb, first_child + 3, get_sub_aabb<true, true, false>(node_aabb), depth + 1);
+  insert(to_store, aabb, first_child + 4, get_sub_aabb<false, false, true>(node_aabb), depth + 1);
+  insert(to_store, aabb, first_child + 5, get_sub_aabb<true, false, true>(node_aabb), depth + 1);
+  insert(to_store, aabb, first_child + 6, get_sub_aabb<false, true, true>(node_aabb), depth + 1);
+  insert(to_store, aabb, first_child + 7, get_sub_aabb<true, true, true>(node_aabb), depth + 1);
+}
+
+/*
+ * Store a body in a node, or in the first
+ * overflow node in its chain with room. We
+ * keep a copy of the body's AABB next to its
+ * ID, so queries can cull the bodies of a
+ * node without looking them up.
+ */
+void Octree::store(const unsigned int to_store, const AABB& aabb, unsigned int root) {
+  while (nodes[root].num_stored == NODE_SIZE) {
+    if (!nodes[root].next) {
+      const unsigned int next = static_cast<unsigned int>(nodes.size());
+      nodes[root].next = next;
+      nodes.emplace_back();
+    }
+    root = nodes[root].next;
+  }
+  auto& node = nodes[root];
+  const unsigned int slot = node.num_stored++;
+  node.bodies[slot] = to_store;
+  node.x1[slot] = aabb.x1;
+  node.x2[slot] = aabb.x2;
+  node.y1[slot] = aabb.y1;
+  node.y2[slot] = aabb.y2;
+  node.z1[slot] = aabb.z1;
+  node.z2[slot] = aabb.z2;
+}
+
+/*
+ * Test eight boxes, given as lanes of six
+ * registers, against a single box. Bit i of
+ * the result is set if box i intersects it.
+ */
+__attribute__((always_inline))
+inline unsigned int intersects8(const __m256 x1, const __m256 x2, const __m256 y1, const __m256 y2, const __m256 z1, const __m256 z2, const AABB& aabb) {
+  __m256 hit = _mm256_and_ps(_mm256_cmp_ps(x1, _mm256_set1_ps(aabb.x2), _CMP_LE_OQ), _mm256_cmp_ps(_mm256_set1_ps(aabb.x1), x2, _CMP_LE_OQ));
+  hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(y1, _mm256_set1_ps(aabb.y2), _CMP_LE_OQ), _mm256_cmp_ps(_mm256_set1_ps(aabb.y1), y2, _CMP_LE_OQ)));
+  hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(z1, _mm256_set1_ps(aabb.z2), _CMP_LE_OQ), _mm256_cmp_ps(_mm256_set1_ps(aabb.z1), z2, _CMP_LE_OQ)));
+  return static_cast<unsigned int>(_mm256_movemask_ps(hit));
 }
 
 /*
@@ -82,49 +133,598 @@ void Octree::insert(const unsigned int to_store, const AABB& aabb, const unsigne
  * to double count collisions (we only
  * return bodies whose ID is larger than
  * the one passed in).
+ *
+ * Traversal uses an explicit stack. At each
+ * node, the stored bodies are tested against
+ * the query eight at a time, and all eight
+ * children are culled at once, so only the
+ * children that overlap the query are ever
+ * pushed.
  */
-void Octree::possibilities(const unsigned int id, const AABB& aabb, std::unordered_set<unsigned int>& dest) {
-  possibilities(id, aabb, dest, 0, root_bound);
-}
+void Octree::possibilities(const unsigned int id, const AABB& aabb, std::unordered_set<unsigned int>& dest) const {
+  if (!intersects(aabb, root_bound)) return;
 
-void Octree::possibilities(const unsigned int id, const AABB& aabb, std::unordered_set<unsigned int>& dest, const unsigned int root, const AABB& node_aabb) {
   /*
-   * If we don't intersect the body's
-   * AABB, we know we're done.
+   * Every level pushes at most eight
+   * children, and depth is bounded, so the
+   * stack never needs to grow.
    */
-  if (!intersects(aabb, node_aabb)) return;
+  std::pair<unsigned int, AABB> stack[8 * MAX_DEPTH + 8];
+  std::size_t stack_size = 0;
+  stack[stack_size++] = {0, root_bound};
+
+  const __m256 upper_x = _mm256_castsi256_ps(_mm256_setr_epi32(0, -1, 0, -1, 0, -1, 0, -1));
+  const __m256 upper_y = _mm256_castsi256_ps(_mm256_setr_epi32(0, 0, -1, -1, 0, 0, -1, -1));
+  const __m256 upper_z = _mm256_castsi256_ps(_mm256_setr_epi32(0, 0, 0, 0, -1, -1, -1, -1));
+
+  while (stack_size) {
+    const auto [root, node_aabb] = stack[--stack_size];
+    const auto& node = nodes[root];
+
+    /*
+     * Add bodies from current node (and its
+     * overflow chain) whose AABBs overlap the
+     * query. We only allow collisions with
+     * bodies whose ID is larger than the query.
+     * This is an easy way to avoid double
+     * counting collisions.
+     */
+    for (unsigned int n = root;; n = nodes[n].next) {
+      const auto& stored = nodes[n];
+      for (unsigned int i = 0; i < stored.num_stored; i += 8) {
+	unsigned int hits = intersects8(_mm256_load_ps(stored.x1 + i), _mm256_load_ps(stored.x2 + i),
+					_mm256_load_ps(stored.y1 + i), _mm256_load_ps(stored.y2 + i),
+					_mm256_load_ps(stored.z1 + i), _mm256_load_ps(stored.z2 + i), aabb);
+	if (stored.num_stored - i < 8) hits &= (1u << (stored.num_stored - i)) - 1;
+	while (hits) {
+	  auto body = stored.bodies[i + static_cast<unsigned int>(__builtin_ctz(hits))];
+	  if (id < body) dest.insert(body);
+	  hits &= hits - 1;
+	}
+      }
+      if (!stored.next) break;
+    }
+
+    /*
+     * If we have children, build all eight
+     * child boxes side by side and only visit
+     * those that overlap the query.
+     */
+    const unsigned int first_child = node.first_child;
+    if (first_child) {
+      const __m256 lo_x = _mm256_set1_ps(node_aabb.x1), hi_x = _mm256_set1_ps(node_aabb.x2);
+      const __m256 lo_y = _mm256_set1_ps(node_aabb.y1), hi_y = _mm256_set1_ps(node_aabb.y2);
+      const __m256 lo_z = _mm256_set1_ps(node_aabb.z1), hi_z = _mm256_set1_ps(node_aabb.z2);
+      const __m256 half = _mm256_set1_ps(0.5f);
+      const __m256 mid_x = _mm256_mul_ps(half, _mm256_add_ps(lo_x, hi_x));
+      const __m256 mid_y = _mm256_mul_ps(half, _mm256_add_ps(lo_y, hi_y));
+      const __m256 mid_z = _mm256_mul_ps(half, _mm256_add_ps(lo_z, hi_z));
+
+      alignas(32) float cx1[8], cx2[8], cy1[8], cy2[8], cz1[8], cz2[8];
+      const __m256 c_x1 = _mm256_blendv_ps(lo_x, mid_x, upper_x), c_x2 = _mm256_blendv_ps(mid_x, hi_x, upper_x);
+      const __m256 c_y1 = _mm256_blendv_ps(lo_y, mid_y, upper_y), c_y2 = _mm256_blendv_ps(mid_y, hi_y, upper_y);
+      const __m256 c_z1 = _mm256_blendv_ps(lo_z, mid_z, upper_z), c_z2 = _mm256_blendv_ps(mid_z, hi_z, upper_z);
+      unsigned int hits = intersects8(c_x1, c_x2, c_y1, c_y2, c_z1, c_z2, aabb);
+      _mm256_store_ps(cx1, c_x1);
+      _mm256_store_ps(cx2, c_x2);
+      _mm256_store_ps(cy1, c_y1);
+      _mm256_store_ps(cy2, c_y2);
+      _mm256_store_ps(cz1, c_z1);
+      _mm256_store_ps(cz2, c_z2);
+      while (hits) {
+	const unsigned int c = static_cast<unsigned int>(__builtin_ctz(hits));
+	stack[stack_size++] = {first_child + c, AABB{cx1[c], cx2[c], cy1[c], cy2[c], cz1[c], cz2[c]}};
+	hits &= hits - 1;
+      }
+    }
+  }
+}
+
+/*
+ * Get the i-th child AABB of a node, in the
+ * same order children are stored in.
+ */
+__attribute__((always_inline))
+inline AABB get_sub_aabb(const AABB& aabb, const unsigned int i) {
+  const float mid_x = 0.5f * (aabb.x1 + aabb.x2);
+  const float mid_y = 0.5f * (aabb.y1 + aabb.y2);
+  const float mid_z = 0.5f * (aabb.z1 + aabb.z2);
+  return {
+    i & 1 ? mid_x : aabb.x1, i & 1 ? aabb.x2 : mid_x,
+    i & 2 ? mid_y : aabb.y1, i & 2 ? aabb.y2 : mid_y,
+    i & 4 ? mid_z : aabb.z1, i & 4 ? aabb.z2 : mid_z
+  };
+}
 
+/*
+ * A body is copied into every node its AABB
+ * touches, so an overlapping pair may meet in
+ * several places in the tree. We only report
+ * a pair from the one node whose octant holds
+ * the lower corner of the two AABBs' overlap.
+ * Octants are treated as half open (a point
+ * on a split plane belongs to the upper
+ * child), except on the root's upper faces,
+ * and corners outside the root are clamped
+ * onto it. Both bodies of the pair are stored
+ * on the path from the root down to that
+ * corner, so this picks exactly one place.
+ */
+__attribute__((always_inline))
+inline bool owns_pair(const AABB& node_aabb, const AABB& root_bound, const AABB& aabb1, const AABB& aabb2) {
+  const float cx = std::min(std::max(std::max(aabb1.x1, aabb2.x1), root_bound.x1), root_bound.x2);
+  const float cy = std::min(std::max(std::max(aabb1.y1, aabb2.y1), root_bound.y1), root_bound.y2);
+  const float cz = std::min(std::max(std::max(aabb1.z1, aabb2.z1), root_bound.z1), root_bound.z2);
+  return (node_aabb.x1 <= cx) & ((cx < node_aabb.x2) | (node_aabb.x2 == root_bound.x2))
+    & (node_aabb.y1 <= cy) & ((cy < node_aabb.y2) | (node_aabb.y2 == root_bound.y2))
+    & (node_aabb.z1 <= cz) & ((cz < node_aabb.z2) | (node_aabb.z2 == root_bound.z2));
+}
+
+static constexpr std::size_t PAIR_HEADS_PER_TASK = 16;
+
+/*
+ * Enumerate every pair of bodies whose AABBs
+ * overlap, each exactly once and with the
+ * smaller ID first. Rather than querying the
+ * tree once per body, we pair up nodes: the
+ * bodies of a node are tested against each
+ * other, and against the bodies of every node
+ * below it whose octant overlaps them. Bodies
+ * in sibling subtrees never need to be
+ * tested, as an overlap's lower corner can
+ * only lie in one of them. Each node's work
+ * is independent, so nodes are processed in
+ * parallel, which splits the large subtrees
+ * near the root into many tasks.
+ */
+std::vector<std::pair<unsigned int, unsigned int>> Octree::pairs() const {
   /*
-   * Add bodies from current node to
-   * the vector of possible collisions.
-   * We only allow collisions with bodies
-   * whose ID is larger than the query.
-   * This is an easy way to avoid double
-   * counting collisions.
+   * Octants aren't stored in nodes, so we
+   * compute them for every node (but not for
+   * overflow nodes, which are never anyone's
+   * child) in a breadth first pass.
    */
-  auto& node = nodes[root];
-  for (unsigned int i = 0; i < node.num_stored; ++i) {
-    auto body = node.bodies[i];
-    if (id < body) dest.insert(body);
+  std::vector<AABB> node_aabbs(nodes.size());
+  std::vector<unsigned int> heads{0};
+  node_aabbs[0] = root_bound;
+  for (std::size_t k = 0; k < heads.size(); ++k) {
+    const unsigned int first_child = nodes[heads[k]].first_child;
+    if (!first_child) continue;
+    for (unsigned int c = 0; c < 8; ++c) {
+      node_aabbs[first_child + c] = get_sub_aabb(node_aabbs[heads[k]], c);
+      heads.push_back(first_child + c);
+    }
   }
 
   /*
-   * If we have children, we must query
-   * them too.
+   * Threads take PAIR_HEADS_PER_TASK heads at
+   * a time, and each such run of heads keeps
+   * its own pairs, so joining them by run
+   * gives the same order however the runs
+   * were spread across threads.
    */
-  unsigned int first_child = node.first_child;
-  if (first_child) {
-    possibilities(id, aabb, dest, first_child, get_sub_aabb<false, false, false>(node_aabb));
-    possibilities(id, aabb, dest, first_child + 1, get_sub_aabb<true, false, false>(node_aabb));
-    possibilities(id, aabb, dest, first_child + 2, get_sub_aabb<false, true, false>(node_aabb));
-    possibilities(id, aabb, dest, first_child + 3, get_sub_aabb<true, true, false>(node_aabb));
-    possibilities(id, aabb, dest, first_child + 4, get_sub_aabb<false, false, true>(node_aabb));
-    possibilities(id, aabb, dest, first_child + 5, get_sub_aabb<true, false, true>(node_aabb));
-    possibilities(id, aabb, dest, first_child + 6, get_sub_aabb<false, true, true>(node_aabb));
-    possibilities(id, aabb, dest, first_child + 7, get_sub_aabb<true, true, true>(node_aabb));
+  std::vector<std::vector<std::pair<unsigned int, unsigned int>>> found((heads.size() + PAIR_HEADS_PER_TASK - 1) / PAIR_HEADS_PER_TASK);
+#pragma omp parallel for schedule(dynamic, PAIR_HEADS_PER_TASK)
+  for (std::size_t k = 0; k < heads.size(); ++k) {
+    auto& dest = found[k / PAIR_HEADS_PER_TASK];
+    const unsigned int head = heads[k];
+    if (!nodes[head].num_stored) continue;
+
+    /*
+     * Test the body in slot i of node n against
+     * the bodies from slot from onwards of node
+     * m, which lies in the octant m_aabb.
+     */
+    auto test = [&](const Node& n, const unsigned int i, const Node& m, const unsigned int from, const AABB& m_aabb) {
+      const AABB aabb{n.x1[i], n.x2[i], n.y1[i], n.y2[i], n.z1[i], n.z2[i]};
+      for (unsigned int j = from & ~7u; j < m.num_stored; j += 8) {
+	unsigned int hits = intersects8(_mm256_load_ps(m.x1 + j), _mm256_load_ps(m.x2 + j),
+					_mm256_load_ps(m.y1 + j), _mm256_load_ps(m.y2 + j),
+					_mm256_load_ps(m.z1 + j), _mm256_load_ps(m.z2 + j), aabb);
+	if (m.num_stored - j < 8) hits &= (1u << (m.num_stored - j)) - 1;
+	if (from > j) hits &= ~((1u << (from - j)) - 1);
+	while (hits) {
+	  const unsigned int slot = j + static_cast<unsigned int>(__builtin_ctz(hits));
+	  const AABB other{m.x1[slot], m.x2[slot], m.y1[slot], m.y2[slot], m.z1[slot], m.z2[slot]};
+	  if (owns_pair(m_aabb, root_bound, aabb, other)) {
+	    dest.emplace_back(std::min(n.bodies[i], m.bodies[slot]), std::max(n.bodies[i], m.bodies[slot]));
+	  }
+	  hits &= hits - 1;
+	}
+      }
+    };
+
+    /*
+     * Pairs within the node and its overflow
+     * chain. While we're at it, we find the
+     * bounds of the node's bodies, clipped to
+     * the node's octant, as any overlap we
+     * report further down lies inside them.
+     */
+    AABB bound{INFINITY, -INFINITY, INFINITY, -INFINITY, INFINITY, -INFINITY};
+    for (unsigned int n = head;; n = nodes[n].next) {
+      const auto& node = nodes[n];
+      for (unsigned int i = 0; i < node.num_stored; ++i) {
+	test(node, i, node, i + 1, node_aabbs[head]);
+	for (unsigned int m = node.next; m; m = nodes[m].next) test(node, i, nodes[m], 0, node_aabbs[head]);
+	bound = AABB{std::min(bound.x1, node.x1[i]), std::max(bound.x2, node.x2[i]),
+		     std::min(bound.y1, node.y1[i]), std::max(bound.y2, node.y2[i]),
+		     std::min(bound.z1, node.z1[i]), std::max(bound.z2, node.z2[i])};
+      }
+      if (!node.next) break;
+    }
+    const AABB& head_aabb = node_aabbs[head];
+    bound = AABB{std::max(bound.x1, head_aabb.x1), std::min(bound.x2, head_aabb.x2),
+		 std::max(bound.y1, head_aabb.y1), std::min(bound.y2, head_aabb.y2),
+		 std::max(bound.z1, head_aabb.z1), std::min(bound.z2, head_aabb.z2)};
+
+    /*
+     * Pairs between the node and the nodes
+     * below it.
+     */
+    unsigned int stack[8 * MAX_DEPTH + 8];
+    std::size_t stack_size = 0;
+    const unsigned int first_child = nodes[head].first_child;
+    if (first_child) {
+      for (unsigned int c = 0; c < 8; ++c) stack[stack_size++] = first_child + c;
+    }
+    while (stack_size) {
+      const unsigned int below = stack[--stack_size];
+      const AABB& below_aabb = node_aabbs[below];
+      if (!intersects(bound, below_aabb)) continue;
+      for (unsigned int m = below; m; m = nodes[m].next) {
+	for (unsigned int n = head;; n = nodes[n].next) {
+	  for (unsigned int i = 0; i < nodes[n].num_stored; ++i) test(nodes[n], i, nodes[m], 0, below_aabb);
+	  if (!nodes[n].next) break;
+	}
+      }
+      if (nodes[below].first_child) {
+	for (unsigned int c = 0; c < 8; ++c) stack[stack_size++] = nodes[below].first_child + c;
+      }
+    }
   }
+
+  std::vector<std::pair<unsigned int, unsigned int>> result;
+  for (const auto& run_found : found) result.insert(result.end(), run_found.begin(), run_found.end());
+  return result;
+}
+
+/*
+ * Insert a body as a point. Unlike insert,
+ * a full node passes the body down to the
+ * single child whose octant contains the
+ * point (points on a split plane go to the
+ * upper child), so that no body is counted
+ * twice when aggregating mass. Points
+ * outside the root bound still end up in
+ * the tree, in the nearest octant.
+ */
+void Octree::insert_point(const unsigned int to_store, const float x, const float y, const float z) {
+  unsigned int root = 0;
+  AABB node_aabb = root_bound;
+  for (unsigned int depth = 0;; ++depth) {
+    auto& node = nodes[root];
+    if (node.num_stored < NODE_SIZE) {
+      node.bodies[node.num_stored++] = to_store;
+      return;
+    }
+    if (depth == MAX_DEPTH) {
+      overflow.emplace_back(root, to_store);
+      return;
+    }
+
+    unsigned int first_child = node.first_child;
+    if (!node.first_child) {
+      first_child = static_cast<unsigned int>(nodes.size());
+      node.first_child = first_child;
+      for (unsigned int i = 0; i < 8; ++i) nodes.emplace_back(); // Reference node is invalid after this point
+    }
+
+    const float mid_x = 0.5f * (node_aabb.x1 + node_aabb.x2);
+    const float mid_y = 0.5f * (node_aabb.y1 + node_aabb.y2);
+    const float mid_z = 0.5f * (node_aabb.z1 + node_aabb.z2);
+    const bool upper_x = x >= mid_x, upper_y = y >= mid_y, upper_z = z >= mid_z;
+    root = first_child + static_cast<unsigned int>(upper_x) + 2 * static_cast<unsigned int>(upper_y) + 4 * static_cast<unsigned int>(upper_z);
+    node_aabb = AABB{
+      upper_x ? mid_x : node_aabb.x1, upper_x ? node_aabb.x2 : mid_x,
+      upper_y ? mid_y : node_aabb.y1, upper_y ? node_aabb.y2 : mid_y,
+      upper_z ? mid_z : node_aabb.z1, upper_z ? node_aabb.z2 : mid_z
+    };
+  }
+}
+
+/*
+ * Children are always created after their
+ * parent, so they sit at larger indices in
+ * the node vector. Walking the vector
+ * backwards therefore visits every child
+ * before its parent, and we can aggregate
+ * the whole tree in a single pass.
+ */
+void Octree::compute_mass_aggregates(const float *const mass, const float *const x, const float *const y, const float *const z) {
+  node_mass.resize(nodes.size());
+  node_com_x.resize(nodes.size());
+  node_com_y.resize(nodes.size());
+  node_com_z.resize(nodes.size());
+  std::fill(node_mass.begin(), node_mass.end(), 0.0f);
+  std::fill(node_com_x.begin(), node_com_x.end(), 0.0f);
+  std::fill(node_com_y.begin(), node_com_y.end(), 0.0f);
+  std::fill(node_com_z.begin(), node_com_z.end(), 0.0f);
+  for (auto [n, body] : overflow) {
+    node_mass[n] += mass[body];
+    node_com_x[n] += mass[body] * x[body];
+    node_com_y[n] += mass[body] * y[body];
+    node_com_z[n] += mass[body] * z[body];
+  }
+  for (std::size_t n = nodes.size(); n-- > 0;) {
+    const auto& node = nodes[n];
+    float m = node_mass[n], mx = node_com_x[n], my = node_com_y[n], mz = node_com_z[n];
+    for (unsigned int i = 0; i < node.num_stored; ++i) {
+      const unsigned int body = node.bodies[i];
+      m += mass[body];
+      mx += mass[body] * x[body];
+      my += mass[body] * y[body];
+      mz += mass[body] * z[body];
+    }
+    if (node.first_child) {
+      for (unsigned int c = node.first_child; c < node.first_child + 8; ++c) {
+	m += node_mass[c];
+	mx += node_mass[c] * node_com_x[c];
+	my += node_mass[c] * node_com_y[c];
+	mz += node_mass[c] * node_com_z[c];
+      }
+    }
+    const float inv_m = m > 0.0f ? 1.0f / m : 0.0f;
+    node_mass[n] = m;
+    node_com_x[n] = mx * inv_m;
+    node_com_y[n] = my * inv_m;
+    node_com_z[n] = mz * inv_m;
+  }
+}
+
+/*
+ * Accumulate the gravitational acceleration
+ * (without the gravitational constant) that
+ * the bodies in the tree exert on a body at
+ * (x, y, z). A subtree whose size over
+ * distance is below the opening angle acts
+ * as a single point mass. Otherwise, we sum
+ * the pull of the node's own bodies exactly
+ * and descend into its children. Nodes at
+ * the maximum depth are never opened, as
+ * their bodies are practically on top of each
+ * other. We traverse with an explicit stack,
+ * as the traversal runs once per body every
+ * tick.
+ */
+void Octree::gravity(const unsigned int id, const float x, const float y, const float z, const float opening_angle, const float softening,
+		     const float *const mass, const float *const bx, const float *const by, const float *const bz, float& ax, float& ay, float& az) const {
+  const float opening_angle2 = opening_angle * opening_angle;
+  const float softening2 = softening * softening;
+  const float root_size = std::max(root_bound.x2 - root_bound.x1, std::max(root_bound.y2 - root_bound.y1, root_bound.z2 - root_bound.z1));
+
+  std::tuple<unsigned int, unsigned int, float> stack[8 * MAX_DEPTH + 8];
+  unsigned int stack_size = 0;
+  stack[stack_size++] = {0, 0, root_size};
+  float sum_x = 0.0f, sum_y = 0.0f, sum_z = 0.0f;
+  while (stack_size) {
+    const auto [root, depth, size] = stack[--stack_size];
+    if (node_mass[root] <= 0.0f) continue;
+
+    float dx = node_com_x[root] - x;
+    float dy = node_com_y[root] - y;
+    float dz = node_com_z[root] - z;
+    float dist2 = dx * dx + dy * dy + dz * dz + softening2;
+    if (size * size < opening_angle2 * dist2 || depth == MAX_DEPTH) {
+      const float inv_dist = 1.0f / sqrtf(dist2);
+      const float factor = node_mass[root] * inv_dist * inv_dist * inv_dist;
+      sum_x += dx * factor;
+      sum_y += dy * factor;
+      sum_z += dz * factor;
+      continue;
+    }
+
+    const auto& node = nodes[root];
+#pragma omp simd reduction(+:sum_x, sum_y, sum_z)
+    for (unsigned int i = 0; i < node.num_stored; ++i) {
+      const unsigned int body = node.bodies[i];
+      const float bdx = bx[body] - x;
+      const float bdy = by[body] - y;
+      const float bdz = bz[body] - z;
+      const float bdist2 = bdx * bdx + bdy * bdy + bdz * bdz + softening2;
+      const float inv_dist = 1.0f / sqrtf(bdist2);
+      const float factor = body == id ? 0.0f : mass[body] * inv_dist * inv_dist * inv_dist;
+      sum_x += bdx * factor;
+      sum_y += bdy * factor;
+      sum_z += bdz * factor;
+    }
+
+    if (node.first_child) {
+      for (unsigned int c = node.first_child; c < node.first_child + 8; ++c) {
+	stack[stack_size++] = {c, depth + 1, 0.5f * size};
+      }
+    }
+  }
+  ax += sum_x;
+  ay += sum_y;
+  az += sum_z;
+}
+
+/*
+ * Walk a tree from its root, counting
+ * bodies in leaves. Both trees chain
+ * overflow nodes the same way, so this
+ * works for either one's nodes.
+ */
+template <typename Nodes>
+static OctreeShape tree_shape(const Nodes& nodes) {
+  OctreeShape shape{nodes.size(), 0, 0, 0, 0};
+  std::pair<unsigned int, unsigned int> stack[8 * MAX_DEPTH + 8];
+  std::size_t stack_size = 0;
+  stack[stack_size++] = {0, 0};
+  while (stack_size) {
+    const auto [root, depth] = stack[--stack_size];
+    shape.max_depth = std::max(shape.max_depth, static_cast<std::size_t>(depth));
+    const unsigned int first_child = nodes[root].first_child;
+    if (first_child) {
+      for (unsigned int c = 0; c < 8; ++c) stack[stack_size++] = {first_child + c, depth + 1};
+      continue;
+    }
+    std::size_t stored = 0;
+    for (unsigned int n = root;; n = nodes[n].next) {
+      stored += nodes[n].num_stored;
+      if (!nodes[n].next) break;
+    }
+    ++shape.leaves;
+    shape.leaf_bodies += stored;
+    shape.max_leaf_bodies = std::max(shape.max_leaf_bodies, stored);
+  }
+  return shape;
+}
+
+std::size_t Octree::num_nodes() const {
+  return nodes.size();
+}
+
+OctreeShape Octree::shape() const {
+  return tree_shape(nodes);
 }
 
 bool Octree::Node::is_leaf() {
   return !first_child;
 }
+
+__attribute__((always_inline))
+inline bool contains(const AABB& outer, const AABB& inner) {
+  return (outer.x1 <= inner.x1) & (inner.x2 <= outer.x2)
+    & (outer.y1 <= inner.y1) & (inner.y2 <= outer.y2)
+    & (outer.z1 <= inner.z1) & (inner.z2 <= outer.z2);
+}
+
+/*
+ * Loose bounds of a node are its octant,
+ * grown by half the octant's size on every
+ * side.
+ */
+__attribute__((always_inline))
+inline AABB loosen(const AABB& aabb) {
+  const float hx = 0.5f * (aabb.x2 - aabb.x1);
+  const float hy = 0.5f * (aabb.y2 - aabb.y1);
+  const float hz = 0.5f * (aabb.z2 - aabb.z1);
+  return {aabb.x1 - hx, aabb.x2 + hx, aabb.y1 - hy, aabb.y2 + hy, aabb.z1 - hz, aabb.z2 + hz};
+}
+
+LooseOctree::LooseOctree(const AABB& aabb): root_bound(aabb), nodes(1) {}
+
+/*
+ * Insert a body into the loose octree. We
+ * walk down from the root, filling the first
+ * node on the way that has room. A full node
+ * passes the body to the child whose octant
+ * holds the body's center, as long as the
+ * child's loose bounds contain the whole
+ * body - otherwise the body stays with the
+ * full node, in its overflow chain.
+ */
+void LooseOctree::insert(const unsigned int to_store, const AABB& aabb) {
+  const float cx = 0.5f * (aabb.x1 + aabb.x2);
+  const float cy = 0.5f * (aabb.y1 + aabb.y2);
+  const float cz = 0.5f * (aabb.z1 + aabb.z2);
+  unsigned int root = 0;
+  AABB node_aabb = root_bound;
+  for (unsigned int depth = 0;; ++depth) {
+    if (nodes[root].num_stored < NODE_SIZE || depth == MAX_DEPTH) break;
+
+    const float mid_x = 0.5f * (node_aabb.x1 + node_aabb.x2);
+    const float mid_y = 0.5f * (node_aabb.y1 + node_aabb.y2);
+    const float mid_z = 0.5f * (node_aabb.z1 + node_aabb.z2);
+    const bool upper_x = cx >= mid_x, upper_y = cy >= mid_y, upper_z = cz >= mid_z;
+    const AABB child_aabb{
+      upper_x ? mid_x : node_aabb.x1, upper_x ? node_aabb.x2 : mid_x,
+      upper_y ? mid_y : node_aabb.y1, upper_y ? node_aabb.y2 : mid_y,
+      upper_z ? mid_z : node_aabb.z1, upper_z ? node_aabb.z2 : mid_z
+    };
+    if (!contains(loosen(child_aabb), aabb)) break;
+
+    /*
+     * When we add nodes to the tree's vector,
+     * we potentially invalidate node references,
+     * so we only index into the vector here.
+     */
+    if (!nodes[root].first_child) {
+      const unsigned int first_child = static_cast<unsigned int>(nodes.size());
+      nodes[root].first_child = first_child;
+      for (unsigned int i = 0; i < 8; ++i) nodes.emplace_back();
+    }
+    root = nodes[root].first_child + static_cast<unsigned int>(upper_x) + 2 * static_cast<unsigned int>(upper_y) + 4 * static_cast<unsigned int>(upper_z);
+    node_aabb = child_aabb;
+  }
+  store(to_store, root);
+}
+
+/*
+ * Store a body in a node, or in the first
+ * overflow node in its chain with room,
+ * extending the chain if every node in it is
+ * full.
+ */
+void LooseOctree::store(const unsigned int to_store, unsigned int root) {
+  while (nodes[root].num_stored == NODE_SIZE) {
+    if (!nodes[root].next) {
+      const unsigned int next = static_cast<unsigned int>(nodes.size());
+      nodes[root].next = next;
+      nodes.emplace_back();
+    }
+    root = nodes[root].next;
+  }
+  auto& node = nodes[root];
+  node.bodies[node.num_stored++] = to_store;
+}
+
+/*
+ * Query for possible collisions between an
+ * input AABB and AABBs inserted into the
+ * tree. As in the regular octree, we only
+ * return bodies whose ID is larger than the
+ * query's. The root's loose bounds are
+ * unbounded, since bodies that left the root
+ * octant are stored at the root.
+ */
+void LooseOctree::possibilities(const unsigned int id, const AABB& aabb, std::vector<unsigned int>& dest) const {
+  std::pair<unsigned int, AABB> stack[8 * MAX_DEPTH + 8];
+  unsigned int stack_size = 0;
+  stack[stack_size++] = {0, root_bound};
+  while (stack_size) {
+    const auto [root, node_aabb] = stack[--stack_size];
+    if (root && !intersects(aabb, loosen(node_aabb))) continue;
+
+    for (unsigned int chain = root; ; chain = nodes[chain].next) {
+      const auto& node = nodes[chain];
+      for (unsigned int i = 0; i < node.num_stored; ++i) {
+	const auto body = node.bodies[i];
+	if (id < body) dest.push_back(body);
+      }
+      if (!node.next) break;
+    }
+
+    const unsigned int first_child = nodes[root].first_child;
+    if (first_child) {
+      stack[stack_size++] = {first_child, get_sub_aabb<false, false, false>(node_aabb)};
+      stack[stack_size++] = {first_child + 1, get_sub_aabb<true, false, false>(node_aabb)};
+      stack[stack_size++] = {first_child + 2, get_sub_aabb<false, true, false>(node_aabb)};
+      stack[stack_size++] = {first_child + 3, get_sub_aabb<true, true, false>(node_aabb)};
+      stack[stack_size++] = {first_child + 4, get_sub_aabb<false, false, true>(node_aabb)};
+      stack[stack_size++] = {first_child + 5, get_sub_aabb<true, false, true>(node_aabb)};
+      stack[stack_size++] = {first_child + 6, get_sub_aabb<false, true, true>(node_aabb)};
+      stack[stack_size++] = {first_child + 7, get_sub_aabb<true, true, true>(node_aabb)};
+    }
+  }
+}
+
+std::size_t LooseOctree::num_nodes() const {
+  return nodes.size();
+}
+
+OctreeShape LooseOctree::shape() const {
+  return tree_shape(nodes);
+}
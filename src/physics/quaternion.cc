@@ -27,6 +27,32 @@ float Quaternion::invSquareRoot(const float n) const {
   return 1.0f / sqrt(n);
 }
 
+/*
+ * Spherical linear interpolation between two
+ * unit quaternions, along the shorter arc (q
+ * and -q are the same rotation). When the two
+ * are nearly parallel, the slerp weights are
+ * ill conditioned, so we fall back to linear
+ * interpolation and normalize.
+ */
+Quaternion Quaternion::slerp(const Quaternion& a, Quaternion b, const float t) {
+  float cos_theta = a.w*b.w + a.x*b.x + a.y*b.y + a.z*b.z; 
+  if (cos_theta < 0.0f) {
+    b = Quaternion{-b.w, -b.x, -b.y, -b.z}; 
+    cos_theta = -cos_theta; 
+  }
+  float wa = 1.0f - t, wb = t; 
+  if (cos_theta < 0.9995f) {
+    const float theta = acosf(cos_theta); 
+    const float inv_sin_theta = 1.0f / sinf(theta); 
+    wa = sinf(wa * theta) * inv_sin_theta; 
+    wb = sinf(wb * theta) * inv_sin_theta; 
+  }
+  Quaternion q{wa*a.w + wb*b.w, wa*a.x + wb*b.x, wa*a.y + wb*b.y, wa*a.z + wb*b.z}; 
+  q.normalize(); 
+  return q; 
+}
+
 /*
  * Convert between quaternions and rotation matrix.
  */
@@ -0,0 +1,216 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#include <physics/shared_state.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Capacities are rounded up to whole cache
+ * lines of floats, so every array starts on a
+ * cache line.
+ */
+static constexpr std::size_t SHARED_STATE_ALIGN_FLOATS = 64 / sizeof(float);
+
+static std::size_t slot_size_for(const std::size_t capacity) {
+  return sizeof(SharedStateSlot) + NUM_SHARED_STATE_ARRAYS * capacity * sizeof(float) + capacity * sizeof(std::uint32_t);
+}
+
+SharedStatePublisher::SharedStatePublisher(): mapping(nullptr), mapping_size(0), published(0) {}
+
+SharedStatePublisher::~SharedStatePublisher() { close(); }
+
+void SharedStatePublisher::close() {
+  if (!mapping) return;
+  munmap(mapping, mapping_size);
+  shm_unlink(name.c_str());
+  mapping = nullptr;
+}
+
+/*
+ * Always start from a fresh object, so that
+ * readers still mapping an old one (e.g. from a
+ * previous run) never see it change under them.
+ * The magic goes in last, so readers never
+ * accept a half written header.
+ */
+int SharedStatePublisher::open(const std::string& name_i, const std::size_t capacity) {
+  close();
+  name = name_i;
+  const std::size_t rounded = std::max((capacity + SHARED_STATE_ALIGN_FLOATS - 1) / SHARED_STATE_ALIGN_FLOATS, std::size_t(1)) * SHARED_STATE_ALIGN_FLOATS;
+  const std::size_t slot_size = slot_size_for(rounded);
+  const std::size_t size = sizeof(SharedStateHeader) + SHARED_STATE_SLOTS * slot_size;
+
+  shm_unlink(name.c_str());
+  const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) {
+    std::cerr << "ERROR: Couldn't create shared memory " << name << "." << std::endl;
+    return -1;
+  }
+  if (ftruncate(fd, static_cast<off_t>(size))) {
+    std::cerr << "ERROR: Couldn't size shared memory " << name << "." << std::endl;
+    ::close(fd);
+    shm_unlink(name.c_str());
+    return -1;
+  }
+  void *new_mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (new_mapping == MAP_FAILED) {
+    std::cerr << "ERROR: Couldn't map shared memory " << name << "." << std::endl;
+    shm_unlink(name.c_str());
+    return -1;
+  }
+  mapping = new_mapping;
+  mapping_size = size;
+  published = 0;
+
+  char *bytes = static_cast<char*>(mapping);
+  SharedStateHeader *header = new (bytes) SharedStateHeader{};
+  header->version = SHARED_STATE_VERSION;
+  header->num_slots = SHARED_STATE_SLOTS;
+  header->capacity = rounded;
+  header->slot_size = slot_size;
+  for (std::size_t s = 0; s < SHARED_STATE_SLOTS; ++s) new (bytes + sizeof(SharedStateHeader) + s * slot_size) SharedStateSlot{};
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(header->magic, SHARED_STATE_MAGIC, sizeof(SHARED_STATE_MAGIC));
+  return 0;
+}
+
+/*
+ * Fill the next slot of the ring, gathering
+ * the rows straight into it. A world that has
+ * outgrown the object moves to one twice its
+ * size.
+ */
+int SharedStatePublisher::publish(const std::uint64_t tick, const std::size_t num_bodies, const float *const arrays[NUM_SHARED_STATE_ARRAYS],
+				  const std::uint32_t *rows, const std::uint32_t *ids) {
+  if (!mapping) return -1;
+  SharedStateHeader *header = static_cast<SharedStateHeader*>(mapping);
+  if (num_bodies > header->capacity) {
+    header->retired.store(1, std::memory_order_release);
+    if (open(name, 2 * num_bodies)) return -1;
+    header = static_cast<SharedStateHeader*>(mapping);
+  }
+
+  const std::uint64_t sequence = published + 1;
+  char *bytes = static_cast<char*>(mapping) + sizeof(SharedStateHeader) + (sequence % header->num_slots) * header->slot_size;
+  SharedStateSlot *slot = reinterpret_cast<SharedStateSlot*>(bytes);
+  float *data = reinterpret_cast<float*>(bytes + sizeof(SharedStateSlot));
+  const std::size_t capacity = header->capacity;
+
+  const std::uint64_t begin = slot->sequence.load(std::memory_order_relaxed) + 1;
+  slot->sequence.store(begin, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->tick = tick;
+  slot->num_bodies = num_bodies;
+#pragma omp parallel for schedule(static)
+  for (std::size_t a = 0; a < NUM_SHARED_STATE_ARRAYS; ++a) {
+    float *dest = data + a * capacity;
+    for (std::size_t k = 0; k < num_bodies; ++k) dest[k] = arrays[a][rows[k]];
+  }
+  if (num_bodies) memcpy(data + NUM_SHARED_STATE_ARRAYS * capacity, ids, num_bodies * sizeof(std::uint32_t));
+  slot->sequence.store(begin + 1, std::memory_order_release);
+  header->latest.store(sequence, std::memory_order_release);
+  published = sequence;
+  return 0;
+}
+
+SharedStateReader::SharedStateReader(): mapping(nullptr), mapping_size(0) {}
+
+SharedStateReader::~SharedStateReader() { close(); }
+
+void SharedStateReader::close() {
+  if (!mapping) return;
+  munmap(mapping, mapping_size);
+  mapping = nullptr;
+}
+
+/*
+ * Map a publisher's object read only, checking
+ * that it really is one, and that it is as big
+ * as its header says.
+ */
+int SharedStateReader::open(const std::string& name) {
+  close();
+  const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    std::cerr << "ERROR: Couldn't open shared memory " << name << "." << std::endl;
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || static_cast<std::size_t>(st.st_size) < sizeof(SharedStateHeader)) {
+    std::cerr << "ERROR: " << name << " is not Hummingbird shared state." << std::endl;
+    ::close(fd);
+    return -1;
+  }
+  const std::size_t size = static_cast<std::size_t>(st.st_size);
+  void *new_mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (new_mapping == MAP_FAILED) {
+    std::cerr << "ERROR: Couldn't map shared memory " << name << "." << std::endl;
+    return -1;
+  }
+  mapping = new_mapping;
+  mapping_size = size;
+
+  const SharedStateHeader *header = static_cast<const SharedStateHeader*>(mapping);
+  const bool valid = memcmp(header->magic, SHARED_STATE_MAGIC, sizeof(SHARED_STATE_MAGIC)) == 0;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (!valid || header->version != SHARED_STATE_VERSION || !header->num_slots || header->slot_size < slot_size_for(header->capacity) ||
+      (size - sizeof(SharedStateHeader)) / header->num_slots < header->slot_size) {
+    std::cerr << "ERROR: " << name << " is not Hummingbird shared state." << std::endl;
+    close();
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * The newest snapshot, or nullptr if there is
+ * none yet or it is being overwritten right now.
+ */
+const SharedStateSlot *SharedStateReader::begin_read(std::uint64_t& sequence) const {
+  if (!mapping) return nullptr;
+  const SharedStateHeader *header = static_cast<const SharedStateHeader*>(mapping);
+  const std::uint64_t latest = header->latest.load(std::memory_order_acquire);
+  if (!latest) return nullptr;
+  const char *bytes = static_cast<const char*>(mapping) + sizeof(SharedStateHeader) + (latest % header->num_slots) * header->slot_size;
+  const SharedStateSlot *slot = reinterpret_cast<const SharedStateSlot*>(bytes);
+  sequence = slot->sequence.load(std::memory_order_acquire);
+  return sequence & 1 ? nullptr : slot;
+}
+
+bool SharedStateReader::end_read(const SharedStateSlot *slot, const std::uint64_t sequence) const {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot->sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+const float *SharedStateReader::array(const SharedStateSlot *slot, const SharedStateArray which) const {
+  const SharedStateHeader *header = static_cast<const SharedStateHeader*>(mapping);
+  return reinterpret_cast<const float*>(reinterpret_cast<const char*>(slot) + sizeof(SharedStateSlot)) + which * header->capacity;
+}
+
+const std::uint32_t *SharedStateReader::ids(const SharedStateSlot *slot) const {
+  return reinterpret_cast<const std::uint32_t*>(array(slot, NUM_SHARED_STATE_ARRAYS));
+}
+
+bool SharedStateReader::retired() const {
+  return mapping && static_cast<const SharedStateHeader*>(mapping)->retired.load(std::memory_order_acquire);
+}
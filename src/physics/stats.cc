@@ -0,0 +1,50 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#include <physics/stats.h>
+
+#include <iostream>
+
+int StatsWriter::open(const std::string& file_name) {
+  out.open(file_name, std::ios::trunc);
+  if (!out) {
+    std::cerr << "ERROR: Couldn't open stats file " << file_name << "." << std::endl;
+    return -1;
+  }
+  csv = file_name.size() >= 4 && file_name.compare(file_name.size() - 4, 4, ".csv") == 0;
+  if (csv) out << "tick,octree_nodes,octree_depth,leaves,leaf_bodies,max_leaf_bodies,candidate_pairs,narrowphase_tests,contacts,wall_hits,max_penetration\n";
+  return 0;
+}
+
+/*
+ * Lines are flushed as they go, so the file
+ * can be followed while the run goes on.
+ */
+int StatsWriter::write(const TickStats& stats) {
+  const OctreeShape& tree = stats.octree;
+  if (csv) {
+    out << stats.tick << ',' << tree.nodes << ',' << tree.max_depth << ',' << tree.leaves << ',' << tree.leaf_bodies << ',' << tree.max_leaf_bodies << ','
+	<< stats.candidate_pairs << ',' << stats.narrowphase_tests << ',' << stats.contacts << ',' << stats.wall_hits << ',' << stats.max_penetration << '\n';
+  }
+  else {
+    out << "{\"tick\": " << stats.tick << ", \"octree_nodes\": " << tree.nodes << ", \"octree_depth\": " << tree.max_depth
+	<< ", \"leaves\": " << tree.leaves << ", \"leaf_bodies\": " << tree.leaf_bodies << ", \"max_leaf_bodies\": " << tree.max_leaf_bodies
+	<< ", \"candidate_pairs\": " << stats.candidate_pairs << ", \"narrowphase_tests\": " << stats.narrowphase_tests
+	<< ", \"contacts\": " << stats.contacts << ", \"wall_hits\": " << stats.wall_hits << ", \"max_penetration\": " << stats.max_penetration << "}\n";
+  }
+  out.flush();
+  if (!out) {
+    std::cerr << "ERROR: Couldn't write stats." << std::endl;
+    return -1;
+  }
+  return 0;
+}
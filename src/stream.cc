@@ -0,0 +1,481 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#include <stream.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <math.h>
+#include <sstream>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * Orientations are unit quaternions, so their
+ * components fit 16 bits at this step.
+ */
+static constexpr float STREAM_ORIENTATION_STEP = 1.0f / 32767.0f;
+
+/*
+ * Messages start with a type byte and a 64 bit
+ * payload length.
+ */
+static constexpr std::size_t STREAM_MESSAGE_HEADER = 1 + sizeof(std::uint64_t);
+
+/*
+ * Viewers drop servers that announce longer
+ * messages than this, rather than buffering
+ * whatever a bad length asks for. Frames of
+ * millions of bodies fit with room to spare.
+ */
+static constexpr std::uint64_t STREAM_MAX_MESSAGE = std::uint64_t{1} << 30;
+
+static std::int32_t quantize(const float value, const float step) {
+  const double q = nearbyint(static_cast<double>(value) / static_cast<double>(step));
+  if (!(q >= static_cast<double>(std::numeric_limits<std::int32_t>::min()))) return std::numeric_limits<std::int32_t>::min();
+  if (q > static_cast<double>(std::numeric_limits<std::int32_t>::max())) return std::numeric_limits<std::int32_t>::max();
+  return static_cast<std::int32_t>(q);
+}
+
+static void put_varint(std::vector<char>& out, const std::int64_t delta) {
+  std::uint64_t zigzag = (static_cast<std::uint64_t>(delta) << 1) ^ static_cast<std::uint64_t>(delta >> 63);
+  while (zigzag >= 0x80) {
+    out.push_back(static_cast<char>(zigzag | 0x80));
+    zigzag >>= 7;
+  }
+  out.push_back(static_cast<char>(zigzag));
+}
+
+static bool get_varint(const char *&p, const char *const end, std::int64_t& delta) {
+  std::uint64_t zigzag = 0;
+  for (unsigned int shift = 0; shift < 64; shift += 7) {
+    if (p == end) return false;
+    const std::uint64_t byte = static_cast<unsigned char>(*p++);
+    zigzag |= (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      delta = static_cast<std::int64_t>(zigzag >> 1) ^ -static_cast<std::int64_t>(zigzag & 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+static void put_message(std::vector<char>& out, const char type, const char *payload, const std::size_t size) {
+  const std::uint64_t length = size;
+  const std::size_t offset = out.size();
+  out.resize(offset + STREAM_MESSAGE_HEADER + size);
+  out[offset] = type;
+  memcpy(out.data() + offset + 1, &length, sizeof(length));
+  if (size) memcpy(out.data() + offset + STREAM_MESSAGE_HEADER, payload, size);
+}
+
+StreamServer::StreamServer(): listen_fd(-1), wake_fds{-1, -1}, port(0), stopping(false), wanted(false), num_viewers(0), published(0) {}
+
+StreamServer::~StreamServer() {
+  stopping = true;
+  if (thread.joinable()) {
+    const char byte = 0;
+    [[maybe_unused]] const ssize_t n = write(wake_fds[1], &byte, 1);
+    thread.join();
+  }
+  for (auto& viewer : viewers) close(viewer.fd);
+  for (const int fd : {listen_fd, wake_fds[0], wake_fds[1]}) {
+    if (fd >= 0) close(fd);
+  }
+}
+
+std::uint16_t StreamServer::get_port() const { return port; }
+std::size_t StreamServer::get_num_viewers() const { return num_viewers; }
+
+/*
+ * Listen on every interface. Port 0 picks any
+ * free port, which get_port then tells.
+ */
+int StreamServer::open(const std::uint16_t port_i) {
+  listen_fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (listen_fd >= 0) {
+    const int off = 0;
+    setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+  }
+  const int on = 1;
+  sockaddr_in6 address{};
+  address.sin6_family = AF_INET6;
+  address.sin6_addr = in6addr_any;
+  address.sin6_port = htons(port_i);
+  socklen_t length = sizeof(address);
+  if (listen_fd < 0 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+      bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) || listen(listen_fd, 16) ||
+      getsockname(listen_fd, reinterpret_cast<sockaddr*>(&address), &length)) {
+    std::cerr << "ERROR: Couldn't listen for viewers on port " << port_i << "." << std::endl;
+    return -1;
+  }
+  port = ntohs(address.sin6_port);
+
+  if (pipe2(wake_fds, O_NONBLOCK)) {
+    std::cerr << "ERROR: Couldn't start the stream server." << std::endl;
+    return -1;
+  }
+  thread = std::thread(&StreamServer::serve, this);
+  return 0;
+}
+
+/*
+ * Called by the engine's thread after it moves.
+ * Unless a viewer is waiting for a frame, this
+ * costs one atomic load. The header is only
+ * written again when bodies have come or gone.
+ */
+void StreamServer::publish(const Engine& engine) {
+  if (!wanted.load(std::memory_order_acquire)) return;
+  wanted.store(false, std::memory_order_relaxed);
+  if (pending.init.empty() || pending.body_changes != engine.get_body_changes()) {
+    std::ostringstream init;
+    engine.write_init(init);
+    pending.init = init.str();
+    pending.body_changes = engine.get_body_changes();
+  }
+  engine.get_poses(pending.poses);
+  pending.version = ++published;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::swap(pending, shared);
+  }
+  const char byte = 0;
+  [[maybe_unused]] const ssize_t n = write(wake_fds[1], &byte, 1);
+}
+
+void StreamServer::accept_viewers() {
+  for (;;) {
+    const int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+    if (fd < 0) return;
+    const int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    Viewer viewer;
+    viewer.fd = fd;
+    viewers.push_back(std::move(viewer));
+  }
+}
+
+/*
+ * Viewers only ever send their hello, so after
+ * that, reading just tells us when they leave.
+ */
+void StreamServer::read_hello(Viewer& viewer) {
+  char scratch[256];
+  char *dest = viewer.greeted ? scratch : reinterpret_cast<char*>(&viewer.hello) + viewer.hello_received;
+  const std::size_t want = viewer.greeted ? sizeof(scratch) : sizeof(viewer.hello) - viewer.hello_received;
+  const ssize_t n = recv(viewer.fd, dest, want, 0);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    viewer.dead = true;
+    return;
+  }
+  if (n < 0 || viewer.greeted) return;
+  viewer.hello_received += static_cast<std::size_t>(n);
+  if (viewer.hello_received < sizeof(viewer.hello)) return;
+
+  const StreamHello& hello = viewer.hello;
+  if (memcmp(hello.magic, STREAM_MAGIC, sizeof(STREAM_MAGIC)) || hello.version != STREAM_VERSION || !(hello.precision > 0.0f) || !(hello.rate >= 0.0f)) {
+    viewer.dead = true;
+    return;
+  }
+  viewer.greeted = true;
+  if (hello.rate > 0.0f) viewer.period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / static_cast<double>(hello.rate)));
+  viewer.due = std::chrono::steady_clock::now();
+}
+
+/*
+ * Code the working snapshot for one viewer,
+ * against the last frame it got.
+ */
+void StreamServer::encode(Viewer& viewer) {
+  viewer.out.clear();
+  viewer.out_sent = 0;
+  const std::size_t num_bodies = working.poses.size();
+  if (!viewer.have_init || viewer.body_changes != working.body_changes) {
+    put_message(viewer.out, 'I', working.init.data(), working.init.size());
+    viewer.base.assign(STREAM_POSE_VALUES * num_bodies, 0);
+    viewer.body_changes = working.body_changes;
+    viewer.have_init = true;
+  }
+
+  std::vector<char> payload(2 * sizeof(std::uint64_t));
+  const std::uint64_t header[2] = {working.version, num_bodies};
+  memcpy(payload.data(), header, sizeof(header));
+  payload.reserve(payload.size() + 2 * STREAM_POSE_VALUES * num_bodies);
+  const float precision = viewer.hello.precision;
+  for (std::size_t k = 0; k < num_bodies; ++k) {
+    const BodyPose& pose = working.poses[k];
+    const std::int32_t values[STREAM_POSE_VALUES] = {
+      quantize(pose.x, precision), quantize(pose.y, precision), quantize(pose.z, precision),
+      quantize(pose.qw, STREAM_ORIENTATION_STEP), quantize(pose.qx, STREAM_ORIENTATION_STEP), quantize(pose.qy, STREAM_ORIENTATION_STEP), quantize(pose.qz, STREAM_ORIENTATION_STEP)
+    };
+    std::int32_t *base = viewer.base.data() + STREAM_POSE_VALUES * k;
+    for (std::size_t c = 0; c < STREAM_POSE_VALUES; ++c) {
+      put_varint(payload, static_cast<std::int64_t>(values[c]) - base[c]);
+      base[c] = values[c];
+    }
+  }
+  put_message(viewer.out, 'F', payload.data(), payload.size());
+  viewer.version = working.version;
+}
+
+void StreamServer::flush(Viewer& viewer) {
+  while (viewer.out_sent < viewer.out.size()) {
+    const ssize_t n = send(viewer.fd, viewer.out.data() + viewer.out_sent, viewer.out.size() - viewer.out_sent, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EINTR) viewer.dead = true;
+      return;
+    }
+    viewer.out_sent += static_cast<std::size_t>(n);
+  }
+}
+
+/*
+ * The network thread. Viewers whose last frame
+ * has been sent, and whose rate allows another,
+ * get the newest snapshot if they don't have it
+ * yet; otherwise we ask the engine for one.
+ */
+void StreamServer::serve() {
+  std::vector<pollfd> poll_fds;
+  while (!stopping) {
+    const auto now = std::chrono::steady_clock::now();
+    int timeout = 100;
+    poll_fds.assign({pollfd{listen_fd, POLLIN, 0}, pollfd{wake_fds[0], POLLIN, 0}});
+    for (const auto& viewer : viewers) {
+      const bool sending = viewer.out_sent < viewer.out.size();
+      poll_fds.push_back(pollfd{viewer.fd, static_cast<short>(POLLIN | (sending ? POLLOUT : 0)), 0});
+      if (viewer.greeted && !sending && viewer.due > now) {
+	const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(viewer.due - now).count() + 1;
+	timeout = std::min(timeout, static_cast<int>(wait));
+      }
+    }
+    if (poll(poll_fds.data(), poll_fds.size(), timeout) < 0 && errno != EINTR) break;
+
+    if (poll_fds[0].revents & POLLIN) accept_viewers();
+    if (poll_fds[1].revents & POLLIN) {
+      char scratch[64];
+      while (read(wake_fds[0], scratch, sizeof(scratch)) > 0) {}
+    }
+    for (std::size_t v = 0; v + 2 < poll_fds.size(); ++v) {
+      const short revents = poll_fds[v + 2].revents;
+      if (revents & POLLIN) read_hello(viewers[v]);
+      else if (revents & (POLLERR | POLLHUP | POLLNVAL)) viewers[v].dead = true;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (shared.version > working.version) std::swap(shared, working);
+    }
+    const auto after = std::chrono::steady_clock::now();
+    bool need = false;
+    for (auto& viewer : viewers) {
+      if (viewer.dead || !viewer.greeted || viewer.out_sent < viewer.out.size() || viewer.due > after) continue;
+      if (working.version > viewer.version) {
+	encode(viewer);
+	viewer.due = std::max(viewer.due + viewer.period, after);
+      }
+      else need = true;
+    }
+    for (auto& viewer : viewers) {
+      if (!viewer.dead) flush(viewer);
+    }
+    if (need) wanted.store(true, std::memory_order_release);
+
+    std::size_t greeted = 0;
+    for (const auto& viewer : viewers) {
+      if (viewer.dead) close(viewer.fd);
+      else greeted += viewer.greeted;
+    }
+    viewers.erase(std::remove_if(viewers.begin(), viewers.end(), [](const Viewer& viewer) { return viewer.dead; }), viewers.end());
+    num_viewers = greeted;
+  }
+}
+
+StreamClient::StreamClient(): fd(-1), precision(0.0f), in_start(0), base_stale(true), frame(0) {}
+
+StreamClient::~StreamClient() {
+  if (fd >= 0) close(fd);
+}
+
+std::uint64_t StreamClient::get_frame() const { return frame; }
+
+int StreamClient::connect(const std::string& host, const std::string& port, const float rate, const float precision_i) {
+  if (!(precision_i > 0.0f) || !(rate >= 0.0f)) {
+    std::cerr << "ERROR: Stream precision must be positive, and rate can't be negative." << std::endl;
+    return -1;
+  }
+  precision = precision_i;
+
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *addresses = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses)) {
+    std::cerr << "ERROR: Couldn't find stream server " << host << ":" << port << "." << std::endl;
+    return -1;
+  }
+  for (const addrinfo *address = addresses; address && fd < 0; address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd >= 0 && ::connect(fd, address->ai_addr, address->ai_addrlen)) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  if (fd < 0) {
+    std::cerr << "ERROR: Couldn't connect to stream server " << host << ":" << port << "." << std::endl;
+    return -1;
+  }
+  const int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  StreamHello hello{};
+  memcpy(hello.magic, STREAM_MAGIC, sizeof(STREAM_MAGIC));
+  hello.version = STREAM_VERSION;
+  hello.rate = rate;
+  hello.precision = precision;
+  if (send(fd, &hello, sizeof(hello), MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(hello))) {
+    std::cerr << "ERROR: Couldn't greet stream server " << host << ":" << port << "." << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Take the next whole message out of what we
+ * have read so far, reading more first if we
+ * have to. Returns 1 for a message, and 0 if
+ * there is none yet and we aren't waiting.
+ */
+int StreamClient::next_message(const bool wait, char& type, std::string& payload) {
+  for (;;) {
+    const std::size_t available = in.size() - in_start;
+    if (available >= STREAM_MESSAGE_HEADER) {
+      std::uint64_t length;
+      memcpy(&length, in.data() + in_start + 1, sizeof(length));
+      if (length > STREAM_MAX_MESSAGE) {
+	std::cerr << "ERROR: Malformed message from the stream server." << std::endl;
+	return -1;
+      }
+      if (available - STREAM_MESSAGE_HEADER >= length) {
+	type = in[in_start];
+	payload.assign(in.data() + in_start + STREAM_MESSAGE_HEADER, length);
+	in_start += STREAM_MESSAGE_HEADER + length;
+	return 1;
+      }
+    }
+    if (in_start) {
+      in.erase(in.begin(), in.begin() + static_cast<std::ptrdiff_t>(in_start));
+      in_start = 0;
+    }
+
+    char buffer[1 << 16];
+    const ssize_t n = recv(fd, buffer, sizeof(buffer), wait ? 0 : MSG_DONTWAIT);
+    if (n > 0) {
+      in.insert(in.end(), buffer, buffer + n);
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+      if (!wait || errno == EAGAIN) return 0;
+      continue;
+    }
+    std::cerr << "ERROR: Lost the connection to the stream server." << std::endl;
+    return -1;
+  }
+}
+
+int StreamClient::read_init(std::string& init) {
+  char type;
+  if (next_message(true, type, init) < 0) return -1;
+  if (type != 'I') {
+    std::cerr << "ERROR: Stream server didn't start with the scene." << std::endl;
+    return -1;
+  }
+  base_stale = true;
+  return 0;
+}
+
+/*
+ * Frames must be for the bodies of the last
+ * scene, so a frame's body count is checked
+ * against the engine's before it sizes
+ * anything.
+ */
+int StreamClient::decode(const std::string& payload, const std::size_t expected_bodies) {
+  std::uint64_t header[2];
+  if (payload.size() < sizeof(header)) return -1;
+  memcpy(header, payload.data(), sizeof(header));
+  if (header[1] != expected_bodies) return -1;
+  const std::size_t num_bodies = expected_bodies;
+  if (base_stale) {
+    base.assign(STREAM_POSE_VALUES * num_bodies, 0);
+    base_stale = false;
+  }
+  if (base.size() != STREAM_POSE_VALUES * num_bodies) return -1;
+
+  const char *p = payload.data() + sizeof(header), *const end = payload.data() + payload.size();
+  for (std::size_t i = 0; i < base.size(); ++i) {
+    std::int64_t delta;
+    if (!get_varint(p, end, delta)) return -1;
+    base[i] = static_cast<std::int32_t>(base[i] + delta);
+  }
+  if (p != end) return -1;
+  frame = header[0];
+  return 0;
+}
+
+/*
+ * Apply everything that has arrived, but only
+ * set poses from the newest frame. With wait,
+ * block until at least one frame is in.
+ */
+int StreamClient::poll(Engine& engine, const bool wait) {
+  bool have_frame = false;
+  char type;
+  std::string payload;
+  for (;;) {
+    const int got = next_message(wait && !have_frame, type, payload);
+    if (got < 0) return -1;
+    if (!got) break;
+    if (type == 'I') {
+      std::istringstream init(payload);
+      if (engine.load_init(init)) return -1;
+      base_stale = true;
+    }
+    else if (type == 'F') {
+      if (decode(payload, engine.get_num_bodies())) {
+	std::cerr << "ERROR: Malformed frame from the stream server." << std::endl;
+	return -1;
+      }
+      have_frame = true;
+    }
+  }
+  if (!have_frame) return 0;
+
+  poses.resize(base.size() / STREAM_POSE_VALUES);
+  for (std::size_t k = 0; k < poses.size(); ++k) {
+    const std::int32_t *values = base.data() + STREAM_POSE_VALUES * k;
+    poses[k] = BodyPose{static_cast<float>(values[0]) * precision, static_cast<float>(values[1]) * precision, static_cast<float>(values[2]) * precision,
+			static_cast<float>(values[3]) * STREAM_ORIENTATION_STEP, static_cast<float>(values[4]) * STREAM_ORIENTATION_STEP,
+			static_cast<float>(values[5]) * STREAM_ORIENTATION_STEP, static_cast<float>(values[6]) * STREAM_ORIENTATION_STEP};
+  }
+  return engine.set_poses(poses);
+}
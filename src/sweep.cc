@@ -0,0 +1,206 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#include <sweep.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <math.h>
+
+#include <omp.h>
+
+/*
+ * Worlds with fewer bodies than this are too
+ * small to keep every thread busy on their own,
+ * so we run one world per thread, and each
+ * engine's parallel loops run on just that
+ * thread. Bigger worlds run one at a time, with
+ * each phase of each tick spread over every
+ * thread. Either way, we never have more threads
+ * than the one pool.
+ */
+static constexpr std::size_t SWEEP_SMALL_WORLD_BODIES = 20000;
+
+Sweep::Sweep(char *json_file_name_i): json_file_name(json_file_name_i), ticks(0), dt(0.0f), num_runs(0) {}
+
+std::size_t Sweep::get_num_runs() const { return num_runs; }
+const std::vector<SweepSummary> &Sweep::get_summaries() const { return summaries; }
+
+/*
+ * Read the scene and the sweep description.
+ * The scene itself is only checked once we
+ * run it, with each run's values filled in.
+ */
+int Sweep::initialize() {
+  std::ifstream json_file(json_file_name);
+  if (!json_file.is_open()) {
+    std::cerr << "ERROR: Couldn't open config file " << json_file_name << "." << std::endl;
+    return -1;
+  }
+
+  try {  
+    json_file >> root;
+  }
+  catch(const Json::RuntimeError& e) {
+    std::cerr << "ERROR: Malformed JSON config file " << json_file_name << "." << std::endl; 
+    return -1; 
+  }
+
+  const Json::Value &sweep = root["SWEEP"];
+  if (!sweep.isObject()) {
+    std::cerr << "ERROR: Either couldn't find SWEEP in input JSON, or the value of SWEEP is not of the correct type." << std::endl;
+    return -1;
+  }
+  if (!sweep["TICKS"].isIntegral() || !sweep["DT"].isNumeric() || !sweep["PARAMETERS"].isObject()) {
+    std::cerr << "ERROR: SWEEP needs an integer TICKS, a number DT, and an object PARAMETERS." << std::endl;
+    return -1;
+  }
+  ticks = sweep["TICKS"].as<std::size_t>();
+  dt = sweep["DT"].as<float>();
+
+  const Json::Value &parameters = sweep["PARAMETERS"];
+  num_runs = 1;
+  for (const auto &key : parameters.getMemberNames()) {
+    const Json::Value &key_values = parameters[key];
+    if (key == "SWEEP" || key == "BODIES") {
+      std::cerr << "ERROR: Can't sweep over " << key << "." << std::endl;
+      return -1;
+    }
+    if (!key_values.isArray() || key_values.empty()) {
+      std::cerr << "ERROR: Values to sweep " << key << " over must be a non-empty array." << std::endl;
+      return -1;
+    }
+    for (const auto &value : key_values) {
+      if (value.isArray() || value.isObject()) {
+	std::cerr << "ERROR: Values to sweep " << key << " over must be numbers, strings or booleans." << std::endl;
+	return -1;
+      }
+    }
+    keys.push_back(key);
+    values.emplace_back(key_values.begin(), key_values.end());
+    num_runs *= key_values.size();
+  }
+  root.removeMember("SWEEP");
+
+  /*
+   * Without a SEED, each run would generate its
+   * own RANDOM scene, and the runs couldn't be
+   * compared, so we pick one for them all.
+   */
+  if (!root["SEED"].isIntegral() && std::find(keys.begin(), keys.end(), "SEED") == keys.end()) {
+    root["SEED"] = static_cast<Json::Value::UInt64>(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+  }
+
+  return 0;
+}
+
+/*
+ * The config JSON for one run.
+ */
+Json::Value Sweep::run_root(std::size_t run) const {
+  Json::Value run_json = root;
+  for (std::size_t k = keys.size(); k-- > 0;) {
+    run_json[keys[k]] = values[k][run % values[k].size()];
+    run /= values[k].size();
+  }
+  return run_json;
+}
+
+/*
+ * Run every world. We read the first run's
+ * config up front to see how big its world is
+ * (swept values are plain constants, so every
+ * run has as many bodies), which decides how
+ * we schedule the runs.
+ */
+int Sweep::run() {
+  summaries.assign(num_runs, SweepSummary{});
+  Config first(json_file_name);
+  if (first.initialize(run_root(0))) return -1;
+
+  if (first.num_bodies >= SWEEP_SMALL_WORLD_BODIES) {
+    for (std::size_t i = 0; i < num_runs; ++i) {
+      if (run_world(i)) return -1;
+    }
+    return 0;
+  }
+
+  bool failed = false;
+  const int max_active_levels = omp_get_max_active_levels();
+  omp_set_max_active_levels(1);
+#pragma omp parallel for schedule(dynamic, 1)
+  for (std::size_t i = 0; i < num_runs; ++i) {
+    if (run_world(i)) {
+#pragma omp atomic write
+      failed = true;
+    }
+  }
+  omp_set_max_active_levels(max_active_levels);
+  return failed ? -1 : 0;
+}
+
+/*
+ * Run a single world to the end and summarize
+ * it.
+ */
+int Sweep::run_world(const std::size_t run) {
+  const auto start = std::chrono::steady_clock::now();
+  Config config(json_file_name);
+  if (config.initialize(run_root(run))) return -1;
+  Engine engine(config);
+  for (std::size_t tick = 0; tick < ticks; ++tick) engine.update(dt);
+
+  const auto &pos = engine.get_pos();
+  const auto &vel = engine.get_vel();
+  const auto &mass = engine.get_mass();
+  double kinetic_energy = 0.0, total_mass = 0.0, com_x = 0.0, com_y = 0.0, com_z = 0.0, max_speed_2 = 0.0;
+  for (std::size_t i = 0; i < engine.get_num_bodies(); ++i) {
+    const double speed_2 = static_cast<double>(vel.x[i]) * vel.x[i] + static_cast<double>(vel.y[i]) * vel.y[i] + static_cast<double>(vel.z[i]) * vel.z[i];
+    kinetic_energy += 0.5 * mass[i] * speed_2;
+    total_mass += mass[i];
+    com_x += static_cast<double>(mass[i]) * pos.x[i];
+    com_y += static_cast<double>(mass[i]) * pos.y[i];
+    com_z += static_cast<double>(mass[i]) * pos.z[i];
+    max_speed_2 = std::max(max_speed_2, speed_2);
+  }
+  if (total_mass > 0.0) {
+    com_x /= total_mass;
+    com_y /= total_mass;
+    com_z /= total_mass;
+  }
+  const std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+  summaries[run] = SweepSummary{kinetic_energy, com_x, com_y, com_z, sqrt(max_speed_2), seconds.count()};
+  return 0;
+}
+
+/*
+ * Write one CSV row per run: its index, its
+ * value for every swept key, and its summary.
+ */
+void Sweep::write_csv(std::ostream &out) const {
+  out << "run";
+  for (const auto &key : keys) out << "," << key;
+  out << ",kinetic_energy,com_x,com_y,com_z,max_speed,seconds\n";
+  for (std::size_t i = 0; i < num_runs; ++i) {
+    out << i;
+    const Json::Value run_json = run_root(i);
+    for (const auto &key : keys) {
+      const Json::Value &value = run_json[key];
+      if (value.isIntegral()) out << "," << value.asLargestInt();
+      else if (value.isDouble()) out << "," << value.asDouble();
+      else out << "," << value.asString();
+    }
+    const SweepSummary &summary = summaries[i];
+    out << "," << summary.kinetic_energy << "," << summary.com_x << "," << summary.com_y << "," << summary.com_z << "," << summary.max_speed << "," << summary.seconds << "\n";
+  }
+}
@@ -17,6 +17,27 @@
 #include "../include/cli.h"
 
 #include <string>
+#include <cstdio>
+
+#include <unistd.h>
+#include <omp.h>
+
+void write_body_file(const char *file_name, std::uint64_t num_bodies);
+
+/*
+ * Write a body file with num_bodies spheres,
+ * where sphere i sits at (i, 2i, 3i).
+ */
+void write_body_file(const char *file_name, std::uint64_t num_bodies) {
+  BodyFileHeader header{{'H', 'B', 'B', 'O', 'D', 'I', 'E', 'S'}, 1, 0, num_bodies};
+  std::ofstream file(file_name, std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (std::uint64_t i = 0; i < num_bodies; ++i) {
+    float f = static_cast<float>(i);
+    ConfigSphere sphere{f, 2.0f * f, 3.0f * f, 0.0f, 0.0f, 0.0f, 1.0f, 0.5f};
+    file.write(reinterpret_cast<const char*>(&sphere), sizeof(sphere));
+  }
+}
 
 TEST_CASE("Config constructor general case", "[cli]") {
   char file_name[]{"test.json"};
@@ -60,3 +81,106 @@ TEST_CASE("Initialize without fields", "[cli]") {
 
   REQUIRE(cfg.initialize() == -1);
 }
+
+TEST_CASE("Initialize with body file", "[cli]") {
+  write_body_file("tests/cli_jsons/generated_bodies.bin", 100);
+  char file_name[]{"tests/cli_jsons/file.json"};
+  Config cfg(file_name);
+
+  REQUIRE(cfg.initialize() == 0);
+  REQUIRE(cfg.bodies.size() == 1);
+  REQUIRE(cfg.body_files.size() == 1);
+  REQUIRE(cfg.body_files[0].size() == 100);
+  REQUIRE(cfg.num_bodies == 101);
+  REQUIRE(cfg.body_files[0].data()[7].y == 14.0f);
+  std::remove("tests/cli_jsons/generated_bodies.bin");
+}
+
+TEST_CASE("Initialize with truncated body file", "[cli]") {
+  write_body_file("tests/cli_jsons/generated_bodies.bin", 100);
+  std::FILE *file = std::fopen("tests/cli_jsons/generated_bodies.bin", "r+");
+  REQUIRE(ftruncate(fileno(file), sizeof(BodyFileHeader) + 10 * sizeof(ConfigSphere)) == 0);
+  std::fclose(file);
+  char file_name[]{"tests/cli_jsons/file.json"};
+  Config cfg(file_name);
+
+  REQUIRE(cfg.initialize() == -1);
+  std::remove("tests/cli_jsons/generated_bodies.bin");
+}
+
+TEST_CASE("Initialize with missing body file", "[cli]") {
+  char file_name[]{"tests/cli_jsons/missing_file.json"};
+  Config cfg(file_name);
+
+  REQUIRE(cfg.initialize() == -1);
+}
+
+TEST_CASE("Seeded random bodies don't depend on thread count", "[cli]") {
+  char file_name[]{"tests/cli_jsons/random.json"};
+  Config cfg1(file_name);
+  Config cfg2(file_name);
+
+  int old_num_threads = omp_get_max_threads();
+  omp_set_num_threads(1);
+  REQUIRE(cfg1.initialize() == 0);
+  omp_set_num_threads(4);
+  REQUIRE(cfg2.initialize() == 0);
+  omp_set_num_threads(old_num_threads);
+
+  REQUIRE(cfg1.seed == 42);
+  REQUIRE(cfg1.num_bodies == 20000);
+  REQUIRE(cfg2.num_bodies == 20000);
+  for (std::size_t i = 0; i < cfg1.num_bodies; ++i) {
+    const auto& body1 = std::get<ConfigSphere>(cfg1.bodies[i]);
+    const auto& body2 = std::get<ConfigSphere>(cfg2.bodies[i]);
+    REQUIRE(body1.x == body2.x);
+    REQUIRE(body1.y == body2.y);
+    REQUIRE(body1.z == body2.z);
+    REQUIRE(body1.r == body2.r);
+    REQUIRE(body1.x >= 5.0f);
+    REQUIRE(body1.x < 95.0f);
+  }
+
+  /*
+   * The two RANDOM bodies use different
+   * streams, so they don't produce the same
+   * positions.
+   */
+  REQUIRE(std::get<ConfigSphere>(cfg1.bodies[0]).x != std::get<ConfigSphere>(cfg1.bodies[10000]).x);
+}
+
+TEST_CASE("Lattice placement doesn't overlap bodies", "[cli]") {
+  char file_name[]{"tests/cli_jsons/lattice.json"};
+  Config cfg(file_name);
+
+  REQUIRE(cfg.initialize() == 0);
+  REQUIRE(cfg.num_bodies == 3000);
+  float min_dist2 = 1000000.0f;
+  for (std::size_t i = 0; i < cfg.num_bodies; ++i) {
+    const auto& body1 = std::get<ConfigSphere>(cfg.bodies[i]);
+    REQUIRE(body1.x >= 5.0f);
+    REQUIRE(body1.x <= 45.0f);
+    REQUIRE(body1.z >= 5.0f);
+    REQUIRE(body1.z <= 45.0f);
+    for (std::size_t j = i + 1; j < cfg.num_bodies; ++j) {
+      const auto& body2 = std::get<ConfigSphere>(cfg.bodies[j]);
+      float dx = body1.x - body2.x, dy = body1.y - body2.y, dz = body1.z - body2.z;
+      min_dist2 = std::min(min_dist2, dx * dx + dy * dy + dz * dz);
+    }
+  }
+  REQUIRE(min_dist2 >= 3.999f);
+}
+
+TEST_CASE("Lattice placement rejects overfull region", "[cli]") {
+  char file_name[]{"tests/cli_jsons/lattice_full.json"};
+  Config cfg(file_name);
+
+  REQUIRE(cfg.initialize() == -1);
+}
+
+TEST_CASE("Random placement rejects inverted regions", "[cli]") {
+  char file_name[]{"tests/cli_jsons/lattice_inverted.json"};
+  Config cfg(file_name);
+
+  REQUIRE(cfg.initialize() == -1);
+}
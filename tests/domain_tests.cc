@@ -0,0 +1,153 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#include "catch2/catch.hpp"
+
+#include "../include/domain.h"
+
+#include <thread>
+
+#include <sys/socket.h>
+
+/*
+ * What each rank of a test run ended up with.
+ */
+struct RankOutcome {
+  int status;
+  float slab_min, slab_max;
+  std::size_t num_owned;
+};
+
+/*
+ * Run every rank of a distributed run on its
+ * own thread in this process, joined by socket
+ * pairs just like separate processes would be,
+ * and return rank 0's gathered bodies.
+ */
+static std::vector<DomainBody> run_ranks(char *file_name, const int size, std::vector<RankOutcome> &outcomes) {
+  std::vector<int> pairs(2 * static_cast<std::size_t>(size - 1));
+  for (std::size_t k = 0; k + 1 < static_cast<std::size_t>(size); ++k) REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, &pairs[2 * k]) == 0);
+
+  outcomes.assign(static_cast<std::size_t>(size), RankOutcome{-1, 0.0f, 0.0f, 0});
+  std::vector<DomainBody> result;
+  std::vector<std::thread> threads;
+  for (int rank = 0; rank < size; ++rank) {
+    const std::size_t r = static_cast<std::size_t>(rank);
+    const int left_fd = rank > 0 ? pairs[2 * r - 1] : -1;
+    const int right_fd = rank < size - 1 ? pairs[2 * r] : -1;
+    threads.emplace_back([&, rank, r, left_fd, right_fd]() {
+      SocketTransport transport(rank, size, left_fd, right_fd);
+      Domain domain(file_name, transport, 1);
+      RankOutcome &outcome = outcomes[r];
+      outcome.status = domain.initialize() || domain.run();
+      if (outcome.status) return;
+      outcome.slab_min = domain.get_slab_min();
+      outcome.slab_max = domain.get_slab_max();
+      outcome.num_owned = domain.get_num_owned();
+      if (rank == 0) result = domain.get_result();
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  return result;
+}
+
+TEST_CASE("Bodies migrate between ranks", "[domain]") {
+  char file_name[]{"tests/cli_jsons/domain_drift.json"};
+  for (int size = 1; size <= 3; ++size) {
+    std::vector<RankOutcome> outcomes;
+    const std::vector<DomainBody> result = run_ranks(file_name, size, outcomes);
+    for (const auto &outcome : outcomes) REQUIRE(outcome.status == 0);
+
+    /*
+     * Every body moves 20 units along x over the
+     * run, so most cross into another slab, but
+     * each must still be there exactly once.
+     */
+    REQUIRE(result.size() == 15);
+    for (std::uint32_t i = 0; i < 15; ++i) {
+      REQUIRE(result[i].global_id == i);
+      REQUIRE(result[i].state.x == Approx(25.0f + 5.0f * static_cast<float>(i)));
+      REQUIRE(result[i].state.vx == Approx(20.0f));
+    }
+  }
+}
+
+TEST_CASE("Bodies collide across slab boundaries", "[domain]") {
+  char file_name[]{"tests/cli_jsons/domain_ghost.json"};
+  std::vector<RankOutcome> outcomes;
+  const std::vector<DomainBody> result = run_ranks(file_name, 2, outcomes);
+  REQUIRE(outcomes[0].status == 0);
+  REQUIRE(outcomes[1].status == 0);
+
+  /*
+   * The bodies meet right on the boundary, each
+   * only seeing the other as a ghost, and bounce
+   * off each other elastically.
+   */
+  REQUIRE(result.size() == 2);
+  REQUIRE(result[0].state.vx == Approx(-10.0f));
+  REQUIRE(result[1].state.vx == Approx(10.0f));
+  REQUIRE(result[0].state.x < 50.0f);
+  REQUIRE(result[1].state.x > 50.0f);
+}
+
+TEST_CASE("Slow bodies see fast bodies from across the boundary", "[domain]") {
+  char file_name[]{"tests/cli_jsons/domain_fast_ghost.json"};
+  std::vector<RankOutcome> outcomes;
+  const std::vector<DomainBody> result = run_ranks(file_name, 2, outcomes);
+  REQUIRE(outcomes[0].status == 0);
+  REQUIRE(outcomes[1].status == 0);
+
+  /*
+   * The resting body is too far from the
+   * boundary to be sent across by its own
+   * speed, but the fast body reaches it in the
+   * third tick, so both ranks must see the hit
+   * and the bodies swap velocities.
+   */
+  REQUIRE(result.size() == 2);
+  REQUIRE(result[0].state.vx == Approx(-100.0f));
+  REQUIRE(result[1].state.vx == Approx(0.0f).margin(1e-3));
+}
+
+TEST_CASE("Slabs must be wider than a tick's reach", "[domain]") {
+  char file_name[]{"tests/cli_jsons/domain_ghost.json"};
+  std::vector<RankOutcome> outcomes;
+  run_ranks(file_name, 30, outcomes);
+  REQUIRE(outcomes[0].status != 0);
+}
+
+TEST_CASE("Slab boundaries move towards busier ranks", "[domain]") {
+  char file_name[]{"tests/cli_jsons/domain_balance.json"};
+  std::vector<RankOutcome> outcomes;
+  const std::vector<DomainBody> result = run_ranks(file_name, 2, outcomes);
+  REQUIRE(outcomes[0].status == 0);
+  REQUIRE(outcomes[1].status == 0);
+
+  /*
+   * Every body starts in the left half of the
+   * box, so rank 0 starts with all of them.
+   */
+  REQUIRE(outcomes[0].slab_max < 50.0f);
+  REQUIRE(outcomes[0].slab_max == outcomes[1].slab_min);
+  REQUIRE(outcomes[0].num_owned > 0);
+  REQUIRE(outcomes[1].num_owned > 0);
+  REQUIRE(outcomes[0].num_owned + outcomes[1].num_owned == 40);
+  REQUIRE(result.size() == 40);
+}
+
+TEST_CASE("Distributed runs need a DISTRIBUTED object", "[domain]") {
+  char file_name[]{"tests/cli_jsons/general.json"};
+  SocketTransport transport(0, 1, -1, -1);
+  Domain domain(file_name, transport, 1);
+  REQUIRE(domain.initialize() == -1);
+}
@@ -196,4 +196,45 @@ TEST_CASE("Two wall no collide test 2","[WallCollider]"){
     Transform pos2 {32.0f, 34.0f, 22.0f};
     CollisionResponse response = collider1.checkCollision(collider2, pos1, pos2);
     REQUIRE(!response.collides);
-}
\ No newline at end of file
+}
+TEST_CASE("Swept spheres that pass through each other collide","[SphereCollider]"){
+    // Sum of radii is 2.0, and the spheres close 20.0 in the sweep
+    SphereCollider collider1(1.0f);
+    SphereCollider collider2(1.0f);
+    Transform start1 {0.0f, 0.0f, 0.0f};
+    Transform end1 {0.0f, 0.0f, 0.0f};
+    Transform start2 {10.0f, 0.0f, 0.0f};
+    Transform end2 {-10.0f, 0.0f, 0.0f};
+    REQUIRE(!collider1.checkCollision(collider2, end1, end2).collides);
+    CollisionResponse response = collider1.checkSweptCollision(collider2, start1, end1, start2, end2);
+    // Normal is taken where they first touched, depth is how far past that they got
+    CollisionResponse expected_response {{1.0f, 0.0f, 0.0f}, 12.0f, true, 0.4f};
+    REQUIRE_SAME_RESPONSE(response, expected_response);
+    REQUIRE(smallDiff(response.toi, 0.4f));
+}
+
+TEST_CASE("Swept spheres that miss don't collide","[SphereCollider]"){
+    SphereCollider collider1(1.0f);
+    SphereCollider collider2(1.0f);
+    Transform start1 {0.0f, 0.0f, 0.0f};
+    Transform end1 {0.0f, 0.0f, 0.0f};
+    // Passes by 3.0 away from the first sphere
+    Transform start2 {10.0f, 3.0f, 0.0f};
+    Transform end2 {-10.0f, 3.0f, 0.0f};
+    REQUIRE(!collider1.checkSweptCollision(collider2, start1, end1, start2, end2).collides);
+    // Stops short of the first sphere
+    Transform end3 {2.5f, 0.0f, 0.0f};
+    REQUIRE(!collider1.checkSweptCollision(collider2, start1, end1, start2, end3).collides);
+}
+
+TEST_CASE("Swept sphere reaching a wall","[SphereCollider]"){
+    SphereCollider collider1(0.5f);
+    WallCollider collider2(0.0f, 1.0f, 0.0f);
+    Transform start1 {0.0f, 5.0f, 0.0f};
+    Transform end1 {0.0f, -5.0f, 0.0f};
+    Transform pos2 {0.0f, 0.0f, 0.0f};
+    CollisionResponse response = collider1.checkSweptCollision(collider2, start1, end1, pos2, pos2);
+    CollisionResponse expected_response {{0.0f, 1.0f, 0.0f}, 5.5f, true, 0.45f};
+    REQUIRE_SAME_RESPONSE(response, expected_response);
+    REQUIRE(smallDiff(response.toi, 0.45f));
+}
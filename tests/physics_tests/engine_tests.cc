@@ -0,0 +1,506 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#include "catch2/catch.hpp"
+#include <iostream>
+
+#include "../../include/physics/engine.h"
+
+void REQUIRE_SAME_STATE(const Engine& engine1, const Engine& engine2);
+
+void REQUIRE_SAME_STATE(const Engine& engine1, const Engine& engine2) {
+  REQUIRE(engine1.get_num_bodies() == engine2.get_num_bodies());
+  for (std::size_t i = 0; i < engine1.get_num_bodies(); ++i) {
+    REQUIRE(engine1.get_pos().x[i] == engine2.get_pos().x[i]);
+    REQUIRE(engine1.get_pos().y[i] == engine2.get_pos().y[i]);
+    REQUIRE(engine1.get_pos().z[i] == engine2.get_pos().z[i]);
+    REQUIRE(engine1.get_vel().x[i] == engine2.get_vel().x[i]);
+    REQUIRE(engine1.get_vel().y[i] == engine2.get_vel().y[i]);
+    REQUIRE(engine1.get_vel().z[i] == engine2.get_vel().z[i]);
+    REQUIRE(engine1.get_force().y[i] == engine2.get_force().y[i]);
+    REQUIRE(engine1.get_mass()[i] == engine2.get_mass()[i]);
+  }
+}
+
+TEST_CASE("Checkpoint round trip", "[engine]") {
+  char file_name[]{"tests/cli_jsons/general.json"};
+  Config cfg(file_name);
+  REQUIRE(cfg.initialize() == 0);
+
+  Engine engine1(cfg);
+  for (int i = 0; i < 10; ++i) engine1.update(0.01f);
+  REQUIRE(engine1.save_checkpoint("tests/checkpoint_test.chk") == 0);
+
+  char no_json[]{""};
+  Config empty_cfg(no_json);
+  Engine engine2(empty_cfg);
+  REQUIRE(engine2.load_checkpoint("tests/checkpoint_test.chk") == 0);
+  REQUIRE_SAME_STATE(engine1, engine2);
+  REQUIRE(engine2.get_speed() == cfg.speed);
+  REQUIRE(engine2.get_ticks_per_frame() == cfg.ticks_per_frame);
+
+  /*
+   * Resumed simulation must continue exactly
+   * like the original one.
+   */
+  for (int i = 0; i < 10; ++i) {
+    engine1.update(0.01f);
+    engine2.update(0.01f);
+  }
+  REQUIRE_SAME_STATE(engine1, engine2);
+
+  std::remove("tests/checkpoint_test.chk");
+}
+
+TEST_CASE("Checkpoint load rejects non-checkpoint file", "[engine]") {
+  char no_json[]{""};
+  Config empty_cfg(no_json);
+  Engine engine(empty_cfg);
+  REQUIRE(engine.load_checkpoint("tests/cli_jsons/general.json") == -1);
+  REQUIRE(engine.load_checkpoint("tests/does_not_exist.chk") == -1);
+  REQUIRE(engine.get_num_bodies() == 0);
+}
+
+TEST_CASE("Checkpoint load rejects impossible body counts", "[engine]") {
+  char file_name[]{"tests/cli_jsons/general.json"};
+  Config cfg(file_name);
+  REQUIRE(cfg.initialize() == 0);
+  Engine engine(cfg);
+  REQUIRE(engine.save_checkpoint("tests/corrupt_test.chk") == 0);
+
+  /*
+   * The body count follows the 8 byte magic
+   * and the 4 byte version.
+   */
+  for (std::size_t bad_count : {std::size_t{1} << 40, ~std::size_t{0}, engine.get_num_bodies() + 1}) {
+    std::fstream file("tests/corrupt_test.chk", std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(12);
+    file.write(reinterpret_cast<const char*>(&bad_count), static_cast<std::streamsize>(sizeof(bad_count)));
+    file.close();
+    char no_json[]{""};
+    Config empty_cfg(no_json);
+    Engine loaded(empty_cfg);
+    REQUIRE(loaded.load_checkpoint("tests/corrupt_test.chk") == -1);
+    REQUIRE(loaded.get_num_bodies() == 0);
+  }
+  std::remove("tests/corrupt_test.chk");
+}
+
+TEST_CASE("Engine loads bodies from body file", "[engine]") {
+  BodyFileHeader header{{'H', 'B', 'B', 'O', 'D', 'I', 'E', 'S'}, 1, 0, 1000};
+  std::ofstream file("tests/cli_jsons/generated_bodies.bin", std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (std::uint64_t i = 0; i < 1000; ++i) {
+    float f = static_cast<float>(i % 90) + 5.0f;
+    ConfigSphere sphere{f, f, f, 1.0f, 2.0f, 3.0f, 2.0f, 0.5f};
+    file.write(reinterpret_cast<const char*>(&sphere), sizeof(sphere));
+  }
+  file.close();
+
+  char file_name[]{"tests/cli_jsons/file.json"};
+  Config cfg(file_name);
+  REQUIRE(cfg.initialize() == 0);
+  Engine engine(cfg);
+
+  REQUIRE(engine.get_num_bodies() == 1001);
+  REQUIRE(engine.get_pos().x[0] == 50.0f);
+  for (std::size_t i = 1; i < 1001; ++i) {
+    REQUIRE(engine.get_pos().z[i] == static_cast<float>((i - 1) % 90) + 5.0f);
+    REQUIRE(engine.get_vel().y[i] == 2.0f);
+    REQUIRE(engine.get_mass()[i] == 2.0f);
+  }
+  std::remove("tests/cli_jsons/generated_bodies.bin");
+}
+
+TEST_CASE("Mutual gravity pulls bodies together", "[engine]") {
+  char file_name[]{"tests/cli_jsons/mutual_gravity.json"};
+  Config cfg(file_name);
+  REQUIRE(cfg.initialize() == 0);
+  Engine engine(cfg);
+
+  engine.update(0.0f);
+  REQUIRE(engine.get_force().x[0] == Approx(6.0f / 100.0f));
+  REQUIRE(engine.get_force().x[1] == Approx(-6.0f / 100.0f));
+  REQUIRE(engine.get_force().y[0] == Approx(0.0f));
+  REQUIRE(engine.get_force().z[1] == Approx(0.0f));
+}
+
+TEST_CASE("Reordering bodies keeps their external IDs", "[engine]") {
+  /*
+   * Bodies fall without touching each other,
+   * so every body must move exactly as it
+   * would without reordering.
+   */
+  char file_name[]{"tests/cli_jsons/reorder.json"};
+  Config cfg(file_name);
+  REQUIRE(cfg.initialize() == 0);
+  REQUIRE(cfg.reorder_interval == 2);
+  cfg.reorder_interval = 0;
+  Engine original(cfg);
+  {
+    cfg.reorder_interval = 2;
+    Engine reordered(cfg, "tests/reorder_test.rec");
+    for (int i = 0; i < 5; ++i) {
+      reordered.update(0.01f);
+      original.update(0.01f);
+    }
+
+    const auto& ids = reordered.get_ids();
+    std::vector<bool> seen(ids.size(), false);
+    bool moved = false;
+    for (std::size_t i = 0; i < reordered.get_num_bodies(); ++i) {
+      REQUIRE(!seen[ids[i]]);
+      seen[ids[i]] = true;
+      moved |= ids[i] != i;
+      REQUIRE(reordered.get_pos().x[i] == original.get_pos().x[ids[i]]);
+      REQUIRE(reordered.get_pos().y[i] == original.get_pos().y[ids[i]]);
+      REQUIRE(reordered.get_vel().y[i] == original.get_vel().y[ids[i]]);
+      REQUIRE(reordered.get_force().y[i] == original.get_force().y[ids[i]]);
+    }
+    REQUIRE(moved);
+  }
+
+  /*
+   * The recording lists bodies by external ID.
+   */
+  Engine playback("tests/reorder_test.rec");
+  for (int i = 0; i < 4; ++i) playback.update(0.01f);
+  for (std::size_t i = 0; i < original.get_num_bodies(); ++i) {
+    REQUIRE(playback.get_pos().x[i] == original.get_pos().x[i]);
+    REQUIRE(playback.get_pos().y[i] == original.get_pos().y[i]);
+  }
+  std::remove("tests/reorder_test.rec");
+}
+
+TEST_CASE("Unpaced playback reaches the end of a recording", "[engine]") {
+  char file_name[]{"tests/cli_jsons/mutual_gravity.json"};
+  Config cfg(file_name);
+  REQUIRE(cfg.initialize() == 0);
+  {
+    Engine recorded(cfg, "tests/export_test.rec");
+    for (int i = 0; i < 7; ++i) recorded.update(0.5f);
+  }
+
+  /*
+   * Each recorded tick is half a second long, so
+   * paced playback would take seconds to get here.
+   */
+  Engine playback("tests/export_test.rec");
+  playback.pace_playback = false;
+  std::size_t frames = 1;
+  for (; frames < 100; ++frames) {
+    playback.update(0.0f);
+    if (playback.playback_ended()) break;
+  }
+  REQUIRE(frames == 7);
+  std::remove("tests/export_test.rec");
+}
+
+TEST_CASE("Decimated recordings interpolate between kept ticks", "[engine]") {
+  char file_name[]{"tests/cli_jsons/friction.json"};
+  Config cfg(file_name);
+  REQUIRE(cfg.initialize() == 0);
+  REQUIRE(cfg.record_interval == 1);
+  {
+    Engine full(cfg, "tests/full_test.rec");
+    cfg.record_interval = 4;
+    Engine decimated(cfg, "tests/decimated_test.rec");
+    for (int i = 0; i < 13; ++i) {
+      full.update(0.01f);
+      decimated.update(0.01f);
+    }
+  }
+  std::ifstream full_file("tests/full_test.rec", std::ios::binary | std::ios::ate);
+  std::ifstream decimated_file("tests/decimated_test.rec", std::ios::binary | std::ios::ate);
+  REQUIRE(decimated_file.tellg() * 3 < full_file.tellg());
+
+  /*
+   * The decimated recording keeps ticks 4, 8 and
+   * 12, and then 13, where the run stopped.
+   * Stepping through it tick by tick should land
+   * exactly on those, and close to the full
+   * recording in between.
+   */
+  Engine full("tests/full_test.rec");
+  Engine decimated("tests/decimated_test.rec");
+  full.pace_playback = false;
+  decimated.pace_playback = false;
+  for (int i = 0; i < 3; ++i) full.update(0.0f);
+  for (int step = 0; step <= 9; ++step) {
+    REQUIRE(!decimated.playback_ended());
+    for (std::size_t i = 0; i < full.get_num_bodies(); ++i) {
+      if (step % 4 == 0 || step == 9) {
+	REQUIRE(decimated.get_pos().x[i] == full.get_pos().x[i]);
+	REQUIRE(decimated.get_ang_pos().z[i] == full.get_ang_pos().z[i]);
+      }
+      REQUIRE(decimated.get_pos().x[i] == Approx(full.get_pos().x[i]).margin(1e-3));
+      REQUIRE(decimated.get_pos().y[i] == Approx(full.get_pos().y[i]).margin(1e-3));
+      const float dot = decimated.get_ang_pos().w[i] * full.get_ang_pos().w[i] + decimated.get_ang_pos().x[i] * full.get_ang_pos().x[i] +
+	decimated.get_ang_pos().y[i] * full.get_ang_pos().y[i] + decimated.get_ang_pos().z[i] * full.get_ang_pos().z[i];
+      REQUIRE(std::fabs(dot) == Approx(1.0f).margin(1e-4));
+    }
+    full.update(0.0f);
+    decimated.update(0.0f);
+  }
+  REQUIRE(decimated.playback_ended());
+  REQUIRE(full.playback_ended());
+  REQUIRE(full.get_ang_pos().z[0] != 0.0f);
+  std::remove("tests/full_test.rec");
+  std::remove("tests/decimated_test.rec");
+}
+
+TEST_CASE("Playback rejects files that aren't recordings", "[engine]") {
+  Engine playback("tests/cli_jsons/friction.json");
+  REQUIRE(playback.playback_ended());
+  REQUIRE(playback.get_num_bodies() == 0);
+}
+
+TEST_CASE("Bodies can be added and removed by ID", "[engine]") {
+  char file_name[]{"tests/cli_jsons/mutual_gravity.json"};
+  Config cfg(file_name);
+  REQUIRE(cfg.initialize() == 0);
+  Engine engine(cfg);
+
+  std::vector<unsigned int> new_ids;
+  std::vector<ConfigSphere> bodies;
+  for (int i = 0; i < 3; ++i) bodies.push_back(ConfigSphere{10.0f * static_cast<float>(i), 20.0f, 20.0f, 0.0f, 0.0f, 0.0f, static_cast<float>(i + 10), 1.0f});
+  REQUIRE(engine.add_bodies(bodies, new_ids) == 0);
+  REQUIRE(new_ids == std::vector<unsigned int>{2, 3, 4});
+  REQUIRE(engine.get_num_bodies() == 5);
+
+  /*
+   * A bad ID leaves the engine untouched.
+   */
+  REQUIRE(engine.remove_bodies({0, 7}) == -1);
+  REQUIRE(engine.remove_bodies({3, 3}) == -1);
+  REQUIRE(engine.get_num_bodies() == 5);
+
+  REQUIRE(engine.remove_bodies({0, 3}) == 0);
+  REQUIRE(engine.get_num_bodies() == 3);
+  const float expected_mass[] = {2.0f, 3.0f, 10.0f, 11.0f, 12.0f};
+  std::vector<unsigned int> remaining;
+  for (std::size_t i = 0; i < engine.get_num_bodies(); ++i) {
+    REQUIRE(engine.get_mass()[i] == expected_mass[engine.get_ids()[i]]);
+    remaining.push_back(engine.get_ids()[i]);
+  }
+  std::sort(remaining.begin(), remaining.end());
+  REQUIRE(remaining == std::vector<unsigned int>{1, 2, 4});
+
+  /*
+   * Freed IDs are handed out again, and the
+   * body survives a checkpoint.
+   */
+  REQUIRE(engine.add_bodies({ConfigSphere{50.0f, 50.0f, 50.0f, 0.0f, 0.0f, 0.0f, 7.0f, 1.0f}}, new_ids) == 0);
+  REQUIRE((new_ids[0] == 0 || new_ids[0] == 3));
+  REQUIRE(engine.save_checkpoint("tests/add_remove_test.chk") == 0);
+  char no_json[]{""};
+  Config empty_cfg(no_json);
+  Engine resumed(empty_cfg);
+  REQUIRE(resumed.load_checkpoint("tests/add_remove_test.chk") == 0);
+  REQUIRE_SAME_STATE(engine, resumed);
+  REQUIRE(resumed.get_ids() == engine.get_ids());
+  std::remove("tests/add_remove_test.chk");
+}
+
+TEST_CASE("Steady body churn keeps aligned storage in place", "[engine]") {
+  char file_name[]{"tests/cli_jsons/mutual_gravity.json"};
+  Config cfg(file_name);
+  REQUIRE(cfg.initialize() == 0);
+  Engine engine(cfg);
+
+  std::vector<unsigned int> new_ids;
+  std::vector<ConfigSphere> bodies(100, ConfigSphere{50.0f, 50.0f, 50.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.1f});
+  REQUIRE(engine.add_bodies(bodies, new_ids) == 0);
+  REQUIRE(engine.remove_bodies(new_ids) == 0);
+  const float* data = engine.get_pos().x.data();
+  REQUIRE(reinterpret_cast<std::uintptr_t>(data) % 32 == 0);
+  for (int i = 0; i < 50; ++i) {
+    REQUIRE(engine.add_bodies(bodies, new_ids) == 0);
+    REQUIRE(reinterpret_cast<std::uintptr_t>(engine.get_vel().z.data()) % 32 == 0);
+    REQUIRE(engine.remove_bodies(new_ids) == 0);
+    engine.update(0.001f);
+  }
+  REQUIRE(engine.get_num_bodies() == 2);
+  REQUIRE(engine.get_pos().x.data() == data);
+}
+
+TEST_CASE("Friction makes sliding spheres roll", "[engine]") {
+  /*
+   * A sphere sliding on the floor slows down
+   * and spins up until it rolls, at 5/7 of
+   * its initial speed.
+   */
+  char file_name[]{"tests/cli_jsons/friction.json"};
+  Config cfg(file_name);
+  REQUIRE(cfg.initialize() == 0);
+  REQUIRE(cfg.friction == 0.5f);
+  Engine engine(cfg);
+  for (int i = 0; i < 100; ++i) engine.update(0.01f);
+
+  const auto& q = engine.get_ang_pos();
+  for (std::size_t i = 0; i < engine.get_num_bodies(); ++i) {
+    REQUIRE(engine.get_vel().x[i] == Approx(5.0f * 5.0f / 7.0f).epsilon(0.02));
+    REQUIRE(engine.get_ang_vel().z[i] == Approx(-engine.get_vel().x[i]).epsilon(0.01));
+    REQUIRE(engine.get_ang_vel().x[i] == Approx(0.0f));
+    REQUIRE(q.w[i] * q.w[i] + q.x[i] * q.x[i] + q.y[i] * q.y[i] + q.z[i] * q.z[i] == Approx(1.0f).epsilon(1e-5));
+    REQUIRE(fabsf(q.z[i]) > 0.1f);
+    REQUIRE(q.x[i] == Approx(0.0f));
+  }
+}
+
+TEST_CASE("Collision results don't depend on the number of threads", "[engine]") {
+  /*
+   * Bodies overlap all over the random scene,
+   * and broadphase chunks are split by cost,
+   * but collisions must still be resolved in
+   * the same order however many threads split
+   * the work.
+   */
+  char file_name[]{"tests/cli_jsons/random.json"};
+  Config cfg(file_name);
+  REQUIRE(cfg.initialize() == 0);
+  const int max_threads = omp_get_max_threads();
+  for (bool loose_octree : {false, true}) {
+    cfg.loose_octree = loose_octree;
+    Engine many(cfg), one(cfg);
+    omp_set_num_threads(std::max(max_threads, 4));
+    for (int i = 0; i < 50; ++i) many.update(0.01f);
+    omp_set_num_threads(1);
+    for (int i = 0; i < 50; ++i) one.update(0.01f);
+    omp_set_num_threads(max_threads);
+    REQUIRE_SAME_STATE(many, one);
+  }
+}
+
+TEST_CASE("Fast spheres don't tunnel with continuous collision detection", "[engine]") {
+  /*
+   * In one tick, the first two spheres pass
+   * right through each other, and the third
+   * goes 10 past the floor.
+   */
+  char file_name[]{"tests/cli_jsons/ccd.json"};
+  Config cfg(file_name);
+  REQUIRE(cfg.initialize() == 0);
+  REQUIRE(cfg.ccd_speed == 10.0f);
+  for (bool loose_octree : {false, true}) {
+    cfg.loose_octree = loose_octree;
+    Engine swept(cfg);
+    swept.update(0.15f);
+    REQUIRE(swept.get_pos().x[0] < swept.get_pos().x[1]);
+    REQUIRE(swept.get_vel().x[0] == Approx(-100.0f));
+    REQUIRE(swept.get_vel().x[1] == Approx(100.0f));
+    REQUIRE(swept.get_pos().y[2] == Approx(11.0f));
+    REQUIRE(swept.get_vel().y[2] == Approx(100.0f));
+  }
+
+  cfg.ccd_speed = 0.0f;
+  Engine discrete(cfg);
+  discrete.update(0.15f);
+  REQUIRE(discrete.get_pos().x[0] > discrete.get_pos().x[1]);
+  REQUIRE(discrete.get_vel().x[0] == Approx(100.0f));
+  REQUIRE(discrete.get_pos().y[2] == Approx(0.5f));
+}
+
+TEST_CASE("Adaptive substepping keeps fast bodies to a fraction of their radius per tick", "[engine]") {
+  /*
+   * Every body keeps moving at 100 (collisions
+   * are elastic), and the smallest radius is
+   * 0.5, so with a CFL number of 0.5 a tick
+   * can be at most 0.0025 long.
+   */
+  char file_name[]{"tests/cli_jsons/ccd.json"};
+  Config cfg(file_name);
+  REQUIRE(cfg.initialize() == 0);
+  REQUIRE(cfg.max_ticks_per_frame == 64);
+  cfg.cfl = 0.5f;
+  {
+    Engine engine(cfg);
+    const std::size_t ticks = engine.advance(0.1f);
+    REQUIRE(ticks >= 40);
+    REQUIRE(ticks <= 41);
+    REQUIRE(engine.get_frame_ticks() == ticks);
+    REQUIRE(engine.get_frame_step() == Approx(0.1f / static_cast<float>(ticks)));
+  }
+  {
+    cfg.max_ticks_per_frame = 16;
+    Engine engine(cfg);
+    REQUIRE(engine.advance(0.1f) == 16);
+  }
+  {
+    cfg.cfl = 1000.0f;
+    cfg.ticks_per_frame = 2;
+    Engine engine(cfg);
+    REQUIRE(engine.advance(0.1f) == 2);
+  }
+  {
+    cfg.cfl = 0.0f;
+    cfg.ticks_per_frame = 3;
+    Engine engine(cfg);
+    REQUIRE(engine.advance(0.1f) == 3);
+    REQUIRE(engine.get_frame_step() == Approx(0.1f / 3.0f));
+  }
+}
+
+TEST_CASE("Stats count collision work on counted ticks", "[engine]") {
+  /*
+   * In the first tick, the first two spheres
+   * collide and the third hits the floor.
+   */
+  char file_name[]{"tests/cli_jsons/ccd.json"};
+  Config cfg(file_name);
+  REQUIRE(cfg.initialize() == 0);
+  for (bool loose_octree : {false, true}) {
+    cfg.loose_octree = loose_octree;
+    Engine counted(cfg), plain(cfg);
+    REQUIRE(counted.set_stats("tests/stats_test.csv", 2) == 0);
+    for (int i = 0; i < 3; ++i) {
+      counted.update(0.15f);
+      plain.update(0.15f);
+      if (i == 0) {
+	const TickStats& stats = counted.get_tick_stats();
+	REQUIRE(stats.tick == 0);
+	REQUIRE(stats.octree.nodes >= 1);
+	REQUIRE(stats.octree.leaf_bodies <= 3);
+	REQUIRE(stats.candidate_pairs >= 1);
+	REQUIRE(stats.narrowphase_tests == stats.candidate_pairs + 18);
+	REQUIRE(stats.contacts == 1);
+	REQUIRE(stats.wall_hits == 1);
+	REQUIRE(stats.max_penetration > 0.0f);
+      }
+    }
+    REQUIRE(counted.get_tick_stats().tick == 2);
+    REQUIRE_SAME_STATE(counted, plain);
+
+    std::ifstream csv("tests/stats_test.csv");
+    std::string line;
+    std::vector<std::string> lines;
+    while (std::getline(csv, line)) lines.push_back(line);
+    REQUIRE(lines.size() == 3);
+    REQUIRE(lines[0].rfind("tick,octree_nodes,", 0) == 0);
+    REQUIRE(lines[1].rfind("0,", 0) == 0);
+    REQUIRE(lines[2].rfind("2,", 0) == 0);
+  }
+  std::remove("tests/stats_test.csv");
+
+  Engine engine(cfg);
+  REQUIRE(engine.set_stats("tests/stats_test.jsonl", 1) == 0);
+  engine.update(0.15f);
+  std::ifstream jsonl("tests/stats_test.jsonl");
+  std::string line;
+  REQUIRE(std::getline(jsonl, line));
+  REQUIRE(line.rfind("{\"tick\": 0, \"octree_nodes\": ", 0) == 0);
+  REQUIRE(line.find("\"contacts\": 1,") != std::string::npos);
+  std::remove("tests/stats_test.jsonl");
+
+  REQUIRE(engine.set_stats("tests/stats_test.csv", 0) == -1);
+  REQUIRE(engine.set_stats("tests/missing_directory/stats.csv", 1) == -1);
+}
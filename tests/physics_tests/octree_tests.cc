@@ -0,0 +1,277 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#include "catch2/catch.hpp"
+#include <algorithm>
+#include <iostream>
+#include <set>
+#include <vector>
+
+#include <math.h>
+#include <omp.h>
+
+#include "../../include/physics/octree.h"
+#include "../../include/random.h"
+
+struct PointCloud {
+  std::vector<float> x, y, z, m;
+};
+
+PointCloud make_point_cloud(std::size_t n, std::uint64_t seed);
+void brute_force_gravity(const PointCloud& cloud, unsigned int id, float softening, float& ax, float& ay, float& az);
+
+PointCloud make_point_cloud(std::size_t n, std::uint64_t seed) {
+  PointCloud cloud;
+  for (std::size_t i = 0; i < n; ++i) {
+    Philox4x32 rnd = philox4x32(i, 0, seed);
+    cloud.x.push_back(100.0f * uniform_float(rnd.v[0]));
+    cloud.y.push_back(100.0f * uniform_float(rnd.v[1]));
+    cloud.z.push_back(100.0f * uniform_float(rnd.v[2]));
+    cloud.m.push_back(1.0f + uniform_float(rnd.v[3]));
+  }
+  return cloud;
+}
+
+void brute_force_gravity(const PointCloud& cloud, unsigned int id, float softening, float& ax, float& ay, float& az) {
+  double sx = 0.0, sy = 0.0, sz = 0.0;
+  for (unsigned int j = 0; j < cloud.x.size(); ++j) {
+    if (j == id) continue;
+    double dx = cloud.x[j] - cloud.x[id], dy = cloud.y[j] - cloud.y[id], dz = cloud.z[j] - cloud.z[id];
+    double d2 = dx * dx + dy * dy + dz * dz + softening * softening;
+    double f = cloud.m[j] / (d2 * sqrt(d2));
+    sx += dx * f;
+    sy += dy * f;
+    sz += dz * f;
+  }
+  ax = static_cast<float>(sx);
+  ay = static_cast<float>(sy);
+  az = static_cast<float>(sz);
+}
+
+TEST_CASE("Barnes-Hut with zero opening angle is exact", "[octree]") {
+  PointCloud cloud = make_point_cloud(500, 1);
+  Octree octree(AABB{0.0f, 100.0f, 0.0f, 100.0f, 0.0f, 100.0f});
+  for (unsigned int i = 0; i < 500; ++i) octree.insert_point(i, cloud.x[i], cloud.y[i], cloud.z[i]);
+  octree.compute_mass_aggregates(cloud.m.data(), cloud.x.data(), cloud.y.data(), cloud.z.data());
+
+  for (unsigned int i = 0; i < 500; i += 7) {
+    float ax = 0.0f, ay = 0.0f, az = 0.0f, ex = 0.0f, ey = 0.0f, ez = 0.0f;
+    octree.gravity(i, cloud.x[i], cloud.y[i], cloud.z[i], 0.0f, 0.01f, cloud.m.data(), cloud.x.data(), cloud.y.data(), cloud.z.data(), ax, ay, az);
+    brute_force_gravity(cloud, i, 0.01f, ex, ey, ez);
+    REQUIRE(fabsf(ax - ex) <= 1e-3f * (fabsf(ex) + 1e-3f));
+    REQUIRE(fabsf(ay - ey) <= 1e-3f * (fabsf(ey) + 1e-3f));
+    REQUIRE(fabsf(az - ez) <= 1e-3f * (fabsf(ez) + 1e-3f));
+  }
+}
+
+TEST_CASE("Barnes-Hut approximates brute force gravity", "[octree]") {
+  PointCloud cloud = make_point_cloud(5000, 2);
+  Octree octree(AABB{0.0f, 100.0f, 0.0f, 100.0f, 0.0f, 100.0f});
+  for (unsigned int i = 0; i < 5000; ++i) octree.insert_point(i, cloud.x[i], cloud.y[i], cloud.z[i]);
+  octree.compute_mass_aggregates(cloud.m.data(), cloud.x.data(), cloud.y.data(), cloud.z.data());
+
+  for (unsigned int i = 0; i < 5000; i += 97) {
+    float ax = 0.0f, ay = 0.0f, az = 0.0f, ex = 0.0f, ey = 0.0f, ez = 0.0f;
+    octree.gravity(i, cloud.x[i], cloud.y[i], cloud.z[i], 0.5f, 0.01f, cloud.m.data(), cloud.x.data(), cloud.y.data(), cloud.z.data(), ax, ay, az);
+    brute_force_gravity(cloud, i, 0.01f, ex, ey, ez);
+    float err = sqrtf((ax - ex) * (ax - ex) + (ay - ey) * (ay - ey) + (az - ez) * (az - ez));
+    float norm = sqrtf(ex * ex + ey * ey + ez * ez);
+    REQUIRE(err <= 0.05f * norm);
+  }
+}
+
+TEST_CASE("Point insertion handles coincident bodies", "[octree]") {
+  std::vector<float> x(100, 50.0f), y(100, 50.0f), z(100, 50.0f), m(100, 1.0f);
+  x.push_back(0.0f);
+  y.push_back(50.0f);
+  z.push_back(50.0f);
+  m.push_back(1.0f);
+  Octree octree(AABB{0.0f, 100.0f, 0.0f, 100.0f, 0.0f, 100.0f});
+  for (unsigned int i = 0; i < 101; ++i) octree.insert_point(i, x[i], y[i], z[i]);
+  octree.compute_mass_aggregates(m.data(), x.data(), y.data(), z.data());
+
+  /*
+   * The pile of 100 bodies must pull on the
+   * lone body as a mass of 100 at distance 50.
+   */
+  float ax = 0.0f, ay = 0.0f, az = 0.0f;
+  octree.gravity(100, x[100], y[100], z[100], 0.5f, 0.0f, m.data(), x.data(), y.data(), z.data(), ax, ay, az);
+  REQUIRE(fabsf(ax - 100.0f / 2500.0f) < 1e-4f);
+  REQUIRE(fabsf(ay) < 1e-6f);
+  REQUIRE(fabsf(az) < 1e-6f);
+}
+
+std::vector<AABB> make_sphere_aabbs(std::size_t n, std::uint64_t seed);
+
+std::vector<AABB> make_sphere_aabbs(std::size_t n, std::uint64_t seed) {
+  std::vector<AABB> aabbs;
+  for (std::size_t i = 0; i < n; ++i) {
+    Philox4x32 rnd = philox4x32(i, 1, seed);
+    float x = 100.0f * uniform_float(rnd.v[0]);
+    float y = 100.0f * uniform_float(rnd.v[1]);
+    float z = 100.0f * uniform_float(rnd.v[2]);
+    float r = 0.5f + 2.5f * uniform_float(rnd.v[3]);
+    aabbs.push_back(AABB{x - r, x + r, y - r, y + r, z - r, z + r});
+  }
+  return aabbs;
+}
+
+TEST_CASE("Loose octree finds every overlap exactly once", "[octree]") {
+  std::vector<AABB> aabbs = make_sphere_aabbs(3000, 3);
+  LooseOctree octree(AABB{0.0f, 100.0f, 0.0f, 100.0f, 0.0f, 100.0f});
+  for (unsigned int i = 0; i < aabbs.size(); ++i) octree.insert(i, aabbs[i]);
+
+  std::vector<unsigned int> dest;
+  for (unsigned int i = 0; i < aabbs.size(); ++i) {
+    dest.clear();
+    octree.possibilities(i, aabbs[i], dest);
+    std::unordered_set<unsigned int> unique(dest.begin(), dest.end());
+    REQUIRE(unique.size() == dest.size());
+    for (unsigned int j = i + 1; j < aabbs.size(); ++j) {
+      const AABB& a = aabbs[i];
+      const AABB& b = aabbs[j];
+      bool overlaps = a.x1 <= b.x2 && b.x1 <= a.x2 && a.y1 <= b.y2 && b.y1 <= a.y2 && a.z1 <= b.z2 && b.z1 <= a.z2;
+      if (overlaps) REQUIRE(unique.count(j));
+    }
+  }
+}
+
+TEST_CASE("Loose octree stores bodies on split planes once", "[octree]") {
+  /*
+   * 4096 spheres sitting on the root's split
+   * planes make the regular octree copy each
+   * of them into several children.
+   */
+  Octree octree(AABB{0.0f, 100.0f, 0.0f, 100.0f, 0.0f, 100.0f});
+  LooseOctree loose_octree(AABB{0.0f, 100.0f, 0.0f, 100.0f, 0.0f, 100.0f});
+  for (unsigned int i = 0; i < 4096; ++i) {
+    float t = static_cast<float>(i % 64) * 1.5f + 2.0f;
+    float u = static_cast<float>(i / 64) * 1.5f + 2.0f;
+    AABB aabb = i % 2 ? AABB{49.5f, 50.5f, t - 0.5f, t + 0.5f, u - 0.5f, u + 0.5f} : AABB{t - 0.5f, t + 0.5f, 49.5f, 50.5f, u - 0.5f, u + 0.5f};
+    octree.insert(i, aabb);
+    loose_octree.insert(i, aabb);
+  }
+  REQUIRE(loose_octree.num_nodes() < octree.num_nodes());
+
+  std::vector<unsigned int> dest;
+  loose_octree.possibilities(0, AABB{0.0f, 100.0f, 0.0f, 100.0f, 0.0f, 100.0f}, dest);
+  REQUIRE(dest.size() == 4095);
+}
+
+TEST_CASE("Octree queries return exactly the overlapping bodies", "[octree]") {
+  /*
+   * Besides random spheres, pile 40 identical
+   * boxes on top of each other, which fill
+   * nodes all the way down to the maximum
+   * depth.
+   */
+  std::vector<AABB> aabbs = make_sphere_aabbs(2000, 5);
+  for (unsigned int i = 0; i < 40; ++i) aabbs.push_back(AABB{10.0f, 11.0f, 10.0f, 11.0f, 10.0f, 11.0f});
+  Octree octree(AABB{0.0f, 100.0f, 0.0f, 100.0f, 0.0f, 100.0f});
+  for (unsigned int i = 0; i < aabbs.size(); ++i) octree.insert(i, aabbs[i]);
+
+  std::unordered_set<unsigned int> dest;
+  for (unsigned int i = 0; i < aabbs.size(); ++i) {
+    dest.clear();
+    octree.possibilities(i, aabbs[i], dest);
+    std::size_t expected = 0;
+    for (unsigned int j = i + 1; j < aabbs.size(); ++j) {
+      const AABB& a = aabbs[i];
+      const AABB& b = aabbs[j];
+      bool overlaps = a.x1 <= b.x2 && b.x1 <= a.x2 && a.y1 <= b.y2 && b.y1 <= a.y2 && a.z1 <= b.z2 && b.z1 <= a.z2;
+      if (overlaps) {
+	REQUIRE(dest.count(j));
+	++expected;
+      }
+    }
+    REQUIRE(dest.size() == expected);
+  }
+}
+
+TEST_CASE("Octree pairs enumerate every overlap exactly once", "[octree]") {
+  /*
+   * Include bodies sticking out of the root,
+   * bodies on split planes and a pile deep
+   * enough to need overflow nodes.
+   */
+  std::vector<AABB> aabbs = make_sphere_aabbs(3000, 7);
+  for (unsigned int i = 0; i < 40; ++i) aabbs.push_back(AABB{10.0f, 11.0f, 10.0f, 11.0f, 10.0f, 11.0f});
+  for (unsigned int i = 0; i < 40; ++i) aabbs.push_back(AABB{49.0f, 51.0f, 24.0f + static_cast<float>(i), 26.0f + static_cast<float>(i), 50.0f, 50.0f});
+  aabbs.push_back(AABB{-5.0f, 1.0f, -5.0f, 1.0f, -5.0f, 1.0f});
+  aabbs.push_back(AABB{-4.0f, 2.0f, -4.0f, 2.0f, -4.0f, 2.0f});
+  aabbs.push_back(AABB{99.0f, 105.0f, 99.0f, 105.0f, 99.0f, 105.0f});
+  aabbs.push_back(AABB{98.0f, 104.0f, 98.0f, 104.0f, 98.0f, 104.0f});
+  Octree octree(AABB{0.0f, 100.0f, 0.0f, 100.0f, 0.0f, 100.0f});
+  for (unsigned int i = 0; i < aabbs.size(); ++i) octree.insert(i, aabbs[i]);
+
+  std::set<std::pair<unsigned int, unsigned int>> expected;
+  for (unsigned int i = 0; i < aabbs.size(); ++i) {
+    for (unsigned int j = i + 1; j < aabbs.size(); ++j) {
+      const AABB& a = aabbs[i];
+      const AABB& b = aabbs[j];
+      if (a.x1 <= b.x2 && b.x1 <= a.x2 && a.y1 <= b.y2 && b.y1 <= a.y2 && a.z1 <= b.z2 && b.z1 <= a.z2) expected.emplace(i, j);
+    }
+  }
+
+  auto pairs = octree.pairs();
+  std::set<std::pair<unsigned int, unsigned int>> unique(pairs.begin(), pairs.end());
+  REQUIRE(unique.size() == pairs.size());
+  REQUIRE(unique == expected);
+
+  /*
+   * Collisions are resolved in the order of
+   * the pairs, so the order must not depend
+   * on how threads split the work.
+   */
+  const int max_threads = omp_get_max_threads();
+  omp_set_num_threads(1);
+  const auto serial_pairs = octree.pairs();
+  omp_set_num_threads(std::max(max_threads, 4));
+  for (int run = 0; run < 5; ++run) REQUIRE(octree.pairs() == serial_pairs);
+  omp_set_num_threads(max_threads);
+}
+
+TEST_CASE("Tree shapes count nodes, depth and leaf bodies", "[octree]") {
+  Octree empty(AABB{0.0f, 100.0f, 0.0f, 100.0f, 0.0f, 100.0f});
+  OctreeShape shape = empty.shape();
+  REQUIRE(shape.nodes == 1);
+  REQUIRE(shape.max_depth == 0);
+  REQUIRE(shape.leaves == 1);
+  REQUIRE(shape.leaf_bodies == 0);
+
+  /*
+   * Nodes keep their first NODE_SIZE bodies
+   * when they split, so leaves above the
+   * maximum depth never hold more than that.
+   */
+  std::vector<AABB> aabbs = make_sphere_aabbs(3000, 11);
+  Octree octree(AABB{0.0f, 100.0f, 0.0f, 100.0f, 0.0f, 100.0f});
+  LooseOctree loose_octree(AABB{0.0f, 100.0f, 0.0f, 100.0f, 0.0f, 100.0f});
+  for (unsigned int i = 0; i < aabbs.size(); ++i) {
+    octree.insert(i, aabbs[i]);
+    loose_octree.insert(i, aabbs[i]);
+  }
+  shape = octree.shape();
+  REQUIRE(shape.nodes == octree.num_nodes());
+  REQUIRE(shape.max_depth > 0);
+  REQUIRE(shape.max_depth < MAX_DEPTH);
+  REQUIRE(shape.max_leaf_bodies > 0);
+  REQUIRE(shape.max_leaf_bodies <= NODE_SIZE);
+  REQUIRE(shape.leaf_bodies >= shape.max_leaf_bodies);
+  REQUIRE(shape.leaves % 7 == 1);
+
+  shape = loose_octree.shape();
+  REQUIRE(shape.nodes == loose_octree.num_nodes());
+  REQUIRE(shape.max_depth > 0);
+  REQUIRE(shape.leaf_bodies <= aabbs.size());
+  REQUIRE(shape.leaves % 7 == 1);
+}
@@ -164,4 +164,31 @@ TEST_CASE("Quaternion to matrix 2", "[quaternion]"){
   REQUIRE(smallDiff(m.arr[6], -0.333333f));
   REQUIRE(smallDiff(m.arr[7], 0.6666667f));
   REQUIRE(smallDiff(m.arr[8], 0.6666667f));
-}
\ No newline at end of file
+}
+TEST_CASE("Quaternion slerp halves a rotation", "[quaternion]"){
+  /*
+   * Halfway between no rotation and a quarter
+   * turn about z is an eighth turn about z.
+   */
+  const float s = sqrtf(0.5f);
+  Quaternion a = {1.0f, 0.0f, 0.0f, 0.0f};
+  Quaternion b = {s, 0.0f, 0.0f, s};
+  Quaternion q = Quaternion::slerp(a, b, 0.5f);
+  REQUIRE(smallDiff(q.w, cosf(static_cast<float>(M_PI) / 8.0f)));
+  REQUIRE(smallDiff(q.x, 0.0f));
+  REQUIRE(smallDiff(q.y, 0.0f));
+  REQUIRE(smallDiff(q.z, sinf(static_cast<float>(M_PI) / 8.0f)));
+
+  Quaternion end = Quaternion::slerp(a, b, 1.0f);
+  REQUIRE(smallDiff(end.w, s));
+  REQUIRE(smallDiff(end.z, s));
+}
+
+TEST_CASE("Quaternion slerp takes the shorter arc", "[quaternion]"){
+  const float s = sqrtf(0.5f);
+  Quaternion a = {1.0f, 0.0f, 0.0f, 0.0f};
+  Quaternion b = {-s, 0.0f, 0.0f, -s};
+  Quaternion q = Quaternion::slerp(a, b, 0.5f);
+  REQUIRE(smallDiff(q.w, cosf(static_cast<float>(M_PI) / 8.0f)));
+  REQUIRE(smallDiff(q.z, sinf(static_cast<float>(M_PI) / 8.0f)));
+}
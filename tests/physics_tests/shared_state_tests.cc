@@ -0,0 +1,219 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#include "catch2/catch.hpp"
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../../include/physics/shared_state.h"
+#include "../../include/physics/engine.h"
+
+static std::string shared_state_name(const char *test) {
+  return "/hummingbird_test_" + std::string(test) + "_" + std::to_string(getpid());
+}
+
+/*
+ * Publish n bodies whose every value is
+ * value, plus the array index.
+ */
+static int publish_filled(SharedStatePublisher &publisher, const std::uint64_t tick, const std::size_t n, const float value) {
+  std::vector<std::vector<float>> data(NUM_SHARED_STATE_ARRAYS);
+  const float *arrays[NUM_SHARED_STATE_ARRAYS];
+  for (std::size_t a = 0; a < NUM_SHARED_STATE_ARRAYS; ++a) {
+    data[a].assign(n, value + static_cast<float>(a));
+    arrays[a] = data[a].data();
+  }
+  std::vector<std::uint32_t> rows(n);
+  std::iota(rows.begin(), rows.end(), 0u);
+  return publisher.publish(tick, n, arrays, rows.data(), rows.data());
+}
+
+TEST_CASE("Readers see the latest published snapshot", "[shared_state]") {
+  const std::string name = shared_state_name("latest");
+  SharedStatePublisher publisher;
+  REQUIRE(publisher.open(name, 10) == 0);
+
+  SharedStateReader reader;
+  REQUIRE(reader.open(name) == 0);
+  std::uint64_t sequence;
+  REQUIRE(reader.begin_read(sequence) == nullptr);
+
+  for (std::uint64_t tick = 1; tick <= 6; ++tick) {
+    REQUIRE(publish_filled(publisher, tick, 10, 100.0f * static_cast<float>(tick)) == 0);
+    const SharedStateSlot *slot = reader.begin_read(sequence);
+    REQUIRE(slot != nullptr);
+    REQUIRE(slot->tick == tick);
+    REQUIRE(slot->num_bodies == 10);
+    for (std::size_t a = 0; a < NUM_SHARED_STATE_ARRAYS; ++a) {
+      const float *values = reader.array(slot, static_cast<SharedStateArray>(a));
+      for (std::size_t i = 0; i < 10; ++i) REQUIRE(values[i] == 100.0f * static_cast<float>(tick) + static_cast<float>(a));
+    }
+    REQUIRE(reader.end_read(slot, sequence));
+  }
+  REQUIRE(!reader.retired());
+}
+
+TEST_CASE("Publishers move to a bigger object when worlds grow", "[shared_state]") {
+  const std::string name = shared_state_name("grow");
+  SharedStatePublisher publisher;
+  REQUIRE(publisher.open(name, 4) == 0);
+  SharedStateReader reader;
+  REQUIRE(reader.open(name) == 0);
+
+  REQUIRE(publish_filled(publisher, 1, 1000, 1.0f) == 0);
+  REQUIRE(reader.retired());
+  REQUIRE(reader.open(name) == 0);
+  REQUIRE(!reader.retired());
+  std::uint64_t sequence;
+  const SharedStateSlot *slot = reader.begin_read(sequence);
+  REQUIRE(slot != nullptr);
+  REQUIRE(slot->num_bodies == 1000);
+  REQUIRE(reader.array(slot, ANG_POS_Z)[999] == 10.0f);
+  REQUIRE(reader.end_read(slot, sequence));
+}
+
+TEST_CASE("Readers never accept torn snapshots", "[shared_state]") {
+  const std::string name = shared_state_name("torn");
+  SharedStatePublisher publisher;
+  REQUIRE(publisher.open(name, 4096) == 0);
+  SharedStateReader reader;
+  REQUIRE(reader.open(name) == 0);
+
+  /*
+   * Every snapshot holds a single value, so a
+   * snapshot mixing two publishes shows up as
+   * mismatched values.
+   */
+  std::atomic<bool> done(false);
+  std::thread writer([&]() {
+    for (std::uint64_t tick = 1; tick <= 2000; ++tick) publish_filled(publisher, tick, 4096, static_cast<float>(tick));
+    done = true;
+  });
+  std::size_t accepted = 0, torn = 0;
+  while (!done) {
+    std::uint64_t sequence;
+    const SharedStateSlot *slot = reader.begin_read(sequence);
+    if (!slot) continue;
+    const std::uint64_t tick = slot->tick;
+    const float *values = reader.array(slot, POS_X);
+    bool consistent = true;
+    for (std::size_t i = 0; i < 4096; ++i) consistent &= values[i] == static_cast<float>(tick);
+    if (!reader.end_read(slot, sequence)) continue;
+    ++accepted;
+    if (!consistent) ++torn;
+  }
+  writer.join();
+  REQUIRE(torn == 0);
+  REQUIRE(accepted > 0);
+}
+
+TEST_CASE("Engine publishes its state while it runs", "[shared_state]") {
+  char file_name[]{"tests/cli_jsons/general.json"};
+  Config config(file_name);
+  REQUIRE(config.initialize() == 0);
+  Engine engine(config);
+
+  const std::string name = shared_state_name("engine");
+  REQUIRE(engine.set_publishing(name, 2) == 0);
+  SharedStateReader reader;
+  REQUIRE(reader.open(name) == 0);
+
+  for (std::size_t tick = 0; tick < 5; ++tick) engine.update(0.01f);
+  std::uint64_t sequence;
+  const SharedStateSlot *slot = reader.begin_read(sequence);
+  REQUIRE(slot != nullptr);
+  REQUIRE(slot->tick == 4);
+  REQUIRE(slot->num_bodies == engine.get_num_bodies());
+
+  engine.update(0.01f);
+  slot = reader.begin_read(sequence);
+  REQUIRE(slot != nullptr);
+  REQUIRE(slot->tick == 6);
+  for (std::size_t i = 0; i < engine.get_num_bodies(); ++i) {
+    REQUIRE(reader.ids(slot)[i] == i);
+    REQUIRE(reader.array(slot, POS_Y)[i] == engine.get_pos().y[i]);
+    REQUIRE(reader.array(slot, VEL_Y)[i] == engine.get_vel().y[i]);
+    REQUIRE(reader.array(slot, ANG_POS_W)[i] == engine.get_ang_pos().w[i]);
+  }
+  REQUIRE(reader.end_read(slot, sequence));
+
+  REQUIRE(engine.set_publishing(name, 0) == -1);
+}
+
+/*
+ * Check that each row of the newest snapshot
+ * holds the body its ID says, and that the IDs
+ * are sorted.
+ */
+static void require_rows_match(const SharedStateReader& reader, Engine& engine) {
+  std::uint64_t sequence;
+  const SharedStateSlot *slot = reader.begin_read(sequence);
+  REQUIRE(slot != nullptr);
+  REQUIRE(slot->num_bodies == engine.get_num_bodies());
+  const std::uint32_t *ids = reader.ids(slot);
+  const std::vector<unsigned int> body_ids(ids, ids + slot->num_bodies);
+  REQUIRE(std::is_sorted(body_ids.begin(), body_ids.end()));
+  std::vector<BodyState> states;
+  REQUIRE(engine.get_body_states(body_ids, states) == 0);
+  for (std::size_t k = 0; k < body_ids.size(); ++k) {
+    REQUIRE(reader.array(slot, POS_X)[k] == states[k].x);
+    REQUIRE(reader.array(slot, POS_Y)[k] == states[k].y);
+    REQUIRE(reader.array(slot, VEL_Z)[k] == states[k].vz);
+    REQUIRE(reader.array(slot, ANG_POS_X)[k] == states[k].qx);
+  }
+  REQUIRE(reader.end_read(slot, sequence));
+}
+
+TEST_CASE("Snapshots list bodies by ID as the engine shuffles them", "[shared_state]") {
+  char file_name[]{"tests/cli_jsons/reorder.json"};
+  Config config(file_name);
+  REQUIRE(config.initialize() == 0);
+  REQUIRE(config.reorder_interval == 2);
+  Engine engine(config);
+
+  const std::string name = shared_state_name("ids");
+  REQUIRE(engine.set_publishing(name, 1) == 0);
+  SharedStateReader reader;
+  REQUIRE(reader.open(name) == 0);
+
+  /*
+   * Reordering moves bodies to new indices, and
+   * removing a body moves the last one into its
+   * slot, but a body keeps its row's ID.
+   */
+  for (std::size_t tick = 0; tick < 4; ++tick) engine.update(0.01f);
+  require_rows_match(reader, engine);
+  bool shuffled = false;
+  for (std::size_t i = 0; i < engine.get_num_bodies(); ++i) shuffled |= engine.get_ids()[i] != i;
+  REQUIRE(shuffled);
+
+  REQUIRE(engine.remove_bodies({0, 3}) == 0);
+  engine.update(0.01f);
+  require_rows_match(reader, engine);
+  std::uint64_t sequence;
+  const SharedStateSlot *slot = reader.begin_read(sequence);
+  REQUIRE(slot != nullptr);
+  REQUIRE(reader.ids(slot)[0] == 1);
+  REQUIRE(reader.ids(slot)[2] == 4);
+  REQUIRE(reader.end_read(slot, sequence));
+}
+
+TEST_CASE("Readers reject missing shared memory", "[shared_state]") {
+  SharedStateReader reader;
+  REQUIRE(reader.open(shared_state_name("missing")) == -1);
+}
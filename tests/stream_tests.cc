@@ -0,0 +1,244 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#include "catch2/catch.hpp"
+
+#include "../include/stream.h"
+
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * Keeps publishing the engine's (unchanging)
+ * state from another thread, the way a running
+ * simulation would, for as long as it lives.
+ */
+class Publishing {
+public:
+  Publishing(StreamServer &server, const Engine &engine): done(false), thread([&]() {
+    while (!done) {
+      server.publish(engine);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }) {}
+  ~Publishing() {
+    done = true;
+    thread.join();
+  }
+private:
+  std::atomic<bool> done;
+  std::thread thread;
+};
+
+static bool matches(const Engine &viewer, const Engine &engine, const float precision) {
+  std::vector<BodyPose> expected, got;
+  engine.get_poses(expected);
+  viewer.get_poses(got);
+  if (got.size() != expected.size()) return false;
+  for (std::size_t k = 0; k < got.size(); ++k) {
+    if (std::abs(got[k].x - expected[k].x) > 0.5f * precision + 1e-4f || std::abs(got[k].y - expected[k].y) > 0.5f * precision + 1e-4f ||
+	std::abs(got[k].z - expected[k].z) > 0.5f * precision + 1e-4f || std::abs(got[k].qw - expected[k].qw) > 1e-4f ||
+	std::abs(got[k].qx - expected[k].qx) > 1e-4f || std::abs(got[k].qy - expected[k].qy) > 1e-4f || std::abs(got[k].qz - expected[k].qz) > 1e-4f) return false;
+  }
+  return true;
+}
+
+/*
+ * Poll until the viewer shows what the engine
+ * holds, or give up after a couple of seconds.
+ */
+static bool catch_up(StreamClient &client, Engine &viewer, const Engine &engine, const float precision) {
+  for (int attempt = 0; attempt < 2000; ++attempt) {
+    if (client.poll(viewer, false)) return false;
+    if (matches(viewer, engine, precision)) return true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return false;
+}
+
+TEST_CASE("Viewers see the streamed world to their precision", "[stream]") {
+  char file_name[]{"tests/cli_jsons/general.json"};
+  Config config(file_name);
+  REQUIRE(config.initialize() == 0);
+  Engine engine(config);
+  for (int tick = 0; tick < 10; ++tick) engine.update(0.01f);
+
+  StreamServer server;
+  REQUIRE(server.open(0) == 0);
+  StreamClient client;
+  REQUIRE(client.connect("localhost", std::to_string(static_cast<unsigned int>(server.get_port())), 0.0f, 0.01f) == 0);
+
+  std::string init_bytes;
+  {
+    Publishing publishing(server, engine);
+    REQUIRE(client.read_init(init_bytes) == 0);
+  }
+  std::istringstream init(init_bytes);
+  Engine viewer(init);
+  REQUIRE(viewer.get_num_bodies() == engine.get_num_bodies());
+  REQUIRE(viewer.get_colliders().size() == engine.get_colliders().size());
+  REQUIRE(viewer.get_boundary()[1] == engine.get_boundary()[1]);
+
+  {
+    Publishing publishing(server, engine);
+    REQUIRE(client.poll(viewer, true) == 0);
+    REQUIRE(catch_up(client, viewer, engine, 0.01f));
+    REQUIRE(server.get_num_viewers() == 1);
+  }
+
+  /*
+   * Later frames only carry differences, and
+   * new bodies send the scene again.
+   */
+  for (int tick = 0; tick < 10; ++tick) engine.update(0.01f);
+  std::vector<unsigned int> new_ids;
+  REQUIRE(engine.add_bodies({ConfigSphere{50.0f, 50.0f, 50.0f, 0.0f, 0.0f, 0.0f, 1.0f, 2.0f}}, new_ids) == 0);
+  {
+    Publishing publishing(server, engine);
+    REQUIRE(catch_up(client, viewer, engine, 0.01f));
+  }
+  REQUIRE(viewer.get_num_bodies() == engine.get_num_bodies());
+}
+
+TEST_CASE("Slow viewers don't hold up the engine", "[stream]") {
+  char file_name[]{"tests/cli_jsons/general.json"};
+  Config config(file_name);
+  REQUIRE(config.initialize() == 0);
+  Engine engine(config);
+  std::vector<ConfigSphere> bodies;
+  for (int i = 0; i < 100000; ++i) bodies.push_back(ConfigSphere{static_cast<float>(i % 100), static_cast<float>(i / 100 % 100), static_cast<float>(i / 10000), 1.0f, 0.0f, 0.0f, 1.0f, 0.1f});
+  std::vector<unsigned int> new_ids;
+  REQUIRE(engine.add_bodies(bodies, new_ids) == 0);
+
+  StreamServer server;
+  REQUIRE(server.open(0) == 0);
+  StreamClient client;
+  REQUIRE(client.connect("localhost", std::to_string(static_cast<unsigned int>(server.get_port())), 0.0f, 0.001f) == 0);
+
+  /*
+   * The viewer doesn't read anything while the
+   * engine runs, so its socket fills up, but
+   * the engine keeps going.
+   */
+  for (int tick = 0; tick < 100; ++tick) {
+    engine.update(0.01f);
+    server.publish(engine);
+  }
+  REQUIRE(server.get_num_viewers() == 1);
+
+  std::string init_bytes;
+  REQUIRE(client.read_init(init_bytes) == 0);
+  std::istringstream init(init_bytes);
+  Engine viewer(init);
+  Publishing publishing(server, engine);
+  REQUIRE(catch_up(client, viewer, engine, 0.001f));
+}
+
+TEST_CASE("Viewers need a server to connect to", "[stream]") {
+  StreamClient client;
+  REQUIRE(client.connect("localhost", "0", 60.0f, 0.001f) == -1);
+  REQUIRE(client.connect("localhost", "1234", 60.0f, 0.0f) == -1);
+}
+
+/*
+ * A server that greets one viewer with the
+ * given bytes and hangs up.
+ */
+static void serve_bytes(const int listen_fd, const std::string bytes) {
+  const int fd = accept(listen_fd, nullptr, nullptr);
+  StreamHello hello;
+  recv(fd, &hello, sizeof(hello), MSG_WAITALL);
+  send(fd, bytes.data(), bytes.size(), MSG_NOSIGNAL);
+  close(fd);
+}
+
+static std::string message(const char type, const std::uint64_t length, const std::string& payload) {
+  std::string bytes(1, type);
+  bytes.append(reinterpret_cast<const char*>(&length), sizeof(length));
+  return bytes + payload;
+}
+
+TEST_CASE("Viewers reject malformed lengths and body counts", "[stream]") {
+  char file_name[]{"tests/cli_jsons/general.json"};
+  Config config(file_name);
+  REQUIRE(config.initialize() == 0);
+  Engine engine(config);
+  std::ostringstream init;
+  engine.write_init(init);
+
+  const int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  REQUIRE(bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+  REQUIRE(listen(listen_fd, 1) == 0);
+  socklen_t address_size = sizeof(address);
+  REQUIRE(getsockname(listen_fd, reinterpret_cast<sockaddr*>(&address), &address_size) == 0);
+  const std::string port = std::to_string(static_cast<unsigned int>(ntohs(address.sin_port)));
+
+  {
+    std::thread server(serve_bytes, listen_fd, message('I', std::uint64_t{1} << 62, ""));
+    StreamClient client;
+    REQUIRE(client.connect("127.0.0.1", port, 0.0f, 0.01f) == 0);
+    std::string init_bytes;
+    REQUIRE(client.read_init(init_bytes) == -1);
+    server.join();
+  }
+
+  /*
+   * A frame claiming far more bodies than the
+   * scene has.
+   */
+  const std::uint64_t frame_header[2] = {1, std::uint64_t{1} << 40};
+  const std::string frame(reinterpret_cast<const char*>(frame_header), sizeof(frame_header));
+  {
+    std::thread server(serve_bytes, listen_fd, message('I', init.str().size(), init.str()) + message('F', frame.size(), frame));
+    StreamClient client;
+    REQUIRE(client.connect("127.0.0.1", port, 0.0f, 0.01f) == 0);
+    std::string init_bytes;
+    REQUIRE(client.read_init(init_bytes) == 0);
+    std::istringstream viewer_init(init_bytes);
+    Engine viewer(viewer_init);
+    REQUIRE(client.poll(viewer, true) == -1);
+    server.join();
+  }
+
+  /*
+   * A scene claiming far more bodies than its
+   * colliders could fill. The viewer keeps the
+   * scene it had.
+   */
+  std::string huge_init = init.str();
+  const std::uint64_t huge_count = std::uint64_t{1} << 40;
+  memcpy(&huge_init[8 + sizeof(std::uint32_t) + sizeof(std::size_t)], &huge_count, sizeof(huge_count));
+  {
+    std::thread server(serve_bytes, listen_fd, message('I', init.str().size(), init.str()) + message('I', huge_init.size(), huge_init));
+    StreamClient client;
+    REQUIRE(client.connect("127.0.0.1", port, 0.0f, 0.01f) == 0);
+    std::string init_bytes;
+    REQUIRE(client.read_init(init_bytes) == 0);
+    std::istringstream viewer_init(init_bytes);
+    Engine viewer(viewer_init);
+    REQUIRE(client.poll(viewer, true) == -1);
+    REQUIRE(viewer.get_num_bodies() == engine.get_num_bodies());
+    REQUIRE(viewer.get_colliders().size() == engine.get_num_bodies());
+    server.join();
+  }
+  close(listen_fd);
+}
@@ -0,0 +1,83 @@
+/*  This file is part of Hummingbird.
+    Hummingbird is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+    Hummingbird is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with Hummingbird. If not, see <https://www.gnu.org/licenses/>.  */
+
+#include "catch2/catch.hpp"
+
+#include "../include/sweep.h"
+
+#include <sstream>
+#include <string>
+
+TEST_CASE("Sweep runs every combination of parameters", "[sweep]") {
+  char file_name[]{"tests/cli_jsons/sweep.json"};
+  Sweep sweep(file_name);
+  REQUIRE(sweep.initialize() == 0);
+  REQUIRE(sweep.get_num_runs() == 6);
+  REQUIRE(sweep.run() == 0);
+
+  /*
+   * Keys are swept in alphabetical order, so
+   * ELASTICITY changes slowest. Bodies fall
+   * freely for 0.1 seconds, so every body ends
+   * up with speed 0.1 * GRAVITY.
+   */
+  const float gravities[3] = {1.0f, 2.0f, 4.0f};
+  for (std::size_t run = 0; run < 6; ++run) {
+    const SweepSummary &summary = sweep.get_summaries()[run];
+    const double speed = 0.1 * gravities[run % 3];
+    REQUIRE(summary.max_speed == Approx(speed));
+    REQUIRE(summary.kinetic_energy == Approx(0.5 * 10.0 * speed * speed));
+    REQUIRE(summary.com_x == Approx(59.0));
+    REQUIRE(summary.com_y < 63.0);
+    REQUIRE(summary.com_z == Approx(50.0));
+  }
+  REQUIRE(sweep.get_summaries()[0].com_y > sweep.get_summaries()[1].com_y);
+  REQUIRE(sweep.get_summaries()[1].com_y > sweep.get_summaries()[2].com_y);
+  REQUIRE(sweep.get_summaries()[2].com_y == sweep.get_summaries()[5].com_y);
+
+  std::ostringstream csv;
+  sweep.write_csv(csv);
+  std::istringstream lines(csv.str());
+  std::string line;
+  std::getline(lines, line);
+  REQUIRE(line == "run,ELASTICITY,GRAVITY,kinetic_energy,com_x,com_y,com_z,max_speed,seconds");
+  std::getline(lines, line);
+  REQUIRE(line.rfind("0,0.5,1,", 0) == 0);
+  std::size_t num_lines = 1;
+  while (std::getline(lines, line)) ++num_lines;
+  REQUIRE(num_lines == 6);
+}
+
+TEST_CASE("Sweep needs a SWEEP object", "[sweep]") {
+  char file_name[]{"tests/cli_jsons/general.json"};
+  Sweep sweep(file_name);
+  REQUIRE(sweep.initialize() == -1);
+}
+
+TEST_CASE("Sweep runs share one scene without a SEED", "[sweep]") {
+  char file_name[]{"tests/cli_jsons/sweep_random.json"};
+  Sweep sweep(file_name);
+  REQUIRE(sweep.initialize() == 0);
+  REQUIRE(sweep.run() == 0);
+  const SweepSummary &first = sweep.get_summaries()[0];
+  for (const auto &summary : sweep.get_summaries()) {
+    REQUIRE(summary.com_x == first.com_x);
+    REQUIRE(summary.com_y == first.com_y);
+    REQUIRE(summary.com_z == first.com_z);
+  }
+}
+
+TEST_CASE("Sweep values must be plain values", "[sweep]") {
+  char file_name[]{"tests/cli_jsons/sweep_array.json"};
+  Sweep sweep(file_name);
+  REQUIRE(sweep.initialize() == -1);
+}